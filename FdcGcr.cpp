@@ -19,6 +19,7 @@
 #include <string.h>
 #include <stdio.h>
 #include "FdcGcr.h"
+#include "archdep.h"
 
 const unsigned int NUM_SYNC=5;
 // this should be speed zone dependent
@@ -29,6 +30,8 @@ const unsigned int GCR_SECTOR_SIZE = NUM_SYNC+10+9+NUM_SYNC+325+GCR_SECTOR_GAP_L
 const unsigned int GCR_MAX_TRACK_SIZE = 4000000 / 8 / 13 / 5 * 10307 / 10000;//GCR_SECTOR_SIZE * 21;
 // Total GCR encoded data size
 const unsigned int GCR_DISK_SIZE = GCR_MAX_TRACK_SIZE * MAX_NUM_TRACKS;
+// G64 images with all the half tracks fit
+const unsigned int MAX_IMAGE_FILE_SIZE = 0x100000;
 
 // Nr of sectors on each track
 const unsigned int d64NumOfSectors[MAX_NUM_TRACKS+1] = {
@@ -80,12 +83,67 @@ const unsigned int speed_zone[MAX_NUM_TRACKS+1] = {
 	0,0,0,0,0,0 // 36-41
 };
 
-unsigned int FdcGcr::sectorSize[MAX_NUM_TRACKS+1];
+unsigned int GcrDisk::sectorSize[MAX_NUM_TRACKS+1];
+unsigned short GcrDisk::gcrEncodeTable[256];
+unsigned char GcrDisk::gcrDecodeTable[1024];
+unsigned int FdcGcr::flushInterval = 2;
+rvar_t FdcGcr::fdcSettings[2] = {
+	{ "Disk write-back interval", "DiskFlushInterval", FdcGcr::flipFlushInterval, &FdcGcr::flushInterval, RVAR_INT, NULL },
+	{ "", "", NULL, NULL, RVAR_NULL, NULL }
+};
+
+void FdcGcr::flipFlushInterval(void *)
+{
+	const unsigned int intervals[] = { 1, 2, 5, 10, 30 };
+	unsigned int i = 0;
+
+	while (i < 4 && intervals[i] != flushInterval)
+		i++;
+	flushInterval = intervals[(i + 1) % 5];
+}
+
+GcrDisk::GcrDisk()
+{
+	imageData = NULL;
+	imageSize = 0;
+	isImageMapped = false;
+	for (unsigned int i = 0; i <= MAX_NUM_TRACKS; i++) {
+		trackEncoded[i] = true;
+		trackDirty[i] = false;
+		trackLength[i] = sectorSize[i];
+		g64TrackOffset[i] = 0;
+	}
+	hasDirtyTracks = false;
+	imageName[0] = 0;
+	imageType = DISK_D64;
+	diskImageHeaderSize = 0;
+	NrOfTracks = 35;
+	NrOfSectors = 0;
+	gcrData = NULL;
+	isDiskInserted = false;
+	isImageWriteProtected = false;
+	isDiskCorrupted = false;
+	isImageChanged = false;
+}
 
 FdcGcr::FdcGcr()
 {
 	setId("FDC8");
-	diskImageHandle = NULL;
+	initGcrTables();
+	// G64 tracks are indexed from 1
+	pendingData = new unsigned char[GCR_DISK_SIZE + GCR_MAX_TRACK_SIZE];
+	memset(pendingBlock, 0, sizeof(pendingBlock));
+	pendingCount = 0;
+	flushLock = SDL_CreateMutex();
+	flushWake = SDL_CreateSemaphore(0);
+	flushThread = NULL;
+	flushQuit = false;
+	setDisks = 0;
+	setCurrent = 0;
+	setInserted = false;
+	setLock = SDL_CreateMutex();
+	setThread = NULL;
+	setQuit = false;
 
 	gcrData = gcrPtr = gcrTrackBegin = new unsigned char[GCR_DISK_SIZE];
 	gcrTrackEnd = gcrTrackBegin + GCR_MAX_TRACK_SIZE;
@@ -102,15 +160,24 @@ FdcGcr::FdcGcr()
 		// 300 rotation per min, 5 per sec
 		sectorSize[i] = 4000000 / (16 - speed_zone[i]) / 8 / 5;
 	}
+	for (unsigned int i = 0; i <= MAX_NUM_TRACKS; i++) {
+		trackLength[i] = sectorSize[i];
+		g64TrackOffset[i] = 0;
+	}
 	NrOfTracks = 35;
 }
 
 FdcGcr::~FdcGcr()
 {
+	closeDiskSet();
 	closeDiskImage();
 	isDiskInserted = false;
 	if (gcrData)
 		delete[] gcrData;
+	delete[] pendingData;
+	SDL_DestroySemaphore(flushWake);
+	SDL_DestroyMutex(flushLock);
+	SDL_DestroyMutex(setLock);
 }
 
 void FdcGcr::dumpState()
@@ -124,6 +191,8 @@ void FdcGcr::dumpState()
 	saveVar(&gcrCurrentBitcount, sizeof(gcrCurrentBitcount));
 	saveVar(&gcrCurrentBitRate, sizeof(gcrCurrentBitRate));
 	saveVar(&currentHalfTrack, sizeof(currentHalfTrack));
+	// the snapshot holds the whole disk
+	disk2gcr();
 	saveVar(gcrData, GCR_DISK_SIZE);
 	tmp = (unsigned int) (gcrPtr - gcrData);
 	saveVar(&tmp, sizeof(tmp));
@@ -160,6 +229,8 @@ void FdcGcr::readState()
 	readVar(&gcrCurrentBitRate, sizeof(gcrCurrentBitRate));
 	readVar(&currentHalfTrack, sizeof(currentHalfTrack));
 	readVar(gcrData, GCR_DISK_SIZE);
+	for (unsigned int i = 0; i <= MAX_NUM_TRACKS; i++)
+		trackEncoded[i] = true;
 	readVar(&tmp, sizeof(tmp));
 	gcrPtr = tmp + gcrData;
 	readVar(&tmp, sizeof(tmp));
@@ -178,14 +249,85 @@ void FdcGcr::readState()
 	readVar(&isImageChanged, sizeof(isImageChanged));
 	readVar(&writeMode, sizeof(writeMode));
 	readVar(&spinFactor, sizeof(spinFactor));
+	// a changed disk is written back as a whole on detach
+	for (unsigned int i = 0; i <= MAX_NUM_TRACKS; i++)
+		trackDirty[i] = isImageChanged;
+	hasDirtyTracks = isImageChanged;
+	for (unsigned int i = 0; i <= MAX_NUM_TRACKS; i++) {
+		trackLength[i] = sectorSize[i];
+		g64TrackOffset[i] = 0;
+	}
+	if (DISK_G64 == imageType && loadImage(imageName)) {
+		const unsigned int tracks = NrOfTracks;
+		readG64TrackTable();
+		releaseImage();
+		NrOfTracks = tracks;
+	}
+	diskImageHeaderSize = 0;
+	FILE *fp = fopen(imageName, "rb");
+	if (fp) {
+		unsigned char magic[4];
+		if (fread(magic, 4, 1, fp) == 1 && magic[0] == 0x43 && magic[1] == 0x15 && magic[2] == 0x41 && magic[3] == 0x64)
+			diskImageHeaderSize = 64;
+		fclose(fp);
+	}
 }
 
 void FdcGcr::openDiskImage(const char *filepath)
 {
+	closeDiskSet();
 	closeDiskImage();
-	attachD64file(filepath);
-	imageType = DISK_D64;
+	if (openImageFile(filepath))
+		attachImage();
 	strcpy(imageName, filepath);
+	if (isDiskInserted)
+		startFlusher();
+}
+
+/*
+	Images from memory (like archive members) have no file to write back to
+	so they are inserted write protected.
+*/
+void FdcGcr::openDiskImage(const unsigned char *data, size_t size, const char *name)
+{
+	closeDiskSet();
+	closeDiskImage();
+	if (size && size <= MAX_IMAGE_FILE_SIZE) {
+		imageData = new unsigned char[size];
+		memcpy(imageData, data, size);
+		imageSize = size;
+		isImageMapped = false;
+		isImageWriteProtected = true;
+		isDiskInserted = false;
+		attachImage();
+	}
+	strncpy(imageName, name, sizeof(imageName) - 1);
+	imageName[sizeof(imageName) - 1] = 0;
+}
+
+void FdcGcr::attachImage()
+{
+	if (parseImage()) {
+		encodeTrack(currentHalfTrack >> 1);
+		isDiskSwapped = true;
+	}
+}
+
+bool GcrDisk::parseImage()
+{
+	// G64 images are told by their signature
+	if (imageSize >= 8 && !memcmp(imageData, "GCR-1541", 8)) {
+		imageType = DISK_G64;
+		isDiskInserted = attachG64file();
+	} else {
+		imageType = DISK_D64;
+		isDiskInserted = attachD64file();
+	}
+	if (isDiskInserted) {
+		isImageChanged = false;
+		isDiskCorrupted = false;
+	}
+	return isDiskInserted;
 }
 
 void FdcGcr::reset()
@@ -196,46 +338,93 @@ void FdcGcr::reset()
 
 void FdcGcr::closeDiskImage()
 {
-	if (diskImageHandle != NULL) {
-		fflush(diskImageHandle);
-		fclose(diskImageHandle);
-		diskImageHandle = NULL;
-	}
 	// check if images has changed and save
-	if (isDiskInserted && !isDiskCorrupted && isImageChanged) {
-		if(DISK_D64 == imageType)
-			gcr2disk();
-	}
+	if (isDiskInserted && !isDiskCorrupted && isImageChanged && hasDirtyTracks)
+		queueDirtyTracks();
+	stopFlusher();
+	releaseImage();
 	strcpy(imageName, "");
 	// Clear GCR buffer with gaps to avoid read errors later
 	memset(gcrData, 0x55, GCR_DISK_SIZE);
+	for (unsigned int i = 0; i <= MAX_NUM_TRACKS; i++) {
+		trackEncoded[i] = true;
+		trackLength[i] = sectorSize[i];
+		g64TrackOffset[i] = 0;
+	}
 
 	isDiskInserted = false;
 }
 
-void FdcGcr::attachD64file(const char *filepath)
+bool GcrDisk::openImageFile(const char *filepath)
+{
+	// Try opening the file as R/W to see if it is write protected
+	FILE *fp = fopen(filepath, "rb+");
+	isImageWriteProtected = (fp == NULL);
+	if (fp)
+		fclose(fp);
+	if (!isImageWriteProtected)
+		replayJournal(filepath);
+	isDiskInserted = false;
+	return loadImage(filepath);
+}
+
+/*
+	The image is mapped into memory, or read if that fails, so attaching
+	costs no more than opening the file.
+*/
+bool GcrDisk::loadImage(const char *filepath)
+{
+	imageData = ad_map_file(filepath, imageSize);
+	isImageMapped = imageData != NULL;
+	if (isImageMapped)
+		return true;
+
+	FILE *fp = fopen(filepath, "rb");
+	if (!fp)
+		return false;
+	fseek(fp, 0, SEEK_END);
+	long size = ftell(fp);
+	if (size <= 0 || size > (long) MAX_IMAGE_FILE_SIZE) {
+		fclose(fp);
+		return false;
+	}
+	imageSize = (size_t) size;
+	imageData = new unsigned char[imageSize];
+	fseek(fp, 0, SEEK_SET);
+	size_t r = fread(imageData, 1, imageSize, fp);
+	fclose(fp);
+	if (r != imageSize) {
+		releaseImage();
+		return false;
+	}
+	return true;
+}
+
+void GcrDisk::releaseImage()
+{
+	if (imageData) {
+		if (isImageMapped)
+			ad_unmap_file(imageData, imageSize);
+		else
+			delete[] imageData;
+		imageData = NULL;
+	}
+	imageSize = 0;
+	isImageMapped = false;
+}
+
+bool GcrDisk::attachD64file()
 {
 	unsigned long size;
-	unsigned char magic[4];
 	unsigned char bam[256];
 
-	// Try opening the file as R/W, then for read only if it failed
-	isImageWriteProtected = false;
-	diskImageHandle = fopen(filepath, "rb+");
-	if (diskImageHandle == NULL) {
-		isImageWriteProtected = true;
-		diskImageHandle = fopen(filepath, "rb");
-	}
-	if (diskImageHandle != NULL) {
+	if (imageData) {
 
-		fseek(diskImageHandle, 0, SEEK_END);
-		size = ftell(diskImageHandle);
+		size = (unsigned long) imageSize;
 		// Check length
 		if ( (size < MIN_d64NumOfSectors * 256) || (size > MAX_d64NumOfSectors * 257) ) {
-			fclose(diskImageHandle);
-			diskImageHandle = NULL;
-			isDiskInserted = false;
-			return;
+			releaseImage();
+			return false;
 		}
 
 		switch (size) {
@@ -272,9 +461,7 @@ void FdcGcr::attachD64file(const char *filepath)
 	//	Log::write(_T("Number of sectors: %i.\n"), NrOfSectors);
 
 		// x64 image?
-		fseek(diskImageHandle, 0, SEEK_SET);
-		fread(&magic, 4, 1, diskImageHandle);
-		if (magic[0] == 0x43 && magic[1] == 0x15 && magic[2] == 0x41 && magic[3] == 0x64)
+		if (imageData[0] == 0x43 && imageData[1] == 0x15 && imageData[2] == 0x41 && imageData[3] == 0x64)
 			diskImageHeaderSize = 64;
 		else
 			diskImageHeaderSize = 0;
@@ -285,30 +472,94 @@ void FdcGcr::attachD64file(const char *filepath)
 		// Load sector error info from .d64 file, if available
 		if (!diskImageHeaderSize && size == NrOfSectors * 257) {
 //			Log::write(_T("Sector error info found.\n"));
-			fseek(diskImageHandle, NrOfSectors * 256, SEEK_SET);
-			fread(&diskErrorInfo, NrOfSectors, 1, diskImageHandle);
+			memcpy(diskErrorInfo, imageData + NrOfSectors * 256, NrOfSectors);
 		}
 
 		// Read BAM and get ID
 		if (!readSector(18, 0, bam)) {
 			isDiskCorrupted = true;
-		} else {
-			id1 = bam[162];
-			id2 = bam[163];
-			// Create GCR encoded disk data from image
-			disk2gcr();
-			// indicate that the disk is present
-			isDiskInserted = true;
-			isImageChanged = false;
-			isDiskCorrupted = false;
-			isDiskSwapped = true;
+			return false;
 		}
-		return;
+		id1 = bam[162];
+		id2 = bam[163];
+		// GCR data is built track by track as the head gets there
+		for (unsigned int i = 0; i <= MAX_NUM_TRACKS; i++) {
+			trackEncoded[i] = false;
+			trackDirty[i] = false;
+			trackLength[i] = sectorSize[i];
+			g64TrackOffset[i] = 0;
+		}
+		hasDirtyTracks = false;
+		return true;
 	}
-	isDiskInserted = false;
+	return false;
 }
 
-bool FdcGcr::readSector(int track, int sector, unsigned char *buffer)
+static inline unsigned int readLE32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24);
+}
+
+/*
+	Track and speed zone tables of a G64 image. Only the full tracks are
+	emulated, speed maps per bit cell fall back to the zone of the track.
+*/
+bool GcrDisk::readG64TrackTable()
+{
+	if (imageSize < 12 || memcmp(imageData, "GCR-1541", 8) || imageData[8] != 0)
+		return false;
+	const unsigned int halfTracks = imageData[9];
+	if (12 + halfTracks * 8 > imageSize)
+		return false;
+
+	NrOfTracks = 0;
+	for (unsigned int track = 1; track <= MAX_NUM_TRACKS; track++) {
+		const unsigned int halfTrack = (track - 1) * 2;
+		unsigned int offset = 0;
+		unsigned int zone = speed_zone[track];
+		if (halfTrack < halfTracks) {
+			offset = readLE32(imageData + 12 + halfTrack * 4);
+			const unsigned int z = readLE32(imageData + 12 + (halfTracks + halfTrack) * 4);
+			if (z < 4)
+				zone = z;
+		}
+		g64TrackOffset[track] = 0;
+		// empty tracks get the nominal size of their zone
+		trackLength[track] = 4000000 / (16 - zone) / 8 / 5;
+		if (offset && offset + 2 <= imageSize) {
+			const unsigned int length = imageData[offset] | (imageData[offset + 1] << 8);
+			if (length && length <= GCR_MAX_TRACK_SIZE && offset + 2 + length <= imageSize) {
+				g64TrackOffset[track] = offset;
+				trackLength[track] = length;
+				NrOfTracks = track;
+			}
+		}
+	}
+	return NrOfTracks != 0;
+}
+
+/*
+	G64 images hold the GCR data as is, a track is copied into its buffer
+	when the head first gets there with no encoding, and written back into
+	the same slot.
+*/
+bool GcrDisk::attachG64file()
+{
+	if (!readG64TrackTable()) {
+		fprintf(stderr, "Invalid G64 image.\n");
+		releaseImage();
+		return false;
+	}
+	diskImageHeaderSize = 0;
+	for (unsigned int i = 0; i <= MAX_NUM_TRACKS; i++) {
+		trackEncoded[i] = false;
+		trackDirty[i] = false;
+	}
+	hasDirtyTracks = false;
+	return true;
+}
+
+bool GcrDisk::readSector(int track, int sector, unsigned char *buffer)
 {
 	int offset;
 
@@ -316,10 +567,11 @@ bool FdcGcr::readSector(int track, int sector, unsigned char *buffer)
 	if ((offset = offsetFromTS(track, sector)) < 0)
 		return false;
 
-	fseek(diskImageHandle, offset + diskImageHeaderSize, SEEK_SET);
-
-	size_t r = fread(buffer, 1, 256, diskImageHandle);
-	return r == 256;
+	offset += diskImageHeaderSize;
+	if (!imageData || offset + 256 > (int) imageSize)
+		return false;
+	memcpy(buffer, imageData + offset, 256);
+	return true;
 }
 
 void FdcGcr::trackSector(unsigned int &track, unsigned int &sector)
@@ -332,12 +584,12 @@ void FdcGcr::trackSector(unsigned int &track, unsigned int &sector)
    Convert track/sector to offset
 */
 
-unsigned int FdcGcr::secnumFromTS(unsigned int track, unsigned int sector)
+unsigned int GcrDisk::secnumFromTS(unsigned int track, unsigned int sector)
 {
 	return d64SectorOffset[track] + sector;
 }
 
-int FdcGcr::offsetFromTS(unsigned int track, unsigned int sector)
+int GcrDisk::offsetFromTS(unsigned int track, unsigned int sector)
 {
 	if ((track < 1) || (track > MAX_NUM_TRACKS) || (sector >= d64NumOfSectors[track]))
 		return -1;
@@ -358,55 +610,38 @@ const unsigned int tblDecodeFromGCR[32] = {
     0, 0, 2, 3, 0,15, 6, 7,  0, 9,10,11, 0,13,14, 0
 };
 
-void FdcGcr::gcrConv4bytesTo5(unsigned char *from, unsigned char *to)
+// whole bytes are looked up instead of nybbles
+void GcrDisk::initGcrTables()
 {
-	unsigned int g;
-
-	g = (tblEncodeToGCR[*from >> 4] << 5) | tblEncodeToGCR[*from & 15];
-	*to++ = g >> 2;
-	*to = (g << 6) & 0xC0;
-	from++;
-
-	g = (tblEncodeToGCR[*from >> 4] << 5) | tblEncodeToGCR[*from & 15];
-	*to++ |= (g >> 4) & 0x3F;
-	*to = (g << 4) & 0xF0;
-	from++;
-
-	g = (tblEncodeToGCR[*from >> 4] << 5) | tblEncodeToGCR[*from & 15];
-	*to++ |= (g >> 6) & 0x0F;
-	*to = (g << 2) & 0xFC;
-	from++;
+	for (unsigned int i = 0; i < 256; i++)
+		gcrEncodeTable[i] = (unsigned short) ((tblEncodeToGCR[i >> 4] << 5) | tblEncodeToGCR[i & 15]);
+	for (unsigned int i = 0; i < 1024; i++)
+		gcrDecodeTable[i] = (unsigned char) ((tblDecodeFromGCR[i >> 5] << 4) | tblDecodeFromGCR[i & 31]);
+}
 
-	g = (tblEncodeToGCR[*from >> 4] << 5) | tblEncodeToGCR[*from & 15];
-	*to++ |= (g >> 8) & 0x03;
-	*to = (unsigned char) g;
+void GcrDisk::gcrConv4bytesTo5(unsigned char *from, unsigned char *to)
+{
+	const unsigned int g0 = gcrEncodeTable[from[0]];
+	const unsigned int g1 = gcrEncodeTable[from[1]];
+	const unsigned int g2 = gcrEncodeTable[from[2]];
+	const unsigned int g3 = gcrEncodeTable[from[3]];
+
+	to[0] = (unsigned char) (g0 >> 2);
+	to[1] = (unsigned char) ((g0 << 6) | (g1 >> 4));
+	to[2] = (unsigned char) ((g1 << 4) | (g2 >> 6));
+	to[3] = (unsigned char) ((g2 << 2) | (g3 >> 8));
+	to[4] = (unsigned char) g3;
 }
 
 void FdcGcr::gcrConv5bytesTo4(unsigned char *buffer, unsigned char *ptr)
 {
-    unsigned int i;
-    unsigned char gcr_bytes[8];
-
-    gcr_bytes[0] = (*buffer)>>3;
-    gcr_bytes[1] =((*buffer++)&0x07)<<2;
-    gcr_bytes[1] |=(*buffer)>>6;
-    gcr_bytes[2] =((*buffer)&0x3E)>>1;
-    gcr_bytes[3] =((*buffer++)&0x01)<<4;
-    gcr_bytes[3]|=((*buffer)&0xF0)>>4;
-    gcr_bytes[4] =((*buffer++)&0x0F)<<1;
-    gcr_bytes[4] |=(*buffer)>>7;
-    gcr_bytes[5] =((*buffer)&0x7C)>>2;
-    gcr_bytes[6] =((*buffer++)&0x03)<<3;
-    gcr_bytes[6]|=((*buffer)&0xE0)>>5;
-    gcr_bytes[7] = (*buffer)&0x1F;
-
-    for (i = 0; i < 4; i++, ptr++) {
-        *ptr = tblDecodeFromGCR[gcr_bytes[2 * i]] << 4;
-        *ptr |= tblDecodeFromGCR[gcr_bytes[2 * i + 1]];
-    }
+	ptr[0] = gcrDecodeTable[(buffer[0] << 2) | (buffer[1] >> 6)];
+	ptr[1] = gcrDecodeTable[((buffer[1] & 0x3F) << 4) | (buffer[2] >> 4)];
+	ptr[2] = gcrDecodeTable[((buffer[2] & 0x0F) << 6) | (buffer[3] >> 2)];
+	ptr[3] = gcrDecodeTable[((buffer[3] & 0x03) << 8) | buffer[4]];
 }
 
-void FdcGcr::sector2gcr(int track, int sector)
+void GcrDisk::sector2gcr(int track, int sector)
 {
 	unsigned char block[256];
 	unsigned char buf[4], headerID1;
@@ -508,12 +743,33 @@ void FdcGcr::dumpGcr(unsigned char *p)
 	fclose( gcrdump );
 }
 
-void FdcGcr::disk2gcr(void)
+// GCR encode a track of the image the first time it is needed
+void GcrDisk::encodeTrack(unsigned int track)
+{
+	if (track > MAX_NUM_TRACKS || trackEncoded[track])
+		return;
+	trackEncoded[track] = true;
+	if (!imageData)
+		return;
+	if (DISK_G64 == imageType) {
+		if (g64TrackOffset[track])
+			memcpy(gcrData + (track - 1) * GCR_MAX_TRACK_SIZE, imageData + g64TrackOffset[track] + 2,
+				trackLength[track]);
+		return;
+	}
+	// tracks beyond the image stay empty
+	if ((d64SectorOffset[track] + d64NumOfSectors[track]) * 256
+		+ diskImageHeaderSize > imageSize)
+		return;
+	for (unsigned int sector = 0; sector < d64NumOfSectors[track]; sector++)
+		sector2gcr(track, sector);
+}
+
+void GcrDisk::disk2gcr(void)
 {
 	// Convert all tracks and sectors
-	for ( unsigned int track=1; track<=NrOfTracks; track++)
-		for( unsigned int sector=0; sector<d64NumOfSectors[track]; sector++)
-			sector2gcr(track, sector);
+	for ( unsigned int track=1; track<=MAX_NUM_TRACKS; track++)
+		encodeTrack(track);
 #if 0
 	dumpGcr(gcrData);
 #endif
@@ -567,81 +823,493 @@ unsigned char *FdcGcr::getSectorHeaderOffset(unsigned int track, unsigned int se
     return NULL;
 }
 
-void FdcGcr::gcr2disk(void)
+/*
+	Decode a sector from the GCR data of its track, false if it cannot be found
+*/
+bool FdcGcr::decodeSector(unsigned int track, unsigned int sector, unsigned char *buffer)
 {
-	FILE			*d64dump;
-	char			new_d64_file[266];
-	unsigned char	*offset;
-	unsigned char	sector_buffer[260];
+	unsigned char *trackStart = gcrData + (track - 1) * GCR_MAX_TRACK_SIZE;
+	unsigned char *trackEnd = trackStart + trackLength[track];
+	unsigned char sector_buffer[260];
+	unsigned char *offset = getSectorHeaderOffset(track, sector, trackStart, trackEnd);
 
-	strcpy( new_d64_file, imageName);
+	if (NULL == offset)
+		return false;
 
-	d64dump = fopen( const_cast<char*> (new_d64_file), "wb");
-	if (!d64dump)
+	int header = 0;
+	// seek data header
+	while (*offset != 0xFF) {
+		offset++;
+		if (offset == trackEnd)
+			offset = trackStart;
+		if (++header >= 10000)
+			return false;
+	}
+	// seek sector data
+	bool fullyRotated = false;
+	while (*offset == 0xFF) { // data mark (0x07) in GCR (0x55)
+		offset++;
+		if (offset == trackEnd) {
+			if (fullyRotated)
+				return false;
+			offset = trackStart;
+			fullyRotated = true;
+		}
+	}
+	// convert to 260 bytes
+	gcr2sector(sector_buffer, offset, trackStart, trackEnd);
+	if (sector_buffer[0] != 0x07)
+		return false;
+	memcpy(buffer, sector_buffer + 1, 256);
+	return true;
+}
+
+/*
+	Decode the tracks written since the last call and hand the sectors, or
+	the tracks themselves for G64 images, over to the flusher. Only runs on
+	the emulation thread, as that is the one writing the GCR data.
+*/
+void FdcGcr::queueDirtyTracks()
+{
+	hasDirtyTracks = false;
+	if (!isDiskInserted || isImageWriteProtected)
 		return;
 
-	// Convert all tracks and sectors
-	for ( unsigned int track = 1; track<=NrOfTracks; track ++) { // NUM_TRACKS
+	SDL_LockMutex(flushLock);
+	for (unsigned int track = 1; track <= MAX_NUM_TRACKS; track++) {
+		if (!trackDirty[track])
+			continue;
+		trackDirty[track] = false;
+		if (DISK_G64 == imageType) {
+			// the track goes back to its own slot
+			if (!g64TrackOffset[track]) {
+				fprintf(stderr, "Disk write-back: track %u has no room in the G64 image.\n", track);
+				continue;
+			}
+			memcpy(pendingBuffer(track), gcrData + (track - 1) * GCR_MAX_TRACK_SIZE, trackLength[track]);
+			queueBlock(track, g64TrackOffset[track] + 2, trackLength[track]);
+			continue;
+		}
+		if (track > NrOfTracks)
+			continue;
+		for (unsigned int sector = 0; sector < d64NumOfSectors[track]; sector++) {
+			const unsigned int secnum = secnumFromTS(track, sector);
+			if (decodeSector(track, sector, pendingBuffer(secnum)))
+				queueBlock(secnum, (secnum << 8) + diskImageHeaderSize, 256);
+			else
+				fprintf(stderr, "Disk write-back: track %u sector %u not found.\n", track, sector);
+		}
+	}
+	SDL_UnlockMutex(flushLock);
+	// no thread, no delay
+	if (!flushThread)
+		writePendingBlocks();
+}
 
-		unsigned char *trackStart	= gcrData + (track - 1) * GCR_MAX_TRACK_SIZE;
-		unsigned char *trackEnd	= trackStart + sectorSize[track];
-		//offset = trackStart;
+// flushLock must be held
+void FdcGcr::queueBlock(unsigned int block, unsigned int offset, unsigned int length)
+{
+	if (!pendingBlock[block])
+		pendingCount++;
+	pendingBlock[block] = true;
+	pendingOffset[block] = offset;
+	pendingLength[block] = length;
+}
 
-		for ( unsigned int sec = 0; sec<d64NumOfSectors[track]; sec++) {
-			offset = getSectorHeaderOffset( track, sec, trackStart, trackEnd);
+unsigned char *FdcGcr::pendingBuffer(unsigned int block)
+{
+	return pendingData + block * (DISK_G64 == imageType ? GCR_MAX_TRACK_SIZE : 256);
+}
 
-			if ( NULL == offset ) {
-//				Log::write(_T("Error dumping gcr data (illegal pointer) at track: %i, sector: %i.\n"),
-//					track, sec);
-				isDiskCorrupted = true;
-				fclose(d64dump);
-				return;
-			}
+// cut a journal back to the batches in front of a torn one
+static void truncateJournal(const char *journalName, long size)
+{
+	if (size <= 0) {
+		::remove(journalName);
+		return;
+	}
+	FILE *journal = fopen(journalName, "rb");
+	if (!journal)
+		return;
+	unsigned char *head = new unsigned char[size];
+	const bool ok = fread(head, size, 1, journal) == 1;
+	fclose(journal);
+	if (ok && (journal = fopen(journalName, "wb"))) {
+		fwrite(head, size, 1, journal);
+		ad_fsync(journal);
+		fclose(journal);
+	}
+	delete[] head;
+}
 
-			int header = 0;
-			// seek data header
-			while (*offset != 0xFF) {
-				offset++;
-				if (offset == trackEnd)
-					offset = trackStart;
-				header++;
-				if (header >= 10000) {
-//					Log::write(_T("Error dumping gcr data (no header) at track: %i, sector: %i.\n"),
-//						track, sec);
-					isDiskCorrupted = true;
-					fclose(d64dump);
-					return;
-				}
-			}
-			// seek sector data
-			bool fullyRotated = false;
-			while (*offset == 0xFF && !fullyRotated) { // data mark (0x07) in GCR (0x55)
-				offset++;
-				if (offset == trackEnd) {
-					if (!fullyRotated) {
-						offset = trackStart;
-						fullyRotated = true;
-					} else {
-	//					Log::write(_T("Error dumping gcr data (no data mark) at track: %i, sector: %i.\n"),
-				//			track, sec);
-						isDiskCorrupted = true;
-					}
-				}
+/*
+	Blocks go to a journal first that is synced before anything in the
+	image is touched, so a crash in between leaves either the old data
+	with a journal to replay or the new one. Batches that could not be
+	written to the image stay in the journal, later ones are appended
+	behind them and the image is only written once those went in first.
+	A batch that does not make it to the journal is queued again.
+*/
+void FdcGcr::writePendingBlocks()
+{
+	char journalName[280];
+	unsigned int count = 0;
+	unsigned int total = 0;
+
+	SDL_LockMutex(flushLock);
+	if (!pendingCount) {
+		SDL_UnlockMutex(flushLock);
+		return;
+	}
+	// take the batch over so that the emulation is not held up by the I/O
+	for (unsigned int i = 0; i < MAX_d64NumOfSectors; i++) {
+		if (pendingBlock[i])
+			total += pendingLength[i];
+	}
+	unsigned int *blocks = new unsigned int[pendingCount];
+	unsigned int *offsets = new unsigned int[pendingCount];
+	unsigned int *lengths = new unsigned int[pendingCount];
+	unsigned char *data = new unsigned char[total];
+	unsigned char *p = data;
+	for (unsigned int i = 0; i < MAX_d64NumOfSectors && count < pendingCount; i++) {
+		if (pendingBlock[i]) {
+			blocks[count] = i;
+			offsets[count] = pendingOffset[i];
+			lengths[count] = pendingLength[i];
+			memcpy(p, pendingBuffer(i), pendingLength[i]);
+			p += lengths[count++];
+			pendingBlock[i] = false;
+		}
+	}
+	pendingCount = 0;
+	SDL_UnlockMutex(flushLock);
+
+	sprintf(journalName, "%s.jnl", imageName);
+	// older batches must reach the image before this one
+	const bool behind = !replayJournal(imageName);
+	FILE *journal = fopen(journalName, "ab");
+	bool journalled = false;
+	if (journal) {
+		fseek(journal, 0, SEEK_END);
+		const long journalSize = ftell(journal);
+		fwrite("YJNL", 4, 1, journal);
+		fwrite(&count, sizeof(count), 1, journal);
+		p = data;
+		for (unsigned int i = 0; i < count; i++) {
+			fwrite(&offsets[i], sizeof(offsets[i]), 1, journal);
+			fwrite(&lengths[i], sizeof(lengths[i]), 1, journal);
+			fwrite(p, lengths[i], 1, journal);
+			p += lengths[i];
+		}
+		journalled = fwrite("DONE", 4, 1, journal) == 1 && ad_fsync(journal);
+		journalled = !fclose(journal) && journalled;
+		if (!journalled)
+			truncateJournal(journalName, journalSize);
+	}
+	bool ok = false;
+	if (journalled && !behind) {
+		FILE *image = fopen(imageName, "rb+");
+		ok = image != NULL;
+		if (image) {
+			p = data;
+			for (unsigned int i = 0; i < count && ok; i++) {
+				ok = !fseek(image, offsets[i], SEEK_SET) && fwrite(p, lengths[i], 1, image) == 1;
+				p += lengths[i];
 			}
-			// convert to 260 bytes
-			gcr2sector( sector_buffer, offset, trackStart, trackEnd);
-			if (sector_buffer[0] != 0x07) {
-				isDiskCorrupted = true;
-				//fclose(d64dump);
-				//return;
-//				Log::write(_T("Warning: head of buffer not data mark at track: %i, sector %i, file offset: %i.\n"),
-//					track, sec, ftell(d64dump));
+			ok = ad_fsync(image) && ok;
+			fclose(image);
+		}
+		// the journal holds only this batch now, dropped once the image has it
+		if (ok)
+			::remove(journalName);
+	} else if (!journalled) {
+		// hand the blocks back to the next flush unless newer data came meanwhile
+		SDL_LockMutex(flushLock);
+		p = data;
+		for (unsigned int i = 0; i < count; i++) {
+			if (!pendingBlock[blocks[i]]) {
+				memcpy(pendingBuffer(blocks[i]), p, lengths[i]);
+				queueBlock(blocks[i], offsets[i], lengths[i]);
 			}
-			// write one sector
-			fwrite( &(sector_buffer[1]), 256, 1, d64dump);
+			p += lengths[i];
+		}
+		SDL_UnlockMutex(flushLock);
+	}
+	if (!ok)
+		fprintf(stderr, "Disk write-back to %s %s.\n", imageName,
+			journalled ? "deferred to the journal" : "failed, retrying");
+	delete[] blocks;
+	delete[] offsets;
+	delete[] lengths;
+	delete[] data;
+}
+
+/*
+	Apply the complete batches of a journal left over from a failed
+	write-back or a crash, in the order they were written. Returns false
+	if the image could not take them and the journal has to stay.
+*/
+bool GcrDisk::replayJournal(const char *filepath)
+{
+	char journalName[280];
+	char tag[4];
+	unsigned int count, offset, length;
+	unsigned int blocks = 0;
+	long batch = 0;
+
+	sprintf(journalName, "%s.jnl", filepath);
+	FILE *journal = fopen(journalName, "rb");
+	if (!journal)
+		return true;
+	FILE *image = NULL;
+	bool ok = true;
+	while (ok) {
+		// a batch counts only when its closing tag made it to the journal
+		bool complete = !fseek(journal, batch, SEEK_SET)
+			&& fread(tag, 4, 1, journal) == 1 && !memcmp(tag, "YJNL", 4)
+			&& fread(&count, sizeof(count), 1, journal) == 1 && count <= MAX_d64NumOfSectors;
+		for (unsigned int i = 0; i < count && complete; i++) {
+			complete = fread(&offset, sizeof(offset), 1, journal) == 1
+				&& fread(&length, sizeof(length), 1, journal) == 1 && length <= GCR_MAX_TRACK_SIZE
+				&& !fseek(journal, length, SEEK_CUR);
+		}
+		complete = complete && fread(tag, 4, 1, journal) == 1 && !memcmp(tag, "DONE", 4);
+		if (!complete)
+			break;
+		const long next = ftell(journal);
+		if (!image)
+			image = fopen(filepath, "rb+");
+		ok = image != NULL && !fseek(journal, batch + 4 + (long) sizeof(count), SEEK_SET);
+		unsigned char data[GCR_MAX_TRACK_SIZE];
+		for (unsigned int i = 0; i < count && ok; i++) {
+			ok = fread(&offset, sizeof(offset), 1, journal) == 1 && fread(&length, sizeof(length), 1, journal) == 1
+				&& fread(data, length, 1, journal) == 1
+				&& !fseek(image, offset, SEEK_SET) && fwrite(data, length, 1, image) == 1;
+		}
+		blocks += count;
+		batch = next;
+	}
+	if (image) {
+		ok = ad_fsync(image) && ok;
+		fclose(image);
+	}
+	fclose(journal);
+	// an incomplete batch never got to the image, it can go as well
+	if (ok)
+		::remove(journalName);
+	if (ok && blocks)
+		fprintf(stderr, "Replayed %u blocks from %s.\n", blocks, journalName);
+	return ok;
+}
+
+int FdcGcr::flusherThread(void *fdc)
+{
+	FdcGcr *f = (FdcGcr *) fdc;
+
+	while (!f->flushQuit) {
+		SDL_SemWaitTimeout(f->flushWake, flushInterval * 1000);
+		f->writePendingBlocks();
+	}
+	return 0;
+}
+
+void FdcGcr::startFlusher()
+{
+#ifndef __EMSCRIPTEN__
+	if (flushThread || isImageWriteProtected)
+		return;
+	flushQuit = false;
+	flushThread = SDL_CreateThread(flusherThread, "Disk flusher", this);
+#endif
+}
+
+void FdcGcr::stopFlusher()
+{
+	if (flushThread) {
+		flushQuit = true;
+		SDL_SemPost(flushWake);
+		SDL_WaitThread(flushThread, NULL);
+		flushThread = NULL;
+	}
+	// whatever is left goes out right now, blocks that still fail go with the disk
+	writePendingBlocks();
+	SDL_LockMutex(flushLock);
+	if (pendingCount) {
+		fprintf(stderr, "Disk write-back: %u blocks could not be saved to %s.\n", pendingCount, imageName);
+		memset(pendingBlock, 0, sizeof(pendingBlock));
+		pendingCount = 0;
+	}
+	SDL_UnlockMutex(flushLock);
+}
+
+/*
+	Load, parse and GCR encode the whole disk. Nothing outside the disk is
+	touched, so it can run on the preparing thread.
+*/
+void GcrDisk::prepare()
+{
+	if (!imageData && !openImageFile(imageName))
+		return;
+	if (parseImage())
+		disk2gcr();
+}
+
+// the disks trade places, the buffers are swapped and not copied
+void FdcGcr::exchangeDisk(GcrDisk &disk)
+{
+	GcrDisk &drive = *this;
+	GcrDisk parked = disk;
+
+	disk = drive;
+	drive = parked;
+}
+
+// point the head at the same spot of the new disk
+void FdcGcr::headOnNewDisk(unsigned int offset)
+{
+	const unsigned int track = currentHalfTrack >> 1;
+
+	encodeTrack(track);
+	gcrTrackBegin = gcrData + (track - 1) * GCR_MAX_TRACK_SIZE;
+	gcrTrackEnd = gcrTrackBegin + trackLength[track];
+	gcrPtr = gcrTrackBegin + (offset < trackLength[track] ? offset : 0);
+	isDiskSwapped = true;
+	if (isDiskInserted)
+		startFlusher();
+}
+
+bool FdcGcr::addToDiskSet(const char *filepath)
+{
+	// adding to a set in use starts a new one
+	if (setInserted)
+		closeDiskSet();
+	if (setDisks == MAX_SET_DISKS)
+		return false;
+	GcrDisk *d = new GcrDisk();
+	d->gcrData = new unsigned char[GCR_DISK_SIZE];
+	memset(d->gcrData, 0x55, GCR_DISK_SIZE);
+	strncpy(d->imageName, filepath, sizeof(d->imageName) - 1);
+	d->imageName[sizeof(d->imageName) - 1] = 0;
+	setDiskReady[setDisks] = false;
+	setDisk[setDisks++] = d;
+	return true;
+}
+
+// images from memory are write protected, like in openDiskImage
+bool FdcGcr::addToDiskSet(const unsigned char *data, size_t size, const char *name)
+{
+	if (!size || size > MAX_IMAGE_FILE_SIZE || !addToDiskSet(name))
+		return false;
+	GcrDisk *d = setDisk[setDisks - 1];
+	d->imageData = new unsigned char[size];
+	memcpy(d->imageData, data, size);
+	d->imageSize = size;
+	d->isImageWriteProtected = true;
+	return true;
+}
+
+/*
+	The first disk goes into the drive, the rest are made ready in the
+	background
+*/
+unsigned int FdcGcr::insertDiskSet()
+{
+	if (!setDisks || setInserted)
+		return setDisks;
+	const unsigned int offset = (unsigned int) (gcrPtr - gcrTrackBegin);
+
+	closeDiskImage();
+	setDisk[0]->prepare();
+	setDiskReady[0] = true;
+	setCurrent = 0;
+	setInserted = true;
+	exchangeDisk(*setDisk[0]);
+	headOnNewDisk(offset);
+	startPreparer();
+	return setDisks;
+}
+
+/*
+	Swapping is a pointer exchange. Changes of the disk going out stay with
+	it until it is back in the drive or the set is closed.
+*/
+bool FdcGcr::nextDisk(unsigned int &number, unsigned int &count)
+{
+	if (!setInserted || setDisks < 2)
+		return false;
+	const unsigned int next = (setCurrent + 1) % setDisks;
+	const unsigned int offset = (unsigned int) (gcrPtr - gcrTrackBegin);
+
+	// the preparing thread may not have got there yet
+	SDL_LockMutex(setLock);
+	if (!setDiskReady[next]) {
+		setDisk[next]->prepare();
+		setDiskReady[next] = true;
+	}
+	SDL_UnlockMutex(setLock);
+	// blocks already queued go to the image of the disk going out
+	stopFlusher();
+	exchangeDisk(*setDisk[setCurrent]);
+	exchangeDisk(*setDisk[next]);
+	setCurrent = next;
+	headOnNewDisk(offset);
+	number = next + 1;
+	count = setDisks;
+	fprintf(stderr, "Disk %u of %u: %s\n", number, count, imageName);
+	return true;
+}
+
+void FdcGcr::closeDiskSet()
+{
+	if (!setDisks)
+		return;
+	if (setThread) {
+		setQuit = true;
+		SDL_WaitThread(setThread, NULL);
+		setThread = NULL;
+	}
+	// the flusher must not see the image name change
+	stopFlusher();
+	for (unsigned int i = 0; i < setDisks; i++) {
+		// parked disks are written back the same way as the one in the drive
+		if (setInserted && i != setCurrent) {
+			exchangeDisk(*setDisk[i]);
+			closeDiskImage();
+			exchangeDisk(*setDisk[i]);
+		} else {
+			setDisk[i]->releaseImage();
+		}
+		delete [] setDisk[i]->gcrData;
+		delete setDisk[i];
+	}
+	if (isDiskInserted)
+		startFlusher();
+	setDisks = 0;
+	setInserted = false;
+}
+
+int FdcGcr::preparerThread(void *fdc)
+{
+	FdcGcr *f = (FdcGcr *) fdc;
+
+	for (unsigned int i = 0; i < f->setDisks && !f->setQuit; i++) {
+		SDL_LockMutex(f->setLock);
+		if (!f->setDiskReady[i]) {
+			f->setDisk[i]->prepare();
+			f->setDiskReady[i] = true;
 		}
+		SDL_UnlockMutex(f->setLock);
 	}
-	fclose(d64dump);
+	return 0;
+}
+
+void FdcGcr::startPreparer()
+{
+#ifndef __EMSCRIPTEN__
+	// without threads the disks are prepared when they are first needed
+	setQuit = false;
+	setThread = SDL_CreateThread(preparerThread, "Disk set", this);
+#endif
 }
 
 // Move R/W head inwards (towards higher tracks)
@@ -658,13 +1326,14 @@ void FdcGcr::moveHeadIn(void)
 		NrOfTracks = currentHalfTrack >> 1;
 	}
 	// Note actual position within the old track...
-	newGCRoffset = (unsigned long)(gcrPtr - gcrTrackBegin) * sectorSize[(currentHalfTrack+1) >> 1]
-		/ sectorSize[(currentHalfTrack) >> 1] ;
+	newGCRoffset = (unsigned long)(gcrPtr - gcrTrackBegin) * trackLength[(currentHalfTrack+1) >> 1]
+		/ trackLength[(currentHalfTrack) >> 1] ;
 
 	currentHalfTrack++;
+	encodeTrack(currentHalfTrack >> 1);
 
 	gcrTrackBegin = gcrData + ((currentHalfTrack >> 1) - 1) * GCR_MAX_TRACK_SIZE;
-	gcrTrackEnd = gcrTrackBegin + sectorSize[currentHalfTrack >> 1];
+	gcrTrackEnd = gcrTrackBegin + trackLength[currentHalfTrack >> 1];
 
 	gcrPtr = gcrTrackBegin + newGCRoffset;
 }
@@ -678,13 +1347,14 @@ void FdcGcr::moveHeadOut(void)
 		return;
 
 	// Note actual position within the old track...
-	newGCRoffset = (unsigned long) (gcrPtr - gcrTrackBegin) * sectorSize[(currentHalfTrack-1) >> 1]
-		/ sectorSize[(currentHalfTrack) >> 1];
+	newGCRoffset = (unsigned long) (gcrPtr - gcrTrackBegin) * trackLength[(currentHalfTrack-1) >> 1]
+		/ trackLength[(currentHalfTrack) >> 1];
 
 	currentHalfTrack--;
+	encodeTrack(currentHalfTrack >> 1);
 
 	gcrTrackBegin = gcrData + ((currentHalfTrack >> 1) - 1) * GCR_MAX_TRACK_SIZE;
-	gcrTrackEnd = gcrTrackBegin + sectorSize[currentHalfTrack >> 1];
+	gcrTrackEnd = gcrTrackBegin + trackLength[currentHalfTrack >> 1];
 
 	gcrPtr = gcrTrackBegin + newGCRoffset;
 }
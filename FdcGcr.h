@@ -14,12 +14,65 @@ static const unsigned int MAX_NUM_TRACKS = 42; // 35 41 42
 static const unsigned int MIN_d64NumOfSectors = 683;
 static const unsigned int MAX_d64NumOfSectors = 768; // This copes with max 40 tracks size d64 images
 
-class FdcGcr : public SaveState {
+/*
+	Everything that belongs to one disk, so that the disks of a set can be
+	loaded and encoded off the emulation thread and swapped into the drive
+*/
+class GcrDisk {
+public:
+	GcrDisk();
+	bool openImageFile(const char *filepath);
+	bool loadImage(const char *filepath);
+	void releaseImage();
+	bool parseImage();
+	void encodeTrack(unsigned int track);
+	void disk2gcr();
+	void prepare();
+	static bool replayJournal(const char *filepath);
+	static void initGcrTables();
+
+	unsigned char *imageData;		// the image file mapped or loaded into memory
+	size_t imageSize;
+	bool isImageMapped;
+	bool trackEncoded[MAX_NUM_TRACKS+1];	// GCR data is only built when the head lands on a track
+	unsigned int trackLength[MAX_NUM_TRACKS+1];		// GCR bytes in one revolution
+	unsigned int g64TrackOffset[MAX_NUM_TRACKS+1];	// slot of the track in a G64 image, 0 if none
+	bool trackDirty[MAX_NUM_TRACKS+1];	// written since the last write-back
+	bool hasDirtyTracks;
+	char imageName[266];
+	int imageType;
+	unsigned int diskImageHeaderSize;		// Length of D64/x64 file header (if any)
+	unsigned char id1, id2;			// Disk IDs
+	unsigned char diskErrorInfo[MAX_d64NumOfSectors];	// sector error info (1 byte/sector)
+	unsigned int NrOfTracks;
+	unsigned int NrOfSectors;
+	unsigned char *gcrData;			// pointer to GCR disk buffer
+	bool isDiskInserted;		// Flag: Disk inserted
+	bool isImageWriteProtected;	// Flag: Disk write-protected
+	bool isDiskCorrupted;
+	bool isImageChanged;		// Flag: D64 image changed
+
+protected:
+	bool attachD64file();
+	bool attachG64file();
+	bool readG64TrackTable();
+	bool readSector(int track, int sector, unsigned char *buffer);
+	unsigned int secnumFromTS(unsigned int track, unsigned int sector);
+	int offsetFromTS(unsigned int track, unsigned int sector);
+	void gcrConv4bytesTo5(unsigned char *from, unsigned char *to);
+	void sector2gcr(int track, int sector);
+	static unsigned short gcrEncodeTable[256];	// byte to 10 GCR bits
+	static unsigned char gcrDecodeTable[1024];	// and back
+	static unsigned int sectorSize[MAX_NUM_TRACKS+1];
+};
+
+class FdcGcr : public SaveState, private GcrDisk {
 public:
 	FdcGcr();
 	virtual ~FdcGcr();
 
 	virtual void openDiskImage(const char *filepath);
+	void openDiskImage(const unsigned char *data, size_t size, const char *name);
 	void moveHeadOut();
 	void moveHeadIn();
 	unsigned char SyncFound();
@@ -47,41 +100,65 @@ public:
 		return false;
 	}
 	unsigned char getMotorState();
+	// a set of disks kept ready for swapping
+	bool addToDiskSet(const char *filepath);
+	bool addToDiskSet(const unsigned char *data, size_t size, const char *name);
+	unsigned int insertDiskSet();
+	bool nextDisk(unsigned int &number, unsigned int &count);
+	void closeDiskSet();
 	// this is for the FRE support
 	virtual void dumpState();
 	virtual void readState();
+	static rvar_t fdcSettings[2];
 //	static bool createG64image(char *d64name, char *hdr, char *id1, char *id2);
 //	static bool G64writeHeader(FILE *g64);
 //	static bool gcrToG64(char *filename, unsigned char *buffer);
 
 private:
 
-	void attachD64file(const char *filepath);
-	bool readSector(int track, int sector, unsigned char *buffer);
+	void attachImage();
+	void headOnNewDisk(unsigned int offset);
 	bool writeSector(int track, int sector, unsigned char *buffer);
-	unsigned int secnumFromTS(unsigned int track, unsigned int sector);
-	int offsetFromTS(unsigned int track, unsigned int sector);
-	void gcrConv4bytesTo5(unsigned char *from, unsigned char *to);
 	void gcrConv5bytesTo4(unsigned char *buffer, unsigned char *ptr);
-	void sector2gcr(int track, int sector);
 	void gcr2sector(unsigned char *buffer, unsigned char *p, unsigned char *trackStart, unsigned char *trackEnd);
-	void disk2gcr();
-	void gcr2disk();
+	// write-back of changed sectors
+	bool decodeSector(unsigned int track, unsigned int sector, unsigned char *buffer);
+	void queueDirtyTracks();
+	void writePendingBlocks();
+	void queueBlock(unsigned int block, unsigned int offset, unsigned int length);
+	unsigned char *pendingBuffer(unsigned int block);
+	void startFlusher();
+	void stopFlusher();
+	static int flusherThread(void *fdc);
+	static void flipFlushInterval(void *none);
 	void dumpGcr(unsigned char *p);
-	FILE *diskImageHandle;
-	char imageName[266];
-	int imageType;
-	unsigned int diskImageHeaderSize;		// Length of D64/x64 file header (if any)
-	unsigned char id1, id2;			// Disk IDs
-	unsigned char diskErrorInfo[MAX_d64NumOfSectors];	// sector error info (1 byte/sector)
-	static unsigned int sectorSize[MAX_NUM_TRACKS+1];
-	unsigned int NrOfTracks;
-	unsigned int NrOfSectors;
+	void exchangeDisk(GcrDisk &disk);
+	void startPreparer();
+	static int preparerThread(void *fdc);
+	unsigned char *pendingData;		// sectors or G64 tracks waiting for the flusher
+	bool pendingBlock[MAX_d64NumOfSectors];
+	unsigned int pendingOffset[MAX_d64NumOfSectors];	// file position
+	unsigned int pendingLength[MAX_d64NumOfSectors];
+	unsigned int pendingCount;
+	SDL_mutex *flushLock;
+	SDL_sem *flushWake;
+	SDL_Thread *flushThread;
+	volatile bool flushQuit;
+	static unsigned int flushInterval;	// in seconds
+	// parked disks of the set, the slot of the one in the drive is empty
+	static const unsigned int MAX_SET_DISKS = 16;
+	GcrDisk *setDisk[MAX_SET_DISKS];
+	bool setDiskReady[MAX_SET_DISKS];
+	unsigned int setDisks;
+	unsigned int setCurrent;
+	bool setInserted;
+	SDL_mutex *setLock;
+	SDL_Thread *setThread;
+	volatile bool setQuit;
 
 	unsigned int gcrCurrentBitcount;// number of bits rotated*4 (wraps around at 32)
 	unsigned int gcrCurrentBitRate;	// current bite rate / speed zone (13-16)
 	unsigned int currentHalfTrack;	// current halftrack (2-70)
-	unsigned char *gcrData;			// pointer to GCR disk buffer
 	unsigned char *gcrPtr;			// GCR data right under the drive head
 	unsigned char *gcrTrackBegin;	// pointer to start of GCR data of actual track
 	unsigned char *gcrTrackEnd;		// pointer to end of GCR data of actual track
@@ -90,11 +167,7 @@ private:
 	unsigned char byteReady;		// Flag: Shift reg finished, new byte is ready
 	unsigned char byteReadyEdge;	// Flag: rising edge of byte ready
 	bool motorSpinning;		// Flag: Disk motor is on/off
-	bool isDiskInserted;		// Flag: Disk inserted
-	bool isImageWriteProtected;	// Flag: Disk write-protected
 	bool isDiskSwapped;		// Flag: Disk changed (WP sensor strobe control)
-	bool isDiskCorrupted;
-	bool isImageChanged;		// Flag: D64 image changed
 	unsigned int writeMode;		// Flag: R/W mode flag
 	unsigned int spinFactor;		// used for synching rotation speed with drive speed
 };
@@ -181,6 +254,9 @@ inline unsigned char FdcGcr::WPState(void)
 
 inline void FdcGcr::SetDriveMotor(unsigned char motoron)
 {
+	// a write session is over when the motor stops
+	if (motorSpinning && !motoron && hasDirtyTracks)
+		queueDirtyTracks();
 	motorSpinning = motoron != 0;
 }
 
@@ -202,6 +278,7 @@ inline void FdcGcr::SpinMotor()
 		if (writeMode) {
 			// Rotate disk
 			*gcrPtr++ = byteWritten;
+			trackDirty[currentHalfTrack >> 1] = hasDirtyTracks = true;
 			if ( gcrPtr == gcrTrackEnd)
 				gcrPtr = gcrTrackBegin; // Restart GCR buffer
 		} else {
@@ -1,6 +1,6 @@
 //  Issues:
 //  - Filter cutoff frequencies not 100% accurate
-//  - Combined waveforms of the 6581 incorrect (SID card used 8580 anyway)
+//  - Combined waveforms only approximated by the reSIDfp model
 //  - filter distortion not emulated
 //  - no joystick or paddle support
 //  - probably many more
@@ -25,6 +25,10 @@ int SIDsound::dcVoice;
 int SIDsound::dcWave;
 int SIDsound::w0;
 int SIDsound::cutOffFreq[2048];
+unsigned short SIDsound::envLfsrIndex[0x8000];
+unsigned short SIDsound::envLfsrState[0x7FFF];
+unsigned short SIDsound::waveTables[2][8][4096];
+unsigned short (*SIDsound::waveTable)[4096] = SIDsound::waveTables[0];
 unsigned int SIDsound::filterCutoff;
 rvar_t SIDsound::sidSettings[2] = {
 	{ "SID model", "SidModel", SIDsound::flipSidModel, &SIDsound::model_, RVAR_STRING_FLIPLIST, SIDsound::getSidModelLabel },
@@ -76,6 +80,9 @@ void SIDsound::setModel(unsigned int model)
 	int i;
 	double temp[2048];
 
+	sound_sync();
+	initWaveTables();
+
 	switch (model) {
 		case SID8580DB:
 		case SID8580:
@@ -93,6 +100,7 @@ void SIDsound::setModel(unsigned int model)
 			dcMixer = 0;
 			dcVoice = 0;
 			combinedWaveFormMask = 0xFF;
+			waveTable = waveTables[1];
 			break;
 
 		case SID6581: // R4 actually
@@ -114,6 +122,7 @@ void SIDsound::setModel(unsigned int model)
 			dcMixer = -0xFFF*0xFF/18 >> 7;
 			dcVoice = 0x800*0xFF;
 			combinedWaveFormMask = 0x3F;
+			waveTable = waveTables[0];
 			break;
 
 		case SID6581R1: // 6581 R1
@@ -129,6 +138,7 @@ void SIDsound::setModel(unsigned int model)
 			dcMixer = -0xFFF*0xFF/18 >> 7;
 			dcVoice = 0x800*0xFF;
 			combinedWaveFormMask = 0x3F;
+			waveTable = waveTables[0];
 			break;
 	}
 	for (i=0; i<2048; i++) {
@@ -139,6 +149,115 @@ void SIDsound::setModel(unsigned int model)
 	model_ = model;
 }
 
+/*
+	Combined waveforms are the analog result of several waveform outputs
+	pulling on the same bit lines. Each output bit is modelled as the average
+	of its neighbours weighted by distance, plus the pulse line pulling all
+	bits up, compared against a threshold.
+	The model and its parameter table are taken from reSIDfp
+	(WaveformCalculator, (C) 2011-2016 Leandro Nini, (C) 2007-2010 Antti
+	S. Lankila, (C) 2004, 2010 Dag Lem), licensed under the GNU GPL.
+*/
+struct CombinedWaveformConfig {
+	float bias;
+	float pulseStrength;
+	float topBit;
+	float distance;
+	float stMix;
+};
+
+static const CombinedWaveformConfig combinedWaveConfig[2][4] = {
+	{	// 6581
+		{ 0.880815f, 0.0f, 0.0f, 0.3279614f, 0.5999545f },		// TRISAW
+		{ 0.8924618f, 2.014781f, 1.003332f, 0.02992322f, 0.0f },	// TRIPULSE
+		{ 0.8646501f, 1.712586f, 1.137704f, 0.02845423f, 0.0f },	// SAWPULSE
+		{ 0.9527834f, 1.794777f, 0.0f, 0.09806272f, 0.7752482f }	// TRISAWPULSE
+	},
+	{	// 8580
+		{ 0.9781665f, 0.0f, 0.9899469f, 8.087667f, 0.8226412f },
+		{ 0.9097769f, 2.039997f, 0.9584096f, 0.1765447f, 0.0f },
+		{ 0.9231212f, 2.084788f, 0.9493895f, 0.1712518f, 0.0f },
+		{ 0.9845552f, 1.415612f, 0.9703883f, 3.68829f, 0.8265008f }
+	}
+};
+
+static unsigned short calcCombinedWaveform(const CombinedWaveformConfig &config, unsigned int wave,
+	unsigned int accu)
+{
+	float o[12];
+	int i, j;
+
+	// sawtooth bits
+	for (i = 0; i < 12; i++)
+		o[i] = (accu >> i) & 1 ? 1.0f : 0.0f;
+	if ((wave & 3) == 1) {
+		// triangle: the MSB inverts the rest, shifted up by one bit
+		const bool top = (accu & 0x800) != 0;
+		for (i = 11; i > 0; i--)
+			o[i] = top ? 1.0f - o[i - 1] : o[i - 1];
+		o[0] = 0.0f;
+	} else if ((wave & 3) == 3) {
+		// triangle and sawtooth, bit 0 is grounded by the triangle selector
+		o[0] *= config.stMix;
+		for (i = 1; i < 12; i++)
+			o[i] = o[i - 1] * (1.0f - config.stMix) + o[i] * config.stMix;
+	}
+	if (wave & 2)
+		o[11] *= config.topBit;
+
+	float distanceTable[25];
+	for (i = 0; i <= 12; i++)
+		distanceTable[12 + i] = distanceTable[12 - i] = 1.0f / (1.0f + i * i * config.distance);
+
+	float tmp[12];
+	for (i = 0; i < 12; i++) {
+		float avg = 0.0f;
+		float n = 0.0f;
+		for (j = 0; j < 12; j++) {
+			const float weight = distanceTable[i - j + 12];
+			avg += o[j] * weight;
+			n += weight;
+		}
+		if (wave > 4) {
+			// pulse line
+			const float weight = distanceTable[i];
+			avg += config.pulseStrength * weight;
+			n += weight;
+		}
+		tmp[i] = (o[i] + avg / n) * 0.5f;
+	}
+
+	unsigned short value = 0;
+	for (i = 0; i < 12; i++) {
+		if (tmp[i] > config.bias)
+			value |= 1 << i;
+	}
+	return value;
+}
+
+void SIDsound::initWaveTables()
+{
+	static bool done = false;
+
+	if (done)
+		return;
+	for (unsigned int chip = 0; chip < 2; chip++) {
+		unsigned short (*table)[4096] = waveTables[chip];
+		for (unsigned int i = 0; i < 4096; i++) {
+			const unsigned int triangle = ((i & 0x800 ? ~i : i) << 1) & 0xFFE;
+			table[WAVE_NONE][i] = 0x000;
+			table[WAVE_TRI][i] = triangle;
+			table[WAVE_SAW][i] = i;
+			table[WAVE_PULSE][i] = 0xFFF;
+			table[WAVE_TRISAW][i] = calcCombinedWaveform(combinedWaveConfig[chip][0], WAVE_TRISAW, i);
+			table[WAVE_TRIPULSE][i] = calcCombinedWaveform(combinedWaveConfig[chip][1], WAVE_TRIPULSE, i);
+			table[WAVE_SAWPULSE][i] = calcCombinedWaveform(combinedWaveConfig[chip][2], WAVE_SAWPULSE, i);
+			table[WAVE_TRISAWPULSE][i] = calcCombinedWaveform(combinedWaveConfig[chip][3], WAVE_TRISAWPULSE, i);
+		}
+	}
+	done = true;
+}
+
 // Static data members
 const unsigned int SIDsound::RateCountPeriod[16] = {
 	0x7F00,0x0006,0x003C,0x0330,0x20C0,0x6755,0x3800,0x500E,
@@ -174,6 +293,7 @@ void SIDsound::calcEnvelopeTable()
 
 void SIDsound::setFrequency(unsigned int sid_frequency = SOUND_FREQ_PAL_C64)
 {
+	sound_sync();
 	if (sid_frequency) {
 		sidBaseFreq = sid_frequency;
 	}
@@ -182,6 +302,7 @@ void SIDsound::setFrequency(unsigned int sid_frequency = SOUND_FREQ_PAL_C64)
 
 void SIDsound::setSampleRate(unsigned int sampleRate_)
 {
+	sound_sync();
 	sampleRate = sampleRate_;
 	calcEnvelopeTable();
 }
@@ -202,6 +323,8 @@ SIDsound::SIDsound(unsigned int model, unsigned int chnlDisableMask) : enableDig
 	sidBaseFreq = SOUND_FREQ_PAL_C64;
 	sampleRate = SAMPLE_FREQ;
 	filterCutoff = 0;
+	filterStepCycles = 0;
+	initEnvelopeLfsrTables();
 	setModel(model);
 	calcEnvelopeTable();
 	reset();
@@ -209,6 +332,7 @@ SIDsound::SIDsound(unsigned int model, unsigned int chnlDisableMask) : enableDig
 
 void SIDsound::reset(void)
 {
+	sound_sync();
 	volume = masterVolume;
 
 	lastByteWritten = 0;
@@ -247,6 +371,7 @@ void SIDsound::reset(void)
 
 void SIDsound::dumpState()
 {
+	sound_sync();
 	saveVar(&reg, sizeof(reg) / sizeof(reg[0]));
 	for (unsigned int i = 0; i < 3; i++) {
 		SIDVoice &v = voice[i];
@@ -262,6 +387,7 @@ void SIDsound::dumpState()
 
 void SIDsound::readState()
 {
+	sound_sync();
 	readVar(&reg, sizeof(reg) / sizeof(reg[0]));
 	//
 	for (unsigned int i = 0; i < 32; i++) {
@@ -280,36 +406,6 @@ void SIDsound::readState()
 	setFilterCutoff();
 }
 
-inline int SIDsound::getWaveSample(SIDVoice &v)
-{
-	switch (v.wave) {
-		case WAVE_TRI:
-			return waveTriangle(v);
-		case WAVE_SAW:
-			return waveSaw(v);
-		case WAVE_PULSE:
-			return wavePulse(v);
-		case WAVE_TRISAW:
-			return waveTriSaw(v);
-		case WAVE_TRIPULSE:
-			return waveTriPulse(v);
-		case WAVE_SAWPULSE:
-			return waveSawPulse(v);
-		case WAVE_TRISAWPULSE:
-			return waveTriSawPulse(v);
-		case WAVE_NOISE:
-			return v.waveNoiseOut;
-		case WAVE_NONE:
-			if (v.accu) {
-				int rv = (v.accu >> 12);
-				v.accu >>= 1;
-				//return rv;
-			}
-		default:
-			return 0x000;
-	}
-}
-
 unsigned char SIDsound::read(unsigned int adr)
 {
 	switch(adr) {
@@ -498,20 +594,66 @@ inline unsigned int SIDsound::clock()
 	return count;
 }
 
+/*
+	The per cycle filter step is linear in (Vlp, Vbp, Vhp) with a constant
+	input during a sample:
+		Vlp' = Vlp - k * Vbp
+		Vbp' = Vbp - k * Vhp
+		Vhp' = r * Vbp' - Vlp' - Vi
+	so n cycles collapse into x' = M^n * x + (I + M + ... + M^(n-1)) * (0, 0, -Vi).
+	Both are precomputed for the two possible cycle counts of a sample.
+*/
+void SIDsound::calcFilterSteps()
+{
+	const double k = (double) (w0 >> 6) / 16384.0;
+	const double r = (double) resonanceCoeffDiv1024 / 1024.0;
+	const double M[3][3] = {
+		{ 1.0, -k, 0.0 },
+		{ 0.0, 1.0, -k },
+		{ -1.0, r + k, -r * k }
+	};
+	double P[3][3] = { { 1.0, 0.0, 0.0 }, { 0.0, 1.0, 0.0 }, { 0.0, 0.0, 1.0 } };
+	double S[3] = { 0.0, 0.0, 0.0 };	// last column of the geometric sum
+	const unsigned int n = sidCyclesPerSampleInt;
+
+	for (unsigned int c = 1; c <= n + 1; c++) {
+		for (unsigned int i = 0; i < 3; i++)
+			S[i] += P[i][2];
+		double T[3][3];
+		for (unsigned int i = 0; i < 3; i++)
+			for (unsigned int j = 0; j < 3; j++)
+				T[i][j] = M[i][0] * P[0][j] + M[i][1] * P[1][j] + M[i][2] * P[2][j];
+		for (unsigned int i = 0; i < 3; i++)
+			for (unsigned int j = 0; j < 3; j++)
+				P[i][j] = T[i][j];
+		if (c >= n) {
+			FilterStep &f = filterStep[c - n];
+			for (unsigned int i = 0; i < 3; i++) {
+				for (unsigned int j = 0; j < 3; j++)
+					f.state[i][j] = P[i][j];
+				f.input[i] = -S[i];
+			}
+		}
+	}
+	filterStepW0 = w0;
+	filterStepResonance = resonanceCoeffDiv1024;
+	filterStepCycles = n;
+}
+
 // simplified version of http://bel.fi/~alankila/c64-sw/index-cpp.html
 inline int SIDsound::filterOutput(unsigned int cycles, int Vi)
 {
-	int w0deltaTime = w0 >> 6;
+	// w0 is shared between instances, so check rather than rely on setters
+	if (w0 != filterStepW0 || resonanceCoeffDiv1024 != filterStepResonance
+		|| sidCyclesPerSampleInt != filterStepCycles)
+		calcFilterSteps();
 	Vi >>= 7;
-	unsigned int count = cycles;
 
-	do {
-		int dVlp = (w0deltaTime * Vbp >> 14);
-		Vlp -= dVlp;
-		int dVbp = (w0deltaTime * Vhp >> 14);
-		Vbp -= dVbp;
-		Vhp = (Vbp * resonanceCoeffDiv1024 >> 10) - Vlp - Vi;
-	} while (--count);
+	const FilterStep &f = filterStep[cycles - sidCyclesPerSampleInt];
+	const double lp = (double) Vlp, bp = (double) Vbp, hp = (double) Vhp, in = (double) Vi;
+	Vlp = (int) floor(f.state[0][0] * lp + f.state[0][1] * bp + f.state[0][2] * hp + f.input[0] * in + 0.5);
+	Vbp = (int) floor(f.state[1][0] * lp + f.state[1][1] * bp + f.state[1][2] * hp + f.input[1] * in + 0.5);
+	Vhp = (int) floor(f.state[2][0] * lp + f.state[2][1] * bp + f.state[2][2] * hp + f.input[2] * in + 0.5);
 
 	int Vf;
 
@@ -545,6 +687,24 @@ inline int SIDsound::filterOutput(unsigned int cycles, int Vi)
 	return Vf << 7;
 }
 
+// the rate counter LFSR has a maximal period, so it can be stepped by index
+void SIDsound::initEnvelopeLfsrTables()
+{
+	static bool done = false;
+
+	if (done)
+		return;
+	unsigned int LFSR = 0x7FFF;
+	for (unsigned int i = 0; i < 0x7FFF; i++) {
+		envLfsrIndex[LFSR] = i;
+		envLfsrState[i] = LFSR;
+		const unsigned int feedback = ((LFSR >> 14) ^ (LFSR >> 13)) & 1;
+		LFSR = ((LFSR << 1) | feedback) & 0x7FFF;
+	}
+	envLfsrIndex[0] = 0;
+	done = true;
+}
+
 // Envelope based on:
 // http://blog.kevtris.org/?p=13
 inline int SIDsound::doEnvelopeGenerator(unsigned int cycles, SIDVoice &v)
@@ -552,47 +712,49 @@ inline int SIDsound::doEnvelopeGenerator(unsigned int cycles, SIDVoice &v)
 	unsigned int count = cycles;
 
 	do {
-		unsigned int LFSR = v.envCounter;
-		if (LFSR != RateCountPeriod[v.envCounterCompare & 0x0f]) {
-			const unsigned int feedback = ((LFSR >> 14) ^ (LFSR >> 13)) & 1;
-			LFSR = ((LFSR << 1) | feedback) & 0x7FFF;
-			v.envCounter = LFSR;
-		} else {
-			// LFSR = 0x7fff reset LFSR
-			v.envCounter = 0x7fff;
-
-			if (v.egState == EG_ATTACK || ++v.envExpCounter == envGenDRdivisors[v.envCurrLevel & 0xff]) {
-
-				v.envExpCounter = 0;
-
-				switch (v.egState) {
-
-				case EG_ATTACK:
-					// According to Bob Yannes, Attack is linear...
-					if ( ((++v.envCurrLevel) & 0xFF) == 0xFF) {
-						v.egState = EG_DECAY;
-						v.envCounterCompare = v.envDecaySub;
-					}
-					break;
+		const unsigned int pos = envLfsrIndex[v.envCounter & 0x7FFF];
+		const unsigned int target = envLfsrIndex[RateCountPeriod[v.envCounterCompare & 0x0f]];
+		// cycles until the counter hits the rate period
+		const unsigned int distance = (target + 0x7FFF - pos) % 0x7FFF;
+		if (distance >= count) {
+			v.envCounter = envLfsrState[(pos + count) % 0x7FFF];
+			break;
+		}
+		count -= distance;
+		// LFSR = 0x7fff reset LFSR
+		v.envCounter = 0x7fff;
 
-				case EG_DECAY:
-					if (v.envCurrLevel != v.envSustainLevel) {
-						--v.envCurrLevel &= 0xFF;
-						if (!v.envCurrLevel)
-							v.egState = EG_FROZEN;
-					}
-					break;
+		if (v.egState == EG_ATTACK || ++v.envExpCounter == envGenDRdivisors[v.envCurrLevel & 0xff]) {
+
+			v.envExpCounter = 0;
 
-				case EG_RELEASE:
-					v.envCurrLevel = (v.envCurrLevel - 1) & 0xFF;
+			switch (v.egState) {
+
+			case EG_ATTACK:
+				// According to Bob Yannes, Attack is linear...
+				if ( ((++v.envCurrLevel) & 0xFF) == 0xFF) {
+					v.egState = EG_DECAY;
+					v.envCounterCompare = v.envDecaySub;
+				}
+				break;
+
+			case EG_DECAY:
+				if (v.envCurrLevel != v.envSustainLevel) {
+					--v.envCurrLevel &= 0xFF;
 					if (!v.envCurrLevel)
 						v.egState = EG_FROZEN;
-					break;
-
-				case EG_FROZEN:
-					v.envCurrLevel = 0;
-					break;
 				}
+				break;
+
+			case EG_RELEASE:
+				v.envCurrLevel = (v.envCurrLevel - 1) & 0xFF;
+				if (!v.envCurrLevel)
+					v.egState = EG_FROZEN;
+				break;
+
+			case EG_FROZEN:
+				v.envCurrLevel = 0;
+				break;
 			}
 		}
 	} while (--count);
@@ -600,6 +762,23 @@ inline int SIDsound::doEnvelopeGenerator(unsigned int cycles, SIDVoice &v)
 	return v.envCurrLevel & 0xFF; // envelope is 8 bits
 }
 
+/*
+	With the master volume at zero the output is zero. If no voice can
+	change state either (envelope frozen at zero, oscillator stopped), nothing
+	observable happens until the next register write.
+*/
+bool SIDsound::isIdle()
+{
+	if (volume || dcDigiBlaster)
+		return false;
+	for (unsigned int i = 0; i < 3; i++) {
+		const SIDVoice &v = voice[i];
+		if (v.egState != EG_FROZEN || v.envCurrLevel || (v.freq && !v.test) || (v.wave == WAVE_NONE && v.accu))
+			return false;
+	}
+	return true;
+}
+
 void SIDsound::calcSamples(short *buf, unsigned int count)
 {
 	do {
@@ -640,15 +819,11 @@ void SIDsound::calcSamples(short *buf, unsigned int count)
 					}
 				}
 #endif
-				// noise shift register is updating even when waveform is not selected
-				unsigned int accNext = accPrev;
-				do {
-					accNext += freq;
-					// Update noise shift register
-					if (!(accPrev & 0x080000) && (accNext & 0x080000))
-						updateShiftReg(v);
-					accPrev = accNext;
-				} while (accNext < v.accu);
+				// noise shift register is updating even when waveform is not selected,
+				// once for every rising edge of bit 19 (a step is always less than 2^19)
+				unsigned int edges = ((v.accu + 0x080000) >> 20) - ((accPrev + 0x080000) >> 20);
+				while (edges--)
+					updateShiftReg(v);
 				// accu is 24 bit
 				v.accu &= 0xFFFFFF;
 			}
@@ -680,5 +855,7 @@ void SIDsound::calcSamples(short *buf, unsigned int count)
 
 SIDsound::~SIDsound()
 {
+	// no queued write may refer to this instance any more
+	sound_sync();
 	masterVolume = volume;
 }
@@ -27,6 +27,7 @@ public:
 	virtual void setFrequency(unsigned int sid_frequency);
 	virtual void setSampleRate(unsigned int sampleRate_);
 	virtual void calcSamples(short *buf, unsigned int count);
+	virtual bool isIdle();
 	// this is for the FRE support
 	virtual void dumpState();
 	virtual void readState();
@@ -35,7 +36,12 @@ public:
 	void calcEnvelopeTable();
 	unsigned char read(unsigned int adr);
 	void write(unsigned int adr, unsigned char byte);
+	// the write takes effect on the synthesis thread at the given cycle
+	void queueWrite(ClockCycle cycle, unsigned int frq, unsigned int adr, unsigned char byte) {
+		sound_write_reg(cycle, frq, writeReg, this, adr, byte);
+	}
 	void enableDisableChannel(unsigned int ch, bool enabled) {
+		sound_sync();
 		voice[ch].disabled = !enabled;
 	}
 	static void flipSidModel(void *n) {
@@ -112,19 +118,22 @@ private:
 	int extIn;
 	//
 	unsigned int clock();
+	static void writeReg(void *sid, unsigned int adr, unsigned char byte) {
+		((SIDsound *) sid)->write(adr, byte);
+	}
 	// Wave generator functions
-	inline static int waveTriangle(SIDVoice &v);
-	inline static int waveSaw(SIDVoice &v);
 	inline static int wavePulse(SIDVoice &v);
-	inline static int waveTriSaw(SIDVoice &v);
-	inline static int waveTriPulse(SIDVoice &v);
-	inline static int waveSawPulse(SIDVoice &v);
-	inline static int waveTriSawPulse(SIDVoice &v);
+	static void initWaveTables();
+	static unsigned short waveTables[2][8][4096];	// 6581 and 8580 dies
+	static unsigned short (*waveTable)[4096];		// tables of the selected model
 	inline static int waveNoise(SIDVoice &v);
 	inline static int getWaveSample(SIDVoice &v);
 	inline void updateShiftReg(SIDVoice &v);
 	// Envelope
 	inline int doEnvelopeGenerator(unsigned int cycles, SIDVoice &v);
+	static void initEnvelopeLfsrTables();
+	static unsigned short envLfsrIndex[0x8000];	// position of an LFSR state in its sequence
+	static unsigned short envLfsrState[0x7FFF];	// LFSR state at a position
 	static const unsigned int RateCountPeriod[16]; // Factors for A/D/S/R Timing
 	static const unsigned char envGenDRdivisors[256]; // For exponential approximation of D/R
 	static unsigned int masterVolume;
@@ -139,9 +148,18 @@ private:
 	void setResonance();
 	static void setFilterCutoff();
 	int filterOutput(unsigned int cycles, int Vi);
+	void calcFilterSteps();
 	int Vhp; // highpass
 	int Vbp; // bandpass
 	int Vlp; // lowpass
+	// filter integrated over a whole sample in one step
+	struct FilterStep {
+		double state[3][3];	// state transition over the cycles of a sample
+		double input[3];	// response to the input over the same cycles
+	} filterStep[2];		// for sidCyclesPerSampleInt and one more cycle
+	int filterStepW0;
+	int filterStepResonance;
+	unsigned int filterStepCycles;
 	//
 	unsigned char lastByteWritten;// Last value written to the SID
 	static unsigned int model_;
@@ -152,47 +170,40 @@ private:
 /*
 	Wave outputs
 */
-inline int SIDsound::waveTriangle(SIDVoice &v)
-{
-	unsigned int msb = (v.ring ? v.accu ^ v.modulatedBy->accu : v.accu)
-		& 0x800000;
-	// triangle wave 15 bit only
- 	return ((msb ? ~v.accu : v.accu) >> 11) & 0xFFF;
-}
-
-inline int SIDsound::waveSaw(SIDVoice &v)
-{
-	return v.accu >> 12;
-}
-
 inline int SIDsound::wavePulse(SIDVoice &v)
 {
 	// square wave starts high
 	return (v.test | (v.accu >= v.pw ? 0xFFF : 0x000));
 }
 
-inline int SIDsound::waveTriSaw(SIDVoice &v)
-{
-	unsigned int sm = (waveTriangle(v)) & (waveSaw(v));
-	return (sm>>1) & (sm<<1);
-}
-
-inline int SIDsound::waveTriPulse(SIDVoice &v)
-{
-	unsigned int sm = (waveTriangle(v)) & (wavePulse(v));
-	return (sm>>1) & (sm<<1);
-}
-
-inline int SIDsound::waveSawPulse(SIDVoice &v)
+inline int SIDsound::getWaveSample(SIDVoice &v)
 {
-	unsigned int sm = (waveSaw(v)) & (wavePulse(v));
-	return (sm >> 1) & (sm << 1);
-}
-
-inline int SIDsound::waveTriSawPulse(SIDVoice &v)
-{
-	unsigned int sm = (waveTriangle(v)) & (waveSaw(v)) & (wavePulse(v));
-	return (sm>>1) & (sm<<1);
+	switch (v.wave) {
+		case WAVE_NOISE:
+			return v.waveNoiseOut;
+		case WAVE_NONE:
+			if (v.accu) {
+				v.accu >>= 1;
+			}
+			return 0x000;
+		case WAVE_SAW:
+			return waveTable[v.wave][v.accu >> 12];
+		case WAVE_PULSE:
+		case WAVE_SAWPULSE:
+			return waveTable[v.wave][v.accu >> 12] & wavePulse(v);
+		case WAVE_TRI:
+		case WAVE_TRISAW:
+		case WAVE_TRIPULSE:
+		case WAVE_TRISAWPULSE:
+			{
+				// ring modulation replaces the MSB of the triangle in every mix with it
+				const unsigned int msb = (v.ring ? v.accu ^ v.modulatedBy->accu : v.accu) & 0x800000;
+				const int output = waveTable[v.wave][(msb | (v.accu & 0x7FFFFF)) >> 12];
+				return (v.wave & WAVE_PULSE) ? output & wavePulse(v) : output;
+			}
+		default:
+			return 0x000;
+	}
 }
 
 #endif
@@ -29,7 +29,6 @@ extern "C" FILE * __cdecl __iob_func(void)
 // forward declarations
 static void flipMaxFps(void *v);
 
-unsigned int	tick_50hz, tick_vsync, fps;
 static unsigned int framesShown = 50;
 static const unsigned int maxFpsValues[] = { 100, 60, 50, 25, 10 };
 static unsigned int maxFps = 100;
@@ -47,6 +46,9 @@ static void flipMaxFps(void *v)
 
 /* functions for Windows */
 #if defined(_WIN32)
+#include <io.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 static HANDLE				handle;
 static WIN32_FIND_DATA			rec;
@@ -173,22 +175,79 @@ int ad_makedirs(char *path)
 
 	return 1;
 }
+
+/* read-only view of a whole file */
+unsigned char *ad_map_file(const char *name, size_t &size)
+{
+	HANDLE file = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return NULL;
+	LARGE_INTEGER length;
+	if (!GetFileSizeEx(file, &length) || !length.QuadPart) {
+		CloseHandle(file);
+		return NULL;
+	}
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file);
+	if (!mapping)
+		return NULL;
+	// the view keeps the mapping alive
+	void *view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	if (!view)
+		return NULL;
+	size = (size_t) length.QuadPart;
+	return (unsigned char *) view;
+}
+
+void ad_unmap_file(unsigned char *data, size_t size)
+{
+	UnmapViewOfFile(data);
+}
+
+/* push buffered writes all the way to the disk */
+bool ad_fsync(FILE *fp)
+{
+	return !fflush(fp) && !_commit(_fileno(fp));
+}
+
+time_t ad_get_dir_mtime(const char *path)
+{
+	struct _stat st;
+
+	if (_stat(path, &st) || !(st.st_mode & _S_IFDIR))
+		return 0;
+	return st.st_mtime;
+}
 #endif /* end of Windows functions */
 
-#if defined(_WIN32) || defined(__EMSCRIPTEN__)
+#if defined(__EMSCRIPTEN__)
 static unsigned int timeelapsed;
+static unsigned int framesBehind;
+
+void ad_vsync_set_frame_rate(double framesPerSecond)
+{
+}
 
 void ad_vsync_init(void)
 {
 	timeelapsed = SDL_GetTicks();
 }
 
-bool ad_vsync(bool sync)
+bool ad_vsync_present_due(unsigned int speed)
 {
+	return true;
+}
+
+bool ad_vsync(unsigned int speed)
+{
+	const bool sync = speed == 1;
 	unsigned int time_limit = timeelapsed + 20;
 	static unsigned int nextFrameTime = timeelapsed + (1000 / maxFps);
 
 	timeelapsed = SDL_GetTicks();
+	framesBehind = sync && timeelapsed > time_limit ? (timeelapsed - time_limit) / 20 : 0;
 	if (sync) {
 		if (time_limit > timeelapsed) {
 			int nr10ms = ((time_limit - timeelapsed) / 10) * 10;
@@ -209,6 +268,11 @@ bool ad_vsync(bool sync)
 	}
 }
 
+unsigned int ad_vsync_frames_behind(void)
+{
+	return framesBehind;
+}
+
 unsigned int ad_get_fps(unsigned int &framesDrawn)
 {
 	static unsigned int fps = 100;
@@ -225,6 +289,181 @@ unsigned int ad_get_fps(unsigned int &framesDrawn)
 		g_TotFrames++;
 	return fps;
 }
+
+void ad_get_jitter(unsigned int &meanUs, unsigned int &maxUs)
+{
+	meanUs = maxUs = 0;
+}
+#endif
+
+#if !defined(__EMSCRIPTEN__)
+/*
+	Frame pacer. Deadlines are absolute nanoseconds on the monotonic clock,
+	advanced by the exact frame period of the emulated machine so rounding
+	never builds up. The wait sleeps until shortly before the deadline and
+	spins through the rest, as the wakeup latency of the scheduler is far
+	coarser than that.
+*/
+#if defined(_WIN32)
+#define PACER_SPIN_NS 2000000ULL	// SDL_Delay may oversleep by a tick
+#else
+#include <time.h>
+#include <errno.h>
+#define PACER_SPIN_NS 500000ULL
+#endif
+#define PACER_NS_PER_SEC 1000000000ULL
+#define PACER_RESYNC_FRAMES 5		// off by more frames than this, start over
+#define PACER_PRESENT_SLACK 1000000ULL	// tolerance of the frame rate limit
+
+static Uint64 framePeriod = PACER_NS_PER_SEC / 50;
+static Uint64 frameDeadline;
+static Uint64 nextPresentTime;
+static bool presentDue = true;	// decided before the frame is emulated
+static Uint64 statsStart;
+static unsigned int statsFrames;
+static Uint64 latenessSum, latenessMax;
+static unsigned int latenessCount;
+static unsigned int speedPercent = 100;
+static unsigned int framesDrawnPerSec = 50;
+static unsigned int jitterMeanUs, jitterMaxUs;
+static unsigned int framesBehind;	// whole frame periods the last frame ended late
+
+static Uint64 getTimeNs()
+{
+#if defined(_WIN32)
+	static const Uint64 frq = SDL_GetPerformanceFrequency();
+	const Uint64 count = SDL_GetPerformanceCounter();
+	return (count / frq) * PACER_NS_PER_SEC + (count % frq) * PACER_NS_PER_SEC / frq;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (Uint64) ts.tv_sec * PACER_NS_PER_SEC + ts.tv_nsec;
+#endif
+}
+
+static void waitUntil(Uint64 deadline)
+{
+	const Uint64 now = getTimeNs();
+
+	if (now + PACER_SPIN_NS < deadline) {
+		const Uint64 wakeup = deadline - PACER_SPIN_NS;
+#if defined(_WIN32)
+		SDL_Delay((Uint32) ((wakeup - now) / 1000000));
+#elif defined(__APPLE__)
+		// no clock_nanosleep here
+		struct timespec ts;
+		ts.tv_sec = (time_t) ((wakeup - now) / PACER_NS_PER_SEC);
+		ts.tv_nsec = (long) ((wakeup - now) % PACER_NS_PER_SEC);
+		nanosleep(&ts, NULL);
+#else
+		struct timespec ts;
+		ts.tv_sec = (time_t) (wakeup / PACER_NS_PER_SEC);
+		ts.tv_nsec = (long) (wakeup % PACER_NS_PER_SEC);
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			;
+#endif
+	}
+	while (getTimeNs() < deadline)
+		;
+}
+
+static void updateStats(Uint64 now)
+{
+	const Uint64 elapsed = now - statsStart;
+
+	statsFrames++;
+	if (elapsed < 2 * PACER_NS_PER_SEC)
+		return;
+	speedPercent = (unsigned int) (statsFrames * framePeriod * 100 / elapsed);
+	framesDrawnPerSec = (unsigned int) ((framesShown * PACER_NS_PER_SEC + elapsed / 2) / elapsed);
+	jitterMeanUs = latenessCount ? (unsigned int) (latenessSum / latenessCount / 1000) : 0;
+	jitterMaxUs = (unsigned int) (latenessMax / 1000);
+	statsStart = now;
+	statsFrames = framesShown = latenessCount = 0;
+	latenessSum = latenessMax = 0;
+}
+
+void ad_vsync_set_frame_rate(double framesPerSecond)
+{
+	framePeriod = (Uint64) (PACER_NS_PER_SEC / framesPerSecond + 0.5);
+}
+
+void ad_vsync_init(void)
+{
+	frameDeadline = nextPresentTime = statsStart = getTimeNs();
+	statsFrames = framesShown = latenessCount = 0;
+	latenessSum = latenessMax = 0;
+}
+
+/*
+	Tells if the upcoming frame ends late enough to be shown, so that frames
+	thrown away by the frame rate limit are not rendered at all. 'speed' is
+	the multiplier of the machine frame rate, 0 is unlimited.
+*/
+bool ad_vsync_present_due(unsigned int speed)
+{
+	const Uint64 frameEnd = speed ? frameDeadline + framePeriod / speed : getTimeNs();
+
+	presentDue = frameEnd + PACER_PRESENT_SLACK >= nextPresentTime;
+	return presentDue;
+}
+
+bool ad_vsync(unsigned int speed)
+{
+	Uint64 now = getTimeNs();
+
+	if (speed) {
+		const Uint64 period = framePeriod / speed;
+		const Uint64 resyncLimit = PACER_RESYNC_FRAMES * period;
+		frameDeadline += period;
+		framesBehind = 0;
+		if (now > frameDeadline + resyncLimit || frameDeadline > now + resyncLimit) {
+			// a stall or the speed limit just turned back on
+			frameDeadline = now;
+		} else {
+			if (now < frameDeadline) {
+				waitUntil(frameDeadline);
+				now = getTimeNs();
+			}
+			const Uint64 lateness = now - frameDeadline;
+			latenessSum += lateness;
+			if (lateness > latenessMax)
+				latenessMax = lateness;
+			latenessCount++;
+			framesBehind = (unsigned int) (lateness / period);
+		}
+	} else {
+		frameDeadline = now;
+		framesBehind = 0;
+	}
+	updateStats(now);
+	if (!presentDue)
+		return false;
+	nextPresentTime = now + PACER_NS_PER_SEC / maxFps;
+	framesShown++;
+	return true;
+}
+
+/*
+	How many frame periods of the machine the last paced frame ended
+	after its deadline, 0 when on time or not paced
+*/
+unsigned int ad_vsync_frames_behind(void)
+{
+	return framesBehind;
+}
+
+unsigned int ad_get_fps(unsigned int &framesDrawn)
+{
+	framesDrawn = framesDrawnPerSec;
+	return speedPercent;
+}
+
+void ad_get_jitter(unsigned int &meanUs, unsigned int &maxUs)
+{
+	meanUs = jitterMeanUs;
+	maxUs = jitterMaxUs;
+}
 #endif
 
 #if !defined(_WIN32)
@@ -238,7 +477,8 @@ unsigned int ad_get_fps(unsigned int &framesDrawn)
 #include <ctype.h>
 #include <string.h>
 #include <stdlib.h>
-#include <signal.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -248,7 +488,6 @@ glob_t		gl;
 unsigned int	gl_curr;
 unsigned int	gl_currsize;
 char		temp[512];
-char		sem_vsync, sem_fps;
 
 void ad_exit_drive_selector()
 {
@@ -341,92 +580,216 @@ int ad_makedirs(char *path)
 
 	return 1;
 }
-#endif
 
-#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
-void _ad_vsync_sigalrm_handler(int signal)
+/* read-only view of a whole file */
+unsigned char *ad_map_file(const char *name, size_t &size)
 {
-	sem_vsync = 0x01;
+	struct stat st;
+	int fd = open(name, O_RDONLY);
 
-	// Refresh FPS every 3 seconds. To avoid race condition, do
-	// it in the next call if tick_vsync is locked.
-	if (++tick_50hz >= 3*20 && sem_fps != 0x00) {
-		fps = (int) (50 * ((double) tick_vsync / (double) tick_50hz));
-		tick_vsync = 0;
-		tick_50hz = 0;
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) || !st.st_size) {
+		close(fd);
+		return NULL;
 	}
+	void *data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	// the mapping stays valid without the descriptor
+	close(fd);
+	if (data == MAP_FAILED)
+		return NULL;
+	size = (size_t) st.st_size;
+	return (unsigned char *) data;
 }
 
-void ad_vsync_init(void)
+void ad_unmap_file(unsigned char *data, size_t size)
 {
-	struct sigaction ac;
-
-	// Initialization
-	sem_vsync = 0x01;
-	sem_fps = 0x01;
-	tick_vsync = 0;
-	tick_50hz = 0;
-	fps = 50;
-
-	ac.sa_handler = _ad_vsync_sigalrm_handler;
-	sigemptyset(&ac.sa_mask);
-	ac.sa_flags = 0;
-
-	if (sigaction(SIGALRM, &ac, NULL) == 0) ualarm(100, 20000);
+	munmap(data, size);
 }
 
-bool ad_vsync(bool sync)
+/* push buffered writes all the way to the disk */
+bool ad_fsync(FILE *fp)
 {
-	if (sync) {
-		while (sem_vsync == 0x00) usleep(VSYNC_LATENCY);
-		sem_vsync = 0x00;
-	}
-	sem_fps = 0x00;
-	tick_vsync++;
-	sem_fps = 0x01;
-	return true;
+	return !fflush(fp) && !fsync(fileno(fp));
 }
 
-unsigned int ad_get_fps(unsigned int &framesDrawn)
+time_t ad_get_dir_mtime(const char *path)
 {
-	framesDrawn = fps;
-	return fps << 1;
-}
+	struct stat st;
 
+	if (stat(path, &st) || !S_ISDIR(st.st_mode))
+		return 0;
+	return st.st_mtime;
+}
 #endif
 
 #if defined(__EMSCRIPTEN__) || defined(ZIP_SUPPORT)
 #pragma comment(lib, "zlibstat.lib")
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
 #include "zlib/unzip.h"
 
-bool zipOpen(const char *zipName, unsigned char *buffer, unsigned int &bufferSize)
+/*
+	Inflated members are kept in a byte budgeted cache, the least recently
+	used ones are dropped first. An entry is only reused while the size and
+	CRC in the central directory of the archive still match.
+*/
+#define ZIP_CACHE_ENTRIES 16
+#define ZIP_CACHE_BUDGET (16 << 20)
+
+static struct ZipCacheEntry {
+	char zipName[MAX_PATH];
+	char memberName[MAX_PATH];
+	unsigned long crc;
+	unsigned int size;
+	unsigned char *data;
+	unsigned int lastUse;
+} zipCache[ZIP_CACHE_ENTRIES];
+static unsigned int zipCacheBytes = 0;
+static unsigned int zipCacheClock = 0;
+
+static void zipCacheEvict(unsigned int i)
+{
+	zipCacheBytes -= zipCache[i].size;
+	delete [] zipCache[i].data;
+	zipCache[i].data = NULL;
+}
+
+static bool zipHasExtension(const char *name, const char *extensions)
+{
+	const char *ext = strrchr(name, '.');
+	if (!ext || strlen(ext) != 4)
+		return false;
+	for (const char *e = extensions; e[0] == '.'; e += 4) {
+		unsigned int i;
+		for (i = 1; i < 4 && tolower(ext[i]) == e[i]; i++) ;
+		if (i == 4)
+			return true;
+	}
+	return false;
+}
+
+/*
+	Returns the named member, or the first one with any of the given
+	extensions (like ".d64.prg"). The data is owned by the cache and stays
+	valid until the next call.
+*/
+unsigned char *zipOpen(const char *zipName, const char *memberName, const char *extensions,
+	unsigned int &size, char *foundName)
 {
 	unzFile zipFile = unzOpen(zipName);
-	   
-	if (zipFile) {
-		if (unzGoToFirstFile(zipFile) == UNZ_OK) {
-			unz_file_info zipfileinfo;
-			char zippedName[512];
-			if (unzOpenCurrentFile(zipFile) == UNZ_OK) {
-				int result = unzGetCurrentFileInfo(zipFile, &zipfileinfo, zippedName, 512, NULL, 0, NULL, 0);
-				fprintf(stderr, "First file in ZIP: %s\n", zippedName);
-				unsigned int fsize = zipfileinfo.uncompressed_size;
-
-				if (fsize > bufferSize) 
-					fsize = bufferSize;
-				bufferSize = fsize;
-				unzReadCurrentFile(zipFile, buffer, fsize);
-				unzCloseCurrentFile(zipFile);
-				unzClose(zipFile);
-				return true;
+	unz_file_info zipfileinfo;
+	char zippedName[MAX_PATH];
+	bool found = false;
+
+	if (!zipFile)
+		return NULL;
+	int result = unzGoToFirstFile(zipFile);
+	while (result == UNZ_OK) {
+		if (unzGetCurrentFileInfo(zipFile, &zipfileinfo, zippedName, MAX_PATH, NULL, 0, NULL, 0) != UNZ_OK)
+			break;
+		if (memberName && memberName[0] ? !strcmp(zippedName, memberName)
+				: !extensions || zipHasExtension(zippedName, extensions)) {
+			found = true;
+			break;
+		}
+		result = unzGoToNextFile(zipFile);
+	}
+	if (!found) {
+		unzClose(zipFile);
+		return NULL;
+	}
+	if (foundName)
+		strcpy(foundName, zippedName);
+	size = (unsigned int) zipfileinfo.uncompressed_size;
+
+	unsigned int i, slot = 0;
+	for (i = 0; i < ZIP_CACHE_ENTRIES; i++) {
+		ZipCacheEntry &e = zipCache[i];
+		if (e.data && e.crc == zipfileinfo.crc && e.size == size
+				&& !strcmp(e.zipName, zipName) && !strcmp(e.memberName, zippedName)) {
+			unzClose(zipFile);
+			e.lastUse = ++zipCacheClock;
+			return e.data;
+		}
+	}
+
+	// make room, a member over the budget still gets a slot of its own
+	for (;;) {
+		unsigned int oldest = ZIP_CACHE_ENTRIES, used = 0;
+		for (i = 0; i < ZIP_CACHE_ENTRIES; i++) {
+			if (!zipCache[i].data) {
+				slot = i;
+				continue;
 			}
+			used++;
+			if (oldest == ZIP_CACHE_ENTRIES || zipCache[i].lastUse < zipCache[oldest].lastUse)
+				oldest = i;
 		}
+		if (!used || (used < ZIP_CACHE_ENTRIES && zipCacheBytes + size <= ZIP_CACHE_BUDGET))
+			break;
+		zipCacheEvict(oldest);
 	}
-	return false;
+
+	unsigned char *data = new unsigned char[size ? size : 1];
+	if (unzOpenCurrentFile(zipFile) != UNZ_OK
+			|| unzReadCurrentFile(zipFile, data, size) != (int) size) {
+		delete [] data;
+		unzClose(zipFile);
+		return NULL;
+	}
+	unzCloseCurrentFile(zipFile);
+	unzClose(zipFile);
+	fprintf(stderr, "Inflated from ZIP: %s (%u bytes)\n", zippedName, size);
+
+	ZipCacheEntry &e = zipCache[slot];
+	strncpy(e.zipName, zipName, MAX_PATH - 1);
+	e.zipName[MAX_PATH - 1] = 0;
+	strcpy(e.memberName, zippedName);
+	e.crc = zipfileinfo.crc;
+	e.size = size;
+	e.data = data;
+	e.lastUse = ++zipCacheClock;
+	zipCacheBytes += size;
+	return data;
+}
+
+static int zipCompareNames(const void *a, const void *b)
+{
+	return strcmp((const char *) a, (const char *) b);
+}
+
+// names of the members with any of the extensions, sorted
+unsigned int zipListMembers(const char *zipName, const char *extensions, char (*names)[MAX_PATH],
+	unsigned int maxNames)
+{
+	unzFile zipFile = unzOpen(zipName);
+	unz_file_info zipfileinfo;
+	unsigned int count = 0;
+
+	if (!zipFile)
+		return 0;
+	int result = unzGoToFirstFile(zipFile);
+	while (result == UNZ_OK && count < maxNames) {
+		if (unzGetCurrentFileInfo(zipFile, &zipfileinfo, names[count], MAX_PATH, NULL, 0, NULL, 0) != UNZ_OK)
+			break;
+		if (zipHasExtension(names[count], extensions))
+			count++;
+		result = unzGoToNextFile(zipFile);
+	}
+	unzClose(zipFile);
+	qsort(names, count, MAX_PATH, zipCompareNames);
+	return count;
 }
 #else
-bool zipOpen(const char *zipName, unsigned char *buffer, unsigned int &bufferSize)
+unsigned char *zipOpen(const char *, const char *, const char *, unsigned int &, char *)
 {
-	return false;
+	return NULL;
+}
+
+unsigned int zipListMembers(const char *, const char *, char (*)[MAX_PATH], unsigned int)
+{
+	return 0;
 }
 #endif
@@ -24,13 +24,14 @@ enum UI_FileTypes {
 	FT_VOLUME
 };
 
+#include <stdio.h>
+#include <time.h>
 #include "types.h"
 
 #if !defined(_WIN32) || defined(__EMSCRIPTEN__)
 #define UNIX
 #include <unistd.h>
 #define MAX_PATH 256
-#define VSYNC_LATENCY 200
 #else
 #include <windows.h>
 #endif
@@ -45,12 +46,26 @@ int		ad_find_file_close(void);
 int		ad_get_curr_dir(char *pathstring);
 int		ad_makedirs(char *temp);
 void	ad_exit_drive_selector();
+// read-only view of a whole file, NULL if it cannot be mapped
+unsigned char	*ad_map_file(const char *name, size_t &size);
+void	ad_unmap_file(unsigned char *data, size_t size);
+bool	ad_fsync(FILE *fp);
+// modification time of a directory, 0 if it cannot be read
+time_t	ad_get_dir_mtime(const char *path);
 
 extern void				ad_vsync_init(void);
-extern bool				ad_vsync(bool sync);
+extern void				ad_vsync_set_frame_rate(double framesPerSecond);
+extern bool				ad_vsync_present_due(unsigned int speed);
+extern bool				ad_vsync(unsigned int speed);
+extern unsigned int		ad_vsync_frames_behind(void);
 extern unsigned int		ad_get_fps(unsigned int &framesDrawn);
+extern void				ad_get_jitter(unsigned int &meanUs, unsigned int &maxUs);
 
-extern bool zipOpen(const char *zipName, unsigned char *buffer, unsigned int &bufferSize);
+// inflated ZIP member, owned by the archive cache
+extern unsigned char *zipOpen(const char *zipName, const char *memberName, const char *extensions,
+	unsigned int &size, char *foundName);
+extern unsigned int zipListMembers(const char *zipName, const char *extensions, char (*names)[MAX_PATH],
+	unsigned int maxNames);
 
 class Sync {
 public:
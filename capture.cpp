@@ -0,0 +1,564 @@
+#include <stdio.h>
+#include <string.h>
+#include "capture.h"
+#include "video.h"
+
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+#endif
+
+// frames waiting for the writer thread; when full, new frames are dropped
+#define VIDEO_QUEUE_LENGTH 16
+#define VIDEO_FRAME_SIZE (SCREENX * SCREENY)
+
+static unsigned int videoCaptureFormat = CAPTURE_Y4M;
+static unsigned int videoFileFormat;
+static FILE *videoFile = NULL;
+static bool videoPiped = false;
+static unsigned char videoQueue[VIDEO_QUEUE_LENGTH][VIDEO_FRAME_SIZE];
+static unsigned char yuvFrame[VIDEO_FRAME_SIZE * 3];
+static unsigned int videoQueueHead, videoQueueTail, videoQueueCount;
+static unsigned int videoFramesWritten, videoFramesDropped;
+static bool videoWriterQuit;
+static SDL_Thread *videoWriter = NULL;
+static SDL_mutex *videoLock = NULL;
+static SDL_cond *videoCond = NULL;
+
+static const char *videoCaptureFormatLabel()
+{
+	const char *label[] = { "RAW", "Y4M" };
+	return label[videoCaptureFormat];
+}
+
+static void flipVideoCaptureFormat(void *)
+{
+	videoCaptureFormat = (videoCaptureFormat + 1) % 2;
+}
+
+rvar_t captureSettings[] = {
+	{ "Video capture format", "VideoCaptureFormat", flipVideoCaptureFormat, &videoCaptureFormat, RVAR_STRING_FLIPLIST, videoCaptureFormatLabel },
+	{ "", "", NULL, NULL, RVAR_NULL, NULL }
+};
+
+static unsigned char clampYuv(int v)
+{
+	return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+static void writeFrame(const unsigned char *frame)
+{
+	if (videoFileFormat == CAPTURE_Y4M) {
+		const Yuv *yuv = palette_get_yuv();
+		unsigned char *y = yuvFrame;
+		unsigned char *u = y + VIDEO_FRAME_SIZE;
+		unsigned char *v = u + VIDEO_FRAME_SIZE;
+
+		for(unsigned int i = 0; i < VIDEO_FRAME_SIZE; i++) {
+			const Yuv &c = yuv[frame[i]];
+			y[i] = c.y;
+			u[i] = clampYuv(c.u);
+			v[i] = clampYuv(c.v);
+		}
+		fputs("FRAME\n", videoFile);
+		fwrite(yuvFrame, 1, sizeof(yuvFrame), videoFile);
+	} else {
+		fwrite(frame, 1, VIDEO_FRAME_SIZE, videoFile);
+	}
+	videoFramesWritten++;
+}
+
+static int videoWriterThread(void *)
+{
+	SDL_LockMutex(videoLock);
+	for(;;) {
+		while (!videoQueueCount && !videoWriterQuit)
+			SDL_CondWait(videoCond, videoLock);
+		// drain the queue before quitting
+		if (!videoQueueCount)
+			break;
+		const unsigned char *frame = videoQueue[videoQueueTail];
+		SDL_UnlockMutex(videoLock);
+		writeFrame(frame);
+		SDL_LockMutex(videoLock);
+		videoQueueTail = (videoQueueTail + 1) % VIDEO_QUEUE_LENGTH;
+		videoQueueCount--;
+	}
+	SDL_UnlockMutex(videoLock);
+	return 0;
+}
+
+static bool writePaletteFile(const char *name)
+{
+	char palName[512];
+	const unsigned int *palette = palette_get_rgb();
+
+	sprintf(palName, "%.500s.pal", name);
+	FILE *fp = fopen(palName, "wb");
+	if (!fp)
+		return false;
+	for(unsigned int i = 0; i < 256; i++) {
+		unsigned char rgb[3];
+		rgb[0] = (palette[i] >> 16) & 0xFF;
+		rgb[1] = (palette[i] >> 8) & 0xFF;
+		rgb[2] = palette[i] & 0xFF;
+		fwrite(rgb, 1, 3, fp);
+	}
+	fclose(fp);
+	return true;
+}
+
+static unsigned int gcd(unsigned int a, unsigned int b)
+{
+	while (b) {
+		unsigned int r = a % b;
+		a = b;
+		b = r;
+	}
+	return a;
+}
+
+/*
+	Starts capturing every emulated frame to a file or,
+	if the name starts with '|', to the standard input of a command.
+	The frame rate of the machine is given as a fraction.
+*/
+bool video_capture_start(const char *name, unsigned int rateNum, unsigned int rateDen)
+{
+	if (videoFile)
+		video_capture_stop();
+
+	videoFileFormat = videoCaptureFormat;
+	videoPiped = name[0] == '|';
+	videoFile = videoPiped ? popen(name + 1, "w") : fopen(name, "wb");
+	if (!videoFile) {
+		fprintf(stderr, "Could not open video capture output %s\n", name);
+		return false;
+	}
+	if (videoFileFormat == CAPTURE_Y4M) {
+		const unsigned int d = gcd(rateNum, rateDen);
+		fprintf(videoFile, "YUV4MPEG2 W%u H%u F%u:%u Ip A1:1 C444 XCOLORRANGE=FULL\n",
+			SCREENX, SCREENY, rateNum / d, rateDen / d);
+	} else if (!videoPiped) {
+		writePaletteFile(name);
+	}
+	videoQueueHead = videoQueueTail = videoQueueCount = 0;
+	videoFramesWritten = videoFramesDropped = 0;
+	videoWriterQuit = false;
+	videoLock = SDL_CreateMutex();
+	videoCond = SDL_CreateCond();
+	if (videoLock && videoCond)
+		videoWriter = SDL_CreateThread(videoWriterThread, "VideoCapture", NULL);
+	if (!videoWriter)
+		fprintf(stderr, "No video capture thread, writing frames synchronously.\n");
+	fprintf(stderr, "Video capture started: %s (%s)\n", name, videoCaptureFormatLabel());
+	return true;
+}
+
+void video_capture_stop()
+{
+	if (!videoFile)
+		return;
+	if (videoWriter) {
+		SDL_LockMutex(videoLock);
+		videoWriterQuit = true;
+		SDL_CondSignal(videoCond);
+		SDL_UnlockMutex(videoLock);
+		SDL_WaitThread(videoWriter, NULL);
+		videoWriter = NULL;
+	}
+	if (videoCond) {
+		SDL_DestroyCond(videoCond);
+		videoCond = NULL;
+	}
+	if (videoLock) {
+		SDL_DestroyMutex(videoLock);
+		videoLock = NULL;
+	}
+	if (videoPiped)
+		pclose(videoFile);
+	else
+		fclose(videoFile);
+	videoFile = NULL;
+	fprintf(stderr, "Video capture stopped: %u frames written, %u dropped.\n",
+		videoFramesWritten, videoFramesDropped);
+}
+
+bool video_capture_active()
+{
+	return videoFile != NULL;
+}
+
+const char *video_capture_extension()
+{
+	return videoCaptureFormat == CAPTURE_Y4M ? "y4m" : "raw";
+}
+
+/*
+	Queues the visible part of the frame; src points to the top left visible pixel
+*/
+void video_capture_frame(const unsigned char *src, unsigned int pitch)
+{
+	unsigned char *frame;
+
+	if (!videoFile)
+		return;
+	if (videoWriter) {
+		SDL_LockMutex(videoLock);
+		if (videoQueueCount == VIDEO_QUEUE_LENGTH) {
+			videoFramesDropped++;
+			SDL_UnlockMutex(videoLock);
+			return;
+		}
+		frame = videoQueue[videoQueueHead];
+		SDL_UnlockMutex(videoLock);
+	} else {
+		frame = videoQueue[0];
+	}
+	for(unsigned int i = 0; i < SCREENY; i++)
+		memcpy(frame + i * SCREENX, src + i * pitch, SCREENX);
+	if (videoWriter) {
+		SDL_LockMutex(videoLock);
+		videoQueueHead = (videoQueueHead + 1) % VIDEO_QUEUE_LENGTH;
+		videoQueueCount++;
+		SDL_CondSignal(videoCond);
+		SDL_UnlockMutex(videoLock);
+	} else {
+		writeFrame(frame);
+	}
+}
+
+/* ---------- Screenshots ---------- */
+
+// screenshots are encoded from the framebuffer on a writer thread
+#define SCREENSHOT_QUEUE_LENGTH 8
+
+struct Screenshot {
+	char prefix[256];		// the file is named prefixNNNNNN.bmp by the writer
+	unsigned int palette[256];
+	unsigned char pixels[VIDEO_FRAME_SIZE];
+};
+
+static Screenshot shotQueue[SCREENSHOT_QUEUE_LENGTH];
+static unsigned int shotQueueHead, shotQueueTail, shotQueueCount;
+static bool shotWriterQuit;
+static SDL_Thread *shotWriter = NULL;
+static SDL_mutex *shotLock = NULL;
+static SDL_cond *shotCond = NULL;
+
+static void putLE(unsigned char *p, unsigned int value, unsigned int bytes)
+{
+	while (bytes--) {
+		*p++ = value & 0xFF;
+		value >>= 8;
+	}
+}
+
+/*
+	Writes an 8 bit indexed, bottom-up Windows bitmap at native resolution
+*/
+static bool writeIndexedBMP(const Screenshot &shot, const char *name)
+{
+	const unsigned int headerSize = 14 + 40 + 256 * 4;
+	unsigned char header[headerSize];
+	unsigned int i;
+
+	FILE *fp = fopen(name, "wb");
+	if (!fp)
+		return false;
+	memset(header, 0, headerSize);
+	// file header
+	header[0] = 'B';
+	header[1] = 'M';
+	putLE(header + 2, headerSize + VIDEO_FRAME_SIZE, 4);
+	putLE(header + 10, headerSize, 4);
+	// info header
+	putLE(header + 14, 40, 4);
+	putLE(header + 18, SCREENX, 4);
+	putLE(header + 22, SCREENY, 4);
+	putLE(header + 26, 1, 2);
+	putLE(header + 28, 8, 2);
+	putLE(header + 34, VIDEO_FRAME_SIZE, 4);
+	putLE(header + 46, 256, 4);
+	// palette in BGR0 order, same as our RGB palette entries
+	for(i = 0; i < 256; i++)
+		putLE(header + 54 + i * 4, shot.palette[i] & 0xFFFFFF, 4);
+	bool ok = fwrite(header, 1, headerSize, fp) == headerSize;
+	// rows are stored bottom-up, SCREENX needs no padding
+	for(i = SCREENY; ok && i--; )
+		ok = fwrite(shot.pixels + i * SCREENX, 1, SCREENX, fp) == SCREENX;
+	fclose(fp);
+	return ok;
+}
+
+static bool writeScreenshot(const Screenshot &shot)
+{
+	// only touched by the writer, so queued shots never get the same name
+	static char lastPrefix[256] = "";
+	static unsigned int shotNumber = 0;
+	char name[512];
+	FILE *fp;
+
+	if (strcmp(lastPrefix, shot.prefix)) {
+		strcpy(lastPrefix, shot.prefix);
+		shotNumber = 0;
+	}
+	// first free name from the last one used on
+	do {
+		sprintf(name, "%s%06u.bmp", shot.prefix, shotNumber++);
+		if ((fp = fopen(name, "rb")))
+			fclose(fp);
+	} while (fp && shotNumber < 1000000);
+	if (!fp && writeIndexedBMP(shot, name)) {
+		fprintf(stderr, "Screenshot saved: %s\n", name);
+		return true;
+	}
+	fprintf(stderr, "Could not save screenshot: %s\n", name);
+	return false;
+}
+
+static int screenshotWriterThread(void *)
+{
+	SDL_LockMutex(shotLock);
+	for(;;) {
+		while (!shotQueueCount && !shotWriterQuit)
+			SDL_CondWait(shotCond, shotLock);
+		if (!shotQueueCount)
+			break;
+		const Screenshot &shot = shotQueue[shotQueueTail];
+		SDL_UnlockMutex(shotLock);
+		writeScreenshot(shot);
+		SDL_LockMutex(shotLock);
+		shotQueueTail = (shotQueueTail + 1) % SCREENSHOT_QUEUE_LENGTH;
+		shotQueueCount--;
+		SDL_CondBroadcast(shotCond);
+	}
+	SDL_UnlockMutex(shotLock);
+	return 0;
+}
+
+/*
+	Takes a screenshot of the visible screen area with the active palette,
+	src points to the top left visible pixel. The file gets the next free
+	serial number after the prefix, all file access is left to the writer.
+*/
+bool screenshot_save(const char *prefix, const unsigned char *src, unsigned int pitch)
+{
+	Screenshot *shot;
+	static Screenshot syncShot;
+
+	if (!shotWriter && !shotLock) {
+		shotQueueHead = shotQueueTail = shotQueueCount = 0;
+		shotWriterQuit = false;
+		shotLock = SDL_CreateMutex();
+		shotCond = SDL_CreateCond();
+		if (shotLock && shotCond)
+			shotWriter = SDL_CreateThread(screenshotWriterThread, "Screenshots", NULL);
+	}
+	if (shotWriter) {
+		SDL_LockMutex(shotLock);
+		// screenshots are not dropped, wait for a free slot
+		while (shotQueueCount == SCREENSHOT_QUEUE_LENGTH)
+			SDL_CondWait(shotCond, shotLock);
+		shot = shotQueue + shotQueueHead;
+		SDL_UnlockMutex(shotLock);
+	} else {
+		shot = &syncShot;
+	}
+	strncpy(shot->prefix, prefix, sizeof(shot->prefix) - 1);
+	shot->prefix[sizeof(shot->prefix) - 1] = 0;
+	memcpy(shot->palette, palette_get_rgb(), sizeof(shot->palette));
+	for(unsigned int i = 0; i < SCREENY; i++)
+		memcpy(shot->pixels + i * SCREENX, src + i * pitch, SCREENX);
+	if (shotWriter) {
+		SDL_LockMutex(shotLock);
+		shotQueueHead = (shotQueueHead + 1) % SCREENSHOT_QUEUE_LENGTH;
+		shotQueueCount++;
+		SDL_CondBroadcast(shotCond);
+		SDL_UnlockMutex(shotLock);
+		return true;
+	}
+	return writeScreenshot(*shot);
+}
+
+/*
+	Writes out pending screenshots and stops the writer thread
+*/
+void screenshot_flush()
+{
+	if (shotWriter) {
+		SDL_LockMutex(shotLock);
+		shotWriterQuit = true;
+		SDL_CondBroadcast(shotCond);
+		SDL_UnlockMutex(shotLock);
+		SDL_WaitThread(shotWriter, NULL);
+		shotWriter = NULL;
+	}
+	if (shotCond) {
+		SDL_DestroyCond(shotCond);
+		shotCond = NULL;
+	}
+	if (shotLock) {
+		SDL_DestroyMutex(shotLock);
+		shotLock = NULL;
+	}
+}
+
+/* ---------- Audio capture ---------- */
+
+// about 20 seconds at 48 kHz between the sound thread and the writer
+#define AUDIO_BUFFER_SIZE (1 << 20)
+
+static FILE *audioFile = NULL;
+static bool audioPiped = false;
+static short audioBuffer[AUDIO_BUFFER_SIZE];
+static unsigned int audioHead, audioTail, audioCount;
+static unsigned int audioSamplesWritten, audioSamplesDropped;
+static bool audioWriterQuit;
+static SDL_Thread *audioWriter = NULL;
+static SDL_mutex *audioLock = NULL;
+static SDL_cond *audioCond = NULL;
+static wav_header_t wavHeader;
+
+static void setWavHeader(unsigned int sampleRate, unsigned int dataSize)
+{
+	memcpy(wavHeader.riff, "RIFF", 4);
+	wavHeader.rLen = sizeof(wav_header_t) - 8 + dataSize;
+	memcpy(wavHeader.WAVEfmt, "WAVEfmt ", 8);
+	wavHeader.fLen = 16;
+	wavHeader.wFormatTag = 1;
+	wavHeader.nChannels = 1;
+	wavHeader.nSamplesPerSec = sampleRate;
+	wavHeader.nAvgBytesPerSec = sampleRate * 2;
+	wavHeader.nBlockAlign = 2;
+	wavHeader.nBitsPerSample = 16;
+	memcpy(wavHeader.datastr, "data", 4);
+	wavHeader.data_size = dataSize;
+}
+
+static int audioWriterThread(void *)
+{
+	SDL_LockMutex(audioLock);
+	for(;;) {
+		while (!audioCount && !audioWriterQuit)
+			SDL_CondWait(audioCond, audioLock);
+		if (!audioCount)
+			break;
+		// the region up to the wrap point is ours until audioTail moves
+		const unsigned int chunk = audioCount < AUDIO_BUFFER_SIZE - audioTail ? audioCount : AUDIO_BUFFER_SIZE - audioTail;
+		const short *samples = audioBuffer + audioTail;
+		SDL_UnlockMutex(audioLock);
+		fwrite(samples, 2, chunk, audioFile);
+		SDL_LockMutex(audioLock);
+		audioTail = (audioTail + chunk) % AUDIO_BUFFER_SIZE;
+		audioCount -= chunk;
+		audioSamplesWritten += chunk;
+	}
+	SDL_UnlockMutex(audioLock);
+	return 0;
+}
+
+/*
+	Starts recording the mixed sound output as a 16 bit mono WAV file or,
+	if the name starts with '|', to the standard input of a command
+*/
+bool audio_capture_start(const char *name, unsigned int sampleRate)
+{
+	if (audioFile)
+		audio_capture_stop();
+
+	audioPiped = name[0] == '|';
+	FILE *fp = audioPiped ? popen(name + 1, "w") : fopen(name, "wb");
+	if (!fp) {
+		fprintf(stderr, "Could not open audio capture output %s\n", name);
+		return false;
+	}
+	// size unknown yet, patched on stop when not piped
+	setWavHeader(sampleRate, audioPiped ? 0xFFFFFFFF - sizeof(wav_header_t) : 0);
+	fwrite(&wavHeader, sizeof(wavHeader), 1, fp);
+	audioHead = audioTail = audioCount = 0;
+	audioSamplesWritten = audioSamplesDropped = 0;
+	audioWriterQuit = false;
+	if (!audioLock)
+		audioLock = SDL_CreateMutex();
+	audioCond = SDL_CreateCond();
+	SDL_LockMutex(audioLock);
+	audioFile = fp;
+	SDL_UnlockMutex(audioLock);
+	if (audioLock && audioCond)
+		audioWriter = SDL_CreateThread(audioWriterThread, "AudioCapture", NULL);
+	if (!audioWriter)
+		fprintf(stderr, "No audio capture thread, writing samples synchronously.\n");
+	fprintf(stderr, "Audio capture started: %s (%u Hz)\n", name, sampleRate);
+	return true;
+}
+
+void audio_capture_stop()
+{
+	if (!audioFile)
+		return;
+	if (audioWriter) {
+		SDL_LockMutex(audioLock);
+		audioWriterQuit = true;
+		SDL_CondSignal(audioCond);
+		SDL_UnlockMutex(audioLock);
+		SDL_WaitThread(audioWriter, NULL);
+		audioWriter = NULL;
+	}
+	if (audioCond) {
+		SDL_DestroyCond(audioCond);
+		audioCond = NULL;
+	}
+	// the lock stays, the sound thread may be about to take it
+	SDL_LockMutex(audioLock);
+	FILE *fp = audioFile;
+	audioFile = NULL;
+	SDL_UnlockMutex(audioLock);
+	if (audioPiped) {
+		pclose(fp);
+	} else {
+		setWavHeader(wavHeader.nSamplesPerSec, audioSamplesWritten * 2);
+		fseek(fp, 0, SEEK_SET);
+		fwrite(&wavHeader, sizeof(wavHeader), 1, fp);
+		fclose(fp);
+	}
+	fprintf(stderr, "Audio capture stopped: %u samples written, %u dropped.\n",
+		audioSamplesWritten, audioSamplesDropped);
+}
+
+bool audio_capture_active()
+{
+	return audioFile != NULL;
+}
+
+/*
+	Called from the sound thread with every block of mixed samples,
+	never waits for the disk
+*/
+void audio_capture_samples(const short *buf, unsigned int nrsamples)
+{
+	if (!audioFile)
+		return;
+	SDL_LockMutex(audioLock);
+	if (!audioFile) {
+		SDL_UnlockMutex(audioLock);
+		return;
+	}
+	if (!audioWriter) {
+		fwrite(buf, 2, nrsamples, audioFile);
+		audioSamplesWritten += nrsamples;
+	} else if (audioCount + nrsamples > AUDIO_BUFFER_SIZE) {
+		audioSamplesDropped += nrsamples;
+	} else {
+		while (nrsamples) {
+			const unsigned int chunk = nrsamples < AUDIO_BUFFER_SIZE - audioHead ? nrsamples : AUDIO_BUFFER_SIZE - audioHead;
+			memcpy(audioBuffer + audioHead, buf, chunk * 2);
+			audioHead = (audioHead + chunk) % AUDIO_BUFFER_SIZE;
+			audioCount += chunk;
+			buf += chunk;
+			nrsamples -= chunk;
+		}
+		SDL_CondSignal(audioCond);
+	}
+	SDL_UnlockMutex(audioLock);
+}
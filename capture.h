@@ -0,0 +1,24 @@
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+
+#include "types.h"
+
+enum {
+	CAPTURE_RAW = 0,	// palettized frames, palette in a separate .pal file
+	CAPTURE_Y4M			// YUV4MPEG2 4:4:4
+};
+
+extern bool video_capture_start(const char *name, unsigned int rateNum, unsigned int rateDen);
+extern void video_capture_stop();
+extern bool video_capture_active();
+extern void video_capture_frame(const unsigned char *src, unsigned int pitch);
+extern const char *video_capture_extension();
+extern bool screenshot_save(const char *prefix, const unsigned char *src, unsigned int pitch);
+extern void screenshot_flush();
+extern bool audio_capture_start(const char *name, unsigned int sampleRate);
+extern void audio_capture_stop();
+extern bool audio_capture_active();
+extern void audio_capture_samples(const short *buf, unsigned int nrsamples);
+extern rvar_t captureSettings[];
+
+#endif // _CAPTURE_H
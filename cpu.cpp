@@ -31,6 +31,8 @@ CPU::CPU( MemoryHandler *memhandler, unsigned char *irqreg, unsigned char *cpust
 	memset( stats, 0, sizeof(stats));
 	irqVector = INTERRUPT_IRQ;
 	nmiLevel = 0;
+	nrOfTraps = 0;
+	memset(trapPages, 0, sizeof(trapPages));
 	setId("CPU0");
 }
 
@@ -111,6 +113,39 @@ unsigned int CPU::getRemainingCycles()
 	return remained;
 }
 
+bool CPU::addTrap(unsigned int address, bool (*handler)(CPU *cpu, void *param), void *param)
+{
+	if (nrOfTraps >= MAX_TRAPS)
+		return false;
+	traps[nrOfTraps].address = address & 0xFFFF;
+	traps[nrOfTraps].handler = handler;
+	traps[nrOfTraps].param = param;
+	nrOfTraps++;
+	trapPages[(address >> 8) & 0xFF]++;
+	return true;
+}
+
+void CPU::removeTraps(bool (*handler)(CPU *cpu, void *param), void *param)
+{
+	unsigned int i = 0;
+	while (i < nrOfTraps) {
+		if (traps[i].handler == handler && (!param || traps[i].param == param)) {
+			trapPages[traps[i].address >> 8]--;
+			traps[i] = traps[--nrOfTraps];
+		} else
+			i++;
+	}
+}
+
+bool CPU::runTrap()
+{
+	for (unsigned int i = 0; i < nrOfTraps; i++) {
+		if (traps[i].address == PC && traps[i].handler(this, traps[i].param))
+			return true;
+	}
+	return false;
+}
+
 inline void CPU::DoCompare(unsigned char reg, unsigned char value)
 {
 	ST = (ST & 0xFE) | ( value<=reg);
@@ -132,6 +167,13 @@ void CPU::process()
 				return;
 			}
 		}
+		if (trapPages[PC >> 8] && runTrap()) {
+			// return to the caller as the RTS of the routine would
+			SP++;
+			PC = pull();
+			SP++;
+			PC = ((PC | (pull() << 8)) + 1) & 0xFFFF;
+		}
 		currins=mem->Read(PC);				// fetch opcode
 		nextins=mem->Read(PC+1);			// prefetch next opcode/operand
 		cycle = 1;							// increment the CPU cycle counter
@@ -47,6 +47,16 @@ class CPU : public SaveState , public Debuggable {
 		};
 		unsigned short irqVector;
 		unsigned int nmiLevel;
+		// host routines run in place of subroutines
+		enum { MAX_TRAPS = 8 };
+		struct {
+			unsigned int address;
+			bool (*handler)(CPU *cpu, void *param);
+			void *param;
+		} traps[MAX_TRAPS];
+		unsigned int nrOfTraps;
+		unsigned char trapPages[256];	// number of traps on each page
+		bool runTrap();
 
 	public:
 		CPU(MemoryHandler *memhandler, unsigned char *irqreg, unsigned char *cpustack);
@@ -71,6 +81,13 @@ class CPU : public SaveState , public Debuggable {
 		unsigned int getcins();
 		unsigned int getRemainingCycles();
 		void setST(unsigned int v) { ST = v; };
+		void setAC(unsigned char v) { AC = v; };
+		void setX(unsigned char v) { X = v; };
+		void setY(unsigned char v) { Y = v; };
+		// the handler returns true if it did the work of the subroutine
+		bool addTrap(unsigned int address, bool (*handler)(CPU *cpu, void *param), void *param);
+		// removes the traps of a handler, those with any parameter if param is NULL
+		void removeTraps(bool (*handler)(CPU *cpu, void *param), void *param = NULL);
 
 		virtual void dumpState();
 		virtual void readState();
@@ -0,0 +1,438 @@
+#include <stdio.h>
+#include <string.h>
+#include "iec.h"
+#include "d64drive.h"
+
+CIECD64Drive::CIECD64Drive() : image(NULL), numTracks(0), dirEntries(0)
+{
+	for (int i=0; i<16; i++)
+		ch[i].data = NULL;
+	Reset();
+}
+
+CIECD64Drive::~CIECD64Drive()
+{
+	DetachImage();
+}
+
+void CIECD64Drive::Reset()
+{
+	CloseAllChannels();
+	cmd_len = 0;
+	name_length = 0;
+	SetError(ERR_STARTUP, 0, 0);
+}
+
+unsigned int CIECD64Drive::SectorsOnTrack(unsigned int track)
+{
+	if (track <= 17)
+		return 21;
+	if (track <= 24)
+		return 19;
+	if (track <= 30)
+		return 18;
+	return 17;
+}
+
+// a failed attach leaves no disk behind, not the previous one
+bool CIECD64Drive::AttachImage(const char *path)
+{
+	DetachImage();
+	FILE *fp = fopen(path, "rb");
+	if (!fp)
+		return false;
+
+	fseek(fp, 0L, SEEK_END);
+	long size = ftell(fp);
+	if (size <= 0 || size > 197376) {
+		fclose(fp);
+		return false;
+	}
+	unsigned char *data = new unsigned char[size];
+	fseek(fp, 0L, SEEK_SET);
+	size_t read = fread(data, 1, size, fp);
+	fclose(fp);
+	bool attached = read == (size_t) size && AttachImage(data, (unsigned int) size, path);
+	delete [] data;
+	return attached;
+}
+
+bool CIECD64Drive::AttachImage(const unsigned char *data, unsigned int size, const char *name)
+{
+	unsigned int tracks;
+
+	DetachImage();
+	// plain images with or without the error info block
+	switch (size) {
+		case 174848:
+		case 175531:
+			tracks = 35;
+			break;
+		case 196608:
+		case 197376:
+			tracks = 40;
+			break;
+		default:
+			return false;
+	}
+	unsigned int sectors = 0;
+	for (unsigned int t = 1; t <= tracks; t++) {
+		trackOffset[t] = sectors;
+		sectors += SectorsOnTrack(t);
+	}
+	image = new unsigned char[sectors * 256];
+	memcpy(image, data, sectors * 256);
+	numTracks = tracks;
+	ReadDirectory();
+	Reset();
+	fprintf(stderr, "Virtual drive: %s attached (%u files, %u blocks free)\n", name, dirEntries, blocksFree);
+	return true;
+}
+
+void CIECD64Drive::DetachImage()
+{
+	CloseAllChannels();
+	if (image) {
+		delete [] image;
+		image = NULL;
+	}
+	numTracks = 0;
+	dirEntries = 0;
+}
+
+unsigned char *CIECD64Drive::SectorData(unsigned int track, unsigned int sector)
+{
+	if (!image || track < 1 || track > numTracks || sector >= SectorsOnTrack(track))
+		return NULL;
+	return image + ((trackOffset[track] + sector) << 8);
+}
+
+/*
+	Parse the BAM and the directory chain into the entry list
+*/
+void CIECD64Drive::ReadDirectory()
+{
+	unsigned char *bam = SectorData(DIR_TRACK, 0);
+	unsigned int i;
+
+	dirEntries = 0;
+	blocksFree = 0;
+	if (!bam)
+		return;
+
+	for (i = 0; i < 16 && bam[0x90 + i] != 0xA0; i++)
+		diskName[i] = bam[0x90 + i];
+	diskName[i] = 0;
+	diskId[0] = bam[0xA2];
+	diskId[1] = bam[0xA3];
+	diskId[2] = ' ';
+	diskId[3] = bam[0xA5];
+	diskId[4] = bam[0xA6];
+	diskId[5] = 0;
+	// the BAM only covers the first 35 tracks
+	for (i = 1; i <= 35; i++) {
+		if (i != DIR_TRACK)
+			blocksFree += bam[i << 2];
+	}
+
+	unsigned int track = bam[0];
+	unsigned int sector = bam[1];
+	unsigned int count = SectorsOnTrack(DIR_TRACK) - 1;
+	unsigned char *sec;
+	while (track && count-- && (sec = SectorData(track, sector))) {
+		for (unsigned int e = 0; e < 8 && dirEntries < MAX_DIR_ENTRIES; e++) {
+			unsigned char *entry = sec + (e << 5);
+			if (!entry[2])	// scratched
+				continue;
+			DirEntry &d = dir[dirEntries++];
+			d.type = entry[2];
+			d.track = entry[3];
+			d.sector = entry[4];
+			for (i = 0; i < 16 && entry[5 + i] != 0xA0; i++)
+				d.name[i] = entry[5 + i];
+			d.name[i] = 0;
+			d.blocks = entry[0x1E] | (entry[0x1F] << 8);
+		}
+		track = sec[0];
+		sector = sec[1];
+	}
+}
+
+/*
+	Strip the drive number and the type/mode suffixes off a file name
+*/
+void CIECD64Drive::PlainName(char *name, char *pattern)
+{
+	char *p = strchr(name, ':');
+	p = p ? p + 1 : name;
+	strncpy(pattern, p, 16);
+	pattern[16] = 0;
+	if ((p = strpbrk(pattern, ",=")) != NULL)
+		*p = 0;
+}
+
+int CIECD64Drive::FindFile(char *pattern)
+{
+	for (unsigned int i = 0; i < dirEntries; i++) {
+		// only closed files with data
+		if ((dir[i].type & 0x80) && (dir[i].type & 7) && Match(pattern, dir[i].name))
+			return i;
+	}
+	return -1;
+}
+
+/*
+	Make the channel buffer point to the data bytes of a sector of the file
+*/
+bool CIECD64Drive::FollowChain(int channel, unsigned int track, unsigned int sector)
+{
+	unsigned char *sec = SectorData(track, sector);
+
+	if (!sec || !sectorsLeft[channel]--)
+		return false;
+	// the last sector holds the index of its last byte
+	int length = sec[0] ? 256 : sec[1] + 1;
+	if (length <= 2)
+		return false;
+	ch[channel].data = sec;
+	ch[channel].ptr = sec + 2;
+	ch[channel].length = length;
+	return true;
+}
+
+unsigned char CIECD64Drive::Open(int channel)
+{
+	SetError(ERR_OK, 0, 0);
+
+	if (channel == 15) {
+		ExecuteCommand(name_buf);
+		return ST_OK;
+	}
+
+	Close(channel);
+
+	if (!image) {
+		SetError(ERR_NOTREADY, 0, 0);
+		return ST_ERROR;
+	}
+
+	switch ( name_buf[0] ) {
+		case '$':
+			return OpenDirectory(channel, name_buf+1);
+		case '#':
+			SetError(ERR_NOCHANNEL, 0, 0);
+			return ST_OK;
+		default:
+			return OpenFile(channel, name_buf);
+	}
+}
+
+unsigned char CIECD64Drive::Open(int channel, char *nameBuf)
+{
+	if (nameBuf)
+		strcpy(name_buf, nameBuf);
+	return Open(channel);
+}
+
+unsigned char CIECD64Drive::OpenFile(int channel, char *filename)
+{
+	char pattern[17];
+
+	// Channel 1 is WRITE PRG
+	if (channel == 1 || filename[0] == '@' || strstr(filename, ",W") || strstr(filename, ",A")) {
+		SetError(ERR_WRITEPROTECT, 0, 0);
+		return ST_ERROR;
+	}
+
+	PlainName(filename, pattern);
+	int i = FindFile(pattern);
+	if (i < 0) {
+		SetError(ERR_FILENOTFOUND, 0, 0);
+		return ST_ERROR;
+	}
+
+	sectorsLeft[channel] = trackOffset[numTracks] + SectorsOnTrack(numTracks);
+	if (!FollowChain(channel, dir[i].track, dir[i].sector)) {
+		SetError(ERR_ILLEGALTS, dir[i].track, dir[i].sector);
+		return ST_ERROR;
+	}
+	ch[channel].mode = CHMOD_FILE;
+	return ST_OK;
+}
+
+/*
+	Render the directory as a BASIC program
+*/
+unsigned char CIECD64Drive::OpenDirectory(int channel, char *filename)
+{
+	static const char *typeName[] = { "DEL", "SEQ", "PRG", "USR", "REL", "???", "???", "???" };
+	char header[] = "\001\004\001\001\0\0\022\042                \042      ";
+	char pattern[17];
+	unsigned char *buf = new unsigned char[(dirEntries + 2) << 5];
+	unsigned char *p = buf;
+	unsigned int i;
+
+	if (filename[0] == '0' && filename[1] == 0)
+		filename += 1;
+	PlainName(filename, pattern);
+
+	memcpy(p, header, 32);
+	for (i = 0; diskName[i]; i++)
+		p[8 + i] = diskName[i];
+	for (i = 0; i < 5; i++)
+		p[26 + i] = diskId[i];
+	p[31] = 0;
+	p += 32;
+
+	for (unsigned int e = 0; e < dirEntries; e++) {
+		DirEntry &d = dir[e];
+		if (!Match(pattern, d.name))
+			continue;
+
+		unsigned char *q = p;
+		memset(p, ' ', 31);
+		p[31] = 0;
+		*q++ = 0x01;
+		*q++ = 0x01;
+		*q++ = d.blocks & 0xff;
+		*q++ = (d.blocks >> 8) & 0xff;
+		q++;
+		if (d.blocks < 10) q++;
+		if (d.blocks < 100) q++;
+		*q++ = '\"';
+		for (i = 0; d.name[i]; i++)
+			q[i] = d.name[i];
+		q[i] = '\"';
+		q += 17;
+		*q++ = (d.type & 0x80) ? ' ' : '*';
+		memcpy(q, typeName[d.type & 7], 3);
+		if (d.type & 0x40)
+			q[3] = '<';
+		p += 32;
+	}
+
+	memcpy(p, "\001\001\0\0BLOCKS FREE.             \0\0", 32);
+	p[2] = blocksFree & 0xff;
+	p[3] = (blocksFree >> 8) & 0xff;
+	p += 32;
+
+	ch[channel].mode = CHMOD_DIRECTORY;
+	ch[channel].data = buf;
+	ch[channel].ptr = buf;
+	ch[channel].length = (int) (p - buf);
+	return ST_OK;
+}
+
+unsigned char CIECD64Drive::Close(int channel)
+{
+	// Closing channel 15 closes all other channels
+	if (channel == 15) {
+		CloseAllChannels();
+		return ST_OK;
+	}
+	if (ch[channel].mode == CHMOD_DIRECTORY)
+		delete [] ch[channel].data;
+	ch[channel].mode = CHMOD_FREE;
+	ch[channel].data = NULL;
+
+	return ST_OK;
+}
+
+unsigned char CIECD64Drive::Read(int channel, unsigned char *byte)
+{
+	if (channel == 15) {
+		*byte = *errorPtr++;
+
+		if (*byte != '\r')
+			return ST_OK;
+		else {	// End of message
+			SetError(ERR_OK, 0, 0);
+			return ST_EOF;
+		}
+	}
+
+	Buffer &b = ch[channel];
+	if (b.mode != CHMOD_FILE && b.mode != CHMOD_DIRECTORY)
+		return ST_ERROR;
+
+	*byte = *b.ptr++;
+	if (b.ptr < b.data + b.length)
+		return ST_OK;
+	if (b.mode == CHMOD_FILE && b.data[0] && FollowChain(channel, b.data[0], b.data[1]))
+		return ST_OK;
+	// keep returning the last byte
+	b.ptr--;
+	return ST_EOF;
+}
+
+unsigned char CIECD64Drive::Write(int channel, unsigned char data, unsigned int cmd, bool eoi)
+{
+	if (channel == 15) {
+
+		if (eoi) {
+			cmd_buffer[cmd_len] = 0;
+			cmd_len = 0;
+			ExecuteCommand(cmd_buffer);
+			return ST_OK;
+		}
+		if (cmd_len >= 40)
+			return ST_ERROR;
+		cmd_buffer[cmd_len++] = data;
+		return ST_OK;
+
+	}
+
+	switch (cmd) {
+		case CIECInterface::CMD_OPEN:
+			if (name_length >= sizeof(name_buf) - 1)
+				return ST_ERROR;
+			name_buf[name_length++] = data;
+			if (eoi) {
+				name_buf[name_length] = 0;
+				name_length = 0;
+				return ST_EOF;
+			}
+			return ST_OK;
+		case CIECInterface::CMD_DATA:
+			if (ch[channel].mode == CHMOD_FREE)
+				SetError(ERR_FILENOTOPEN, 0, 0);
+			else
+				SetError(ERR_WRITEPROTECT, 0, 0);
+			return ST_ERROR;
+		default:
+			return ST_ERROR;
+	}
+}
+
+void CIECD64Drive::ExecuteCommand(char *command)
+{
+	switch (command[0]) {
+		case 'I':
+			CloseAllChannels();
+			ReadDirectory();
+			SetError(ERR_OK, 0, 0);
+			break;
+
+		case 'U':
+			if ((command[1] & 0x0f) == 0x0a) {
+				Reset();
+			} else
+				SetError(ERR_SYNTAX30, 0, 0);
+			break;
+
+		// the image is never written
+		case 'S':
+		case 'R':
+		case 'N':
+		case 'C':
+		case 'V':
+			SetError(ERR_WRITEPROTECT, 0, 0);
+			break;
+
+		case 0:
+			break;
+
+		default:
+			SetError(ERR_SYNTAX30, 0, 0);
+	}
+}
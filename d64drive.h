@@ -0,0 +1,54 @@
+#ifndef _D64DRIVE_H
+#define _D64DRIVE_H
+
+#include "device.h"
+
+// DOS level drive serving the files of a D64 image without a drive CPU
+class CIECD64Drive : public CIECDrive {
+public:
+	CIECD64Drive();
+	virtual ~CIECD64Drive();
+	bool AttachImage(const char *path);
+	bool AttachImage(const unsigned char *data, unsigned int size, const char *name);
+	void DetachImage();
+	bool IsImageAttached() { return image != NULL; };
+	virtual unsigned char Open(int channel);
+	virtual unsigned char Open(int channel, char *nameBuf);
+	virtual unsigned char Close(int channel);
+	virtual unsigned char Read(int channel, unsigned char *data);
+	virtual unsigned char Write(int channel, unsigned char data, unsigned int cmd, bool eoi);
+	virtual void Reset();
+
+private:
+	enum { MAX_DIR_ENTRIES = 144, DIR_TRACK = 18 };
+	virtual unsigned char OpenFile(int channel, char *filename);
+	virtual unsigned char OpenDirectory(int channel, char *filename);
+	virtual void ExecuteCommand(char *command);
+	void ReadDirectory();
+	int FindFile(char *pattern);
+	bool FollowChain(int channel, unsigned int track, unsigned int sector);
+	unsigned char *SectorData(unsigned int track, unsigned int sector);
+	static unsigned int SectorsOnTrack(unsigned int track);
+	static void PlainName(char *name, char *pattern);
+
+	unsigned char *image;		// the whole image, read on attach
+	unsigned int numTracks;
+	unsigned int trackOffset[41];	// index of the first sector of each track
+	struct DirEntry {
+		unsigned char type;
+		unsigned char track;
+		unsigned char sector;
+		char name[17];			// PETSCII without the shifted space padding
+		unsigned int blocks;
+	} dir[MAX_DIR_ENTRIES];
+	unsigned int dirEntries;
+	char diskName[17];
+	char diskId[6];
+	unsigned int blocksFree;
+	unsigned int sectorsLeft[16];	// stops reading a circular sector chain
+
+	char cmd_buffer[44];
+	int cmd_len;
+};
+
+#endif // _D64DRIVE_H
@@ -4,21 +4,29 @@
 #include <string.h>
 #include <ctype.h>
 
-CIECFSDrive::CIECFSDrive(const char *path)
+#define WRITE_BUFFER_SIZE 4096
+
+CIECFSDrive::CIECFSDrive(const char *path) : index(NULL), indexEntries(0), indexCapacity(0)
 {
 	strcpy(orig_dir_path, path);
 	dir_path[0] = 0;
-
-	if (ChangeDir(orig_dir_path)) {
-		for (int i=0; i<16; i++)
-			file[i] = NULL;
-		Reset();
+	indexDir[0] = 0;
+	indexMtime = indexTime = 0;
+
+	for (int i=0; i<16; i++) {
+		file[i] = NULL;
+		writeBuf[i] = NULL;
+		mapped[i] = false;
+		ch[i].writeFlag = false;
 	}
+	if (ChangeDir(orig_dir_path))
+		Reset();
 }
 
 CIECFSDrive::~CIECFSDrive()
 {
 	CloseAllChannels();
+	delete [] index;
 }
 
 void CIECFSDrive::Reset(void)
@@ -48,10 +56,7 @@ unsigned char CIECFSDrive::Open(int channel)
 		return ST_OK;
 	}
 
-	if (file[channel]) {
-		fclose(file[channel]);
-		file[channel] = NULL;
-	}
+	Close(channel);
 
 	switch ( name_buf[0] ) {
 		case '$':
@@ -129,9 +134,16 @@ unsigned char CIECFSDrive::OpenFile(int channel, char *filename)
 			break;
 	}
 
-	if ((file[channel] = fopen(plainname, mode)) != NULL) {
-		if (filemode == FMODE_READ)	// Read and buffer first byte
-			read_char[channel] = fgetc(file[channel]);
+	if (filemode == FMODE_READ) {
+		if (!LoadFile(channel, plainname)) {
+			SetError(ERR_FILENOTFOUND, 0, 0);
+			return ST_ERROR;
+		}
+	} else if ((file[channel] = fopen(plainname, mode)) != NULL) {
+		writeBuf[channel] = new unsigned char[WRITE_BUFFER_SIZE];
+		writeLen[channel] = 0;
+		ch[channel].mode = CHMOD_FILE;
+		ch[channel].writeFlag = true;
 	} else {
 		SetError(ERR_FILENOTFOUND, 0, 0);
 		return ST_ERROR;
@@ -140,6 +152,47 @@ unsigned char CIECFSDrive::OpenFile(int channel, char *filename)
 	return ST_OK;
 }
 
+/*
+	Make the channel buffer hold the whole file, mapped if possible
+*/
+bool CIECFSDrive::LoadFile(int channel, const char *name)
+{
+	Buffer &b = ch[channel];
+	size_t size;
+
+	b.data = ad_map_file(name, size);
+	if (b.data) {
+		mapped[channel] = true;
+	} else {
+		// empty files cannot be mapped
+		FILE *fp = fopen(name, "rb");
+		if (!fp)
+			return false;
+		fseek(fp, 0L, SEEK_END);
+		size = ftell(fp);
+		fseek(fp, 0L, SEEK_SET);
+		if (size) {
+			b.data = new unsigned char[size];
+			size = fread(b.data, 1, size, fp);
+		}
+		fclose(fp);
+		mapped[channel] = false;
+	}
+	b.ptr = b.data;
+	b.length = (int) size;
+	b.mode = CHMOD_FILE;
+	b.writeFlag = false;
+	return true;
+}
+
+bool CIECFSDrive::FlushWrite(int channel)
+{
+	unsigned int len = writeLen[channel];
+
+	writeLen[channel] = 0;
+	return fwrite(writeBuf[channel], 1, len, file[channel]) == len;
+}
+
 
 void CIECFSDrive::ParseFileName(char *srcname, char *destname, int *filemode, int *filetype, bool *wildflag)
 {
@@ -184,50 +237,72 @@ void CIECFSDrive::ParseFileName(char *srcname, char *destname, int *filemode, in
 	*wildflag = strpbrk(destname, "?*") != NULL;
 }
 
-void CIECFSDrive::FindFirstFile(char *name)
+/*
+	Rescan the *.prg files only if the directory has changed since the last scan
+*/
+void CIECFSDrive::RefreshIndex()
 {
-	bool found = true;
-	char *filename, cmpname[NAMEBUF_LENGTH];
-	char fname[NAMEBUF_LENGTH];
+	char cwd[512];
+	time_t mtime = ad_get_dir_mtime(".");
 
-	// convert to uppercase
-	for ( filename = name; filename<name+strlen(name); filename++)
-		*filename=toupper(*filename);
+	if (!ad_get_curr_dir(cwd))
+		cwd[0] = 0;
+	// entries added in the second of the scan would not change the time stamp
+	if (mtime && mtime == indexMtime && mtime < indexTime && !strcmp(cwd, indexDir))
+		return;
 
-	if ( !(ad_set_curr_dir(dir_path)) )
+	strcpy(indexDir, cwd);
+	indexMtime = mtime;
+	indexTime = time(NULL);
+	indexEntries = 0;
+
+	if (!ad_find_first_file("*.prg"))
 		return;
+	char *currfname = ad_return_current_filename();
+	while (currfname) {
+		if (indexEntries == indexCapacity) {
+			IndexEntry *grown = new IndexEntry[indexCapacity ? indexCapacity * 2 : 64];
+			if (indexEntries)
+				memcpy(grown, index, indexEntries * sizeof(IndexEntry));
+			delete [] index;
+			index = grown;
+			indexCapacity = indexCapacity ? indexCapacity * 2 : 64;
+		}
+		IndexEntry &e = index[indexEntries++];
+		strncpy(e.hostName, currfname, NAMEBUF_LENGTH - 1);
+		e.hostName[NAMEBUF_LENGTH - 1] = 0;
+		char *ext = strrchr(e.hostName, '.');
+		int i;
+		for (i = 0; i < 16 && e.hostName + i != ext && e.hostName[i]; i++)
+			e.name[i] = ToPETSCII(e.hostName[i]);
+		e.name[i] = 0;
+		e.size = ad_get_current_filesize();
+		currfname = ad_find_next_file() ? ad_return_current_filename() : NULL;
+	}
+	ad_find_file_close();
+}
 
-	if (!ad_find_first_file("*.prg")) return;
-	found = ad_return_current_filename() != 0;
+void CIECFSDrive::FindFirstFile(char *name)
+{
+	char *filename;
 
-	while (found) {
-		char *currfname = ad_return_current_filename();
-		if (currfname) {
-			char *ext;
-			strncpy( fname, currfname, NAMEBUF_LENGTH);
-			strcpy( cmpname, currfname);
+	// convert to uppercase
+	for ( filename = name; filename<name+strlen(name); filename++)
+		*filename=toupper(*filename);
 
-			ext = strrchr( cmpname, '.' );
-			// FIXME! filetype check!
-			if ( ext ) {
-				*ext++ = '\0';
-			}
-			// Match found? Then copy real file name
-			if (Match(name, cmpname)) {
-				strncpy(name, fname, strlen(fname)+1 );
-				return;
-			}
-			// Get next directory entry
+	RefreshIndex();
+	for (unsigned int i = 0; i < indexEntries; i++) {
+		// Match found? Then copy real file name
+		if (Match(name, index[i].name)) {
+			strcpy(name, index[i].hostName);
+			return;
 		}
-		found = !!ad_find_next_file();
 	}
-	ad_find_file_close();
 }
 
 unsigned char CIECFSDrive::OpenDirectory(int channel, char *filename)
 {
 	char buf[] = "\001\004\001\001\0\0\022\042                \042 00 2A";
-	char str[NAMEBUF_LENGTH];
 	char pattern[NAMEBUF_LENGTH];
 	char *p, *q;
 	int i;
@@ -235,32 +310,24 @@ unsigned char CIECFSDrive::OpenDirectory(int channel, char *filename)
 	int filetype;
 	bool wildflag;
 
-	bool found = true;
-	char fname[NAMEBUF_LENGTH] = "";
-
 	if (filename[0] == '0' && filename[1] == 0)
 		filename += 1;
 
 	ParseFileName(filename, pattern, &filemode, &filetype, &wildflag);
 
-	if ( ad_find_first_file("*.prg"))
-		strcpy( fname, ad_return_current_filename());
-
-	if ( !fname[0] )
-		found = false;
-
-	if ((file[channel] = tmpfile()) == NULL) {
-		return ST_OK;
-	}
+	RefreshIndex();
+	unsigned char *listing = new unsigned char[(indexEntries + 2) << 5];
+	unsigned char *lp = listing;
 
 	p = &buf[8];
 	for (i=0; i<16 && dir_title[i] ; i++)
 		*p++ = ToPETSCII(dir_title[i]);
-	fwrite(buf, 1, 32, file[channel]);
+	memcpy(lp, buf, 32);
+	lp += 32;
 
-	while (found) {
+	for (unsigned int e = 0; e < indexEntries; e++) {
 
-		if (Match(pattern, fname)) {
+		if (Match(pattern, index[e].name)) {
 
 			memset(buf, ' ', 31);
 			buf[31] = 0;
@@ -269,9 +336,8 @@ unsigned char CIECFSDrive::OpenDirectory(int channel, char *filename)
 			*p++ = 0x01;
 			*p++ = 0x01;
 
-			int size = ad_get_current_filesize();
 			// Size in blocks
-			i = (size + 254) / 254;
+			i = (index[e].size + 254) / 254;
 			*p++ = i & 0xff;
 			*p++ = (i >> 8) & 0xff;
 
@@ -279,33 +345,29 @@ unsigned char CIECFSDrive::OpenDirectory(int channel, char *filename)
 			if (i < 10) p++;
 			if (i < 100) p++;
 
-			strcpy(str, fname);
-			str[ strlen(str)-4 ] = '\0';
 			*p++ = '\"';
 			q = p;
-			for (i=0; i<16 && str[i]; i++)
-				*q++ = ToPETSCII(str[i]);
+			for (i=0; i<16 && index[e].name[i]; i++)
+				*q++ = index[e].name[i];
 			*q++ = '\"';
 			p += 18;
 
 			strncpy( p, "PRG", 3);
 			p += 3;
 
-			fwrite(buf, 1, 32, file[channel]);
-		}
-
-		// Take next directory entry
-		if ((found = !!ad_find_next_file())) {
-			strcpy( fname, ad_return_current_filename());
+			memcpy(lp, buf, 32);
+			lp += 32;
 		}
 	}
 
-	fwrite("\001\001\0\0BLOCKS FREE.             \0\0", 1, 32, file[channel]);
+	memcpy(lp, "\001\001\0\0BLOCKS FREE.             \0\0", 32);
+	lp += 32;
 
-	rewind(file[channel]);
-	read_char[channel] = fgetc(file[channel]);
-
-	ad_find_file_close();
+	ch[channel].mode = CHMOD_DIRECTORY;
+	ch[channel].writeFlag = false;
+	ch[channel].data = listing;
+	ch[channel].ptr = listing;
+	ch[channel].length = (int) (lp - listing);
 
 	return ST_OK;
 }
@@ -317,10 +379,26 @@ unsigned char CIECFSDrive::Close(int channel)
 		CloseAllChannels();
 		return ST_OK;
 	}
-	if (file[channel]) {
+	Buffer &b = ch[channel];
+	if (b.mode == CHMOD_FREE)
+		return ST_OK;
+
+	if (b.writeFlag) {
+		if (!FlushWrite(channel))
+			SetError(ERR_WRITEERROR, 0, 0);
 		fclose(file[channel]);
 		file[channel] = NULL;
+		delete [] writeBuf[channel];
+		writeBuf[channel] = NULL;
+	} else if (mapped[channel]) {
+		ad_unmap_file(b.data, (size_t) b.length);
+	} else {
+		delete [] b.data;
 	}
+	mapped[channel] = false;
+	b.mode = CHMOD_FREE;
+	b.writeFlag = false;
+	b.data = NULL;
 
 	return ST_OK;
 }
@@ -334,8 +412,6 @@ unsigned char CIECFSDrive::Close(int channel)
 
 unsigned char CIECFSDrive::Read(int channel, unsigned char *byte)
 {
-	int c;
-
 	if (channel == 15) {
 		*byte = *errorPtr++;
 
@@ -347,17 +423,20 @@ unsigned char CIECFSDrive::Read(int channel, unsigned char *byte)
 		}
 	}
 
-	if (!file[channel]) return ST_ERROR;
+	Buffer &b = ch[channel];
+	if (b.mode == CHMOD_FREE || b.writeFlag) return ST_ERROR;
 
-	// Read one byte
-	*byte = read_char[channel];
-	c = fgetc(file[channel]);
-	if (c == EOF)
+	if (!b.length) {
+		*byte = 0xFF;
 		return ST_EOF;
-	else {
-		read_char[channel] = c;
+	}
+	// Read one byte, the last one comes with EOF
+	*byte = *b.ptr;
+	if (b.ptr + 1 < b.data + b.length) {
+		b.ptr++;
 		return ST_OK;
 	}
+	return ST_EOF;
 }
 
 Uint8 CIECFSDrive::Write(int channel, Uint8 data, unsigned int cmd, bool eoi)
@@ -394,9 +473,12 @@ Uint8 CIECFSDrive::Write(int channel, Uint8 data, unsigned int cmd, bool eoi)
 				return ST_ERROR;
 			}
 
-			if (!eoi && fputc(data, file[channel]) == EOF) {
-				SetError(ERR_WRITEERROR, 0, 0);
-				return ST_ERROR;
+			if (!eoi) {
+				writeBuf[channel][writeLen[channel]++] = data;
+				if (writeLen[channel] == WRITE_BUFFER_SIZE && !FlushWrite(channel)) {
+					SetError(ERR_WRITEERROR, 0, 0);
+					return ST_ERROR;
+				}
 			}
 			return ST_OK;
 		default:
@@ -26,15 +26,31 @@ private:
 	void FindFirstFile(char *name);
 	bool ChangeDir(char *dirpath);
 	void ChangeDirCmd(char *dirpath);
+	bool LoadFile(int channel, const char *name);
+	bool FlushWrite(int channel);
+	void RefreshIndex();
 	char dir_path[MAX_PATH];
 	char orig_dir_path[MAX_PATH];
 	char dir_title[16];
-	FILE *file[16];
+	FILE *file[16];			// write channels only
+	unsigned char *writeBuf[16];
+	unsigned int writeLen[16];
+	bool mapped[16];		// read channel data is a file mapping
+
+	// the *.prg files of the served directory, rescanned when it changes
+	struct IndexEntry {
+		char hostName[NAMEBUF_LENGTH];
+		char name[17];			// PETSCII without the extension
+		unsigned int size;
+	} *index;
+	unsigned int indexEntries;
+	unsigned int indexCapacity;
+	char indexDir[512];
+	time_t indexMtime;
+	time_t indexTime;
 
 	char cmd_buffer[44];
 	int cmd_len;
-
-	unsigned char read_char[16];
 };
 
 #endif // _DISKFS_H
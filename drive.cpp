@@ -94,6 +94,61 @@ void CTrueDrive::SwapDisk(const char *fname)
 	}
 }
 
+void CTrueDrive::AttachDisk(const unsigned char *data, size_t size, const char *name)
+{
+	if (FdcGCR) {
+		FdcGCR->openDiskImage(data, size, name);
+	}
+}
+
+void CTrueDrive::SwapDisk(const unsigned char *data, size_t size, const char *name)
+{
+	CTrueDrive *d = CTrueDrive::GetRoot();
+	if (d) {
+		d->DetachDisk();
+		machineDoSomeFrames(2);
+		d->AttachDisk(data, size, name);
+	}
+}
+
+bool CTrueDrive::AddToDiskSet(const char *fname)
+{
+	CTrueDrive *d = CTrueDrive::GetRoot();
+	return d && d->FdcGCR && d->FdcGCR->addToDiskSet(fname);
+}
+
+bool CTrueDrive::AddToDiskSet(const unsigned char *data, size_t size, const char *name)
+{
+	CTrueDrive *d = CTrueDrive::GetRoot();
+	return d && d->FdcGCR && d->FdcGCR->addToDiskSet(data, size, name);
+}
+
+unsigned int CTrueDrive::InsertDiskSet()
+{
+	CTrueDrive *d = CTrueDrive::GetRoot();
+	if (d && d->FdcGCR)
+		return d->FdcGCR->insertDiskSet();
+	return 0;
+}
+
+bool CTrueDrive::NextDisk(unsigned int &number, unsigned int &count)
+{
+	CTrueDrive *d = CTrueDrive::GetRoot();
+	return d && d->FdcGCR && d->FdcGCR->nextDisk(number, count);
+}
+
+bool CTrueDrive::IsMotorRunning()
+{
+	CTrueDrive *d = CTrueDrive::GetRoot();
+
+	while (d) {
+		if (d->FdcGCR && d->FdcGCR->getMotorState())
+			return true;
+		d = d->GetNext();
+	}
+	return false;
+}
+
 void CTrueDrive::DetachDisk()
 {
 	if (FdcGCR) {
@@ -245,4 +300,11 @@ FakeSerialDrive::FakeSerialDrive(unsigned int dn) : Drive(dn)
 	//devNr = dn;
 	iecDrive = new CIECFSDrive(".");
 	iecInterFace = new IecFakeSerial(dn, iecDrive);
+	activeDrive = iecDrive;
+}
+
+void FakeSerialDrive::useIecDrive(CIECDrive *drive)
+{
+	activeDrive = drive ? drive : iecDrive;
+	iecInterFace->setIecDevice(activeDrive);
 }
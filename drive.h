@@ -63,6 +63,15 @@ public:
 	virtual void AttachDisk(const char *fname);
 	virtual void DetachDisk();
 	static void SwapDisk(const char *fname);
+	void AttachDisk(const unsigned char *data, size_t size, const char *name);
+	static void SwapDisk(const unsigned char *data, size_t size, const char *name);
+	// disk sets go into the first drive
+	static bool AddToDiskSet(const char *fname);
+	static bool AddToDiskSet(const unsigned char *data, size_t size, const char *name);
+	static unsigned int InsertDiskSet();
+	static bool NextDisk(unsigned int &number, unsigned int &count);
+	// true while the disk of any drive spins
+	static bool IsMotorRunning();
 	static CTrueDrive *GetRoot() { return RootDevice; };
 	CTrueDrive *GetNext() { return NextDevice; };
 	unsigned int GetDevNr() { return devNr; };
@@ -130,13 +139,16 @@ public:
 	virtual void DetachDisk() {
 	}
 	CIECDrive *getIecDrive() {
-		return iecDrive;
+		return activeDrive;
 	}
+	// serve the bus from another drive, NULL for the host directory
+	void useIecDrive(CIECDrive *drive);
 	//virtual bool changeROM(_TCHAR *fname);
 	//virtual bool changeOutputPath(_TCHAR *path);
 protected:
 	IecFakeSerial *iecInterFace;
 	CIECDrive *iecDrive;
+	CIECDrive *activeDrive;
 };
 
 #endif // _DRIVE_H
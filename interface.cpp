@@ -87,10 +87,11 @@ static menu_t tape_menu = {
 		{"Press PLAY"	, 0, UI_TAPE_PLAY },
 		{"Press RECORD"	, 0, UI_TAPE_RECORD },
 		{"Press STOP"	, 0, UI_TAPE_STOP },
-		{"Rewind tape"	, 0, UI_TAPE_REWIND }
+		{"Rewind tape"	, 0, UI_TAPE_REWIND },
+		{"Seek next block", 0, UI_TAPE_NEXT_BLOCK }
 	},
 	0,
-	10,
+	11,
 	0,
 	0,
 	0
@@ -128,8 +129,7 @@ static menu_t tap_list;
 static menu_t d64_list;
 static menu_t fre_list;
 static menu_t crt_list;
-static unsigned int *pixels;
-extern void frameUpdate(unsigned char *src, unsigned int *target);
+extern void frameUpdate(unsigned char *src);
 
 static rvar_t *findRVar(char *name)
 {
@@ -148,7 +148,6 @@ static rvar_t *findRVar(char *name)
 UI::UI(class TED *ted) :
 	display(ted->screen), charset(kernal + 0x1400), ted8360(ted)
 {
-	pixels = new unsigned int[512 * 312 * 2];
 	// Link menu structure
 	main_menu.element[0].child = &file_menu;
 	main_menu.element[1].child = &d64_list;
@@ -195,7 +194,7 @@ void UI::screen_update()
 	const unsigned int cyclesPerRow = ted8360->getCyclesPerRow();
 	const int offset = cyclesPerRow == 504 ? -68 : 8;
 
-	frameUpdate(display + (cyclesPerRow - offset - 384) / 2 + 10 * cyclesPerRow, pixels);
+	frameUpdate(display + (cyclesPerRow - offset - 384) / 2 + 10 * cyclesPerRow);
 }
 
 void UI::clear(char color, char shade)
@@ -326,12 +325,16 @@ void UI::show_file_list(menu_t * menu, UI_MenuClass type)
 				ftypes[0].menufunction = UI_D64_ITEM;
 				strcpy(ftypes[1].name, "*.zip");
 				ftypes[1].menufunction = UI_ZIP_ITEM;
+				strcpy(ftypes[2].name, "*.g64");
+				ftypes[2].menufunction = UI_D64_ITEM;
 #ifdef WIN32
-				nrOfExts = 2;
+				nrOfExts = 3;
 #else
-                nrOfExts = 3;
-				strcpy(ftypes[2].name, "*.D64");
-                ftypes[2].menufunction = UI_D64_ITEM;
+                nrOfExts = 5;
+				strcpy(ftypes[3].name, "*.D64");
+                ftypes[3].menufunction = UI_D64_ITEM;
+				strcpy(ftypes[4].name, "*.G64");
+				ftypes[4].menufunction = UI_D64_ITEM;
 #endif
 				break;
 			case UI_FRE_ITEM:
@@ -501,6 +504,11 @@ bool UI::handle_menu_command( struct element_t *element)
 		case UI_TAPE_REWIND:
 			ted8360->tap->rewind();
 			break;
+		case UI_TAPE_NEXT_BLOCK:
+			// past the last block wrap around to the start
+			if (!ted8360->tap->seekToBlock(ted8360->tap->getCurrentBlock()))
+				ted8360->tap->rewind();
+			break;
 		case UI_TAPE_STOP:
 			ted8360->tap->pressTapeButton(ted8360->GetClockCount(), 0);
 			break;
@@ -893,7 +901,6 @@ unsigned char UI::asc2pet(char c)
 
 UI::~UI()
 {
-	delete []pixels;
 }
 
 void interfaceLoop(void *arg)
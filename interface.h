@@ -44,6 +44,7 @@ enum UI_MenuClass {
 	UI_TAPE_RECORD,
 	UI_TAPE_STOP,
 	UI_TAPE_REWIND,
+	UI_TAPE_NEXT_BLOCK,
 	UI_DRIVE_ATTACH_IMAGE,
 	UI_DRIVE_DETACH_IMAGE,
 	UI_DRIVE_SET_DIR,
@@ -30,6 +30,7 @@
 #include "device.h"
 #include "tcbm.h"
 #include "diskfs.h"
+#include "d64drive.h"
 #include "monitor.h"
 #include "prg.h"
 #include "interface.h"
@@ -40,6 +41,7 @@
 #include "vic2mem.h"
 #include "SaveState.h"
 #include "keyoverlay.h"
+#include "capture.h"
 
 #ifdef __EMSCRIPTEN__
 #include <emscripten.h>
@@ -51,16 +53,23 @@
 
 // function prototypes
 static void frameUpdate();
+static void captureFrame();
+static void stopEmulationThread();
 void setMainLoop(int looptype);
 // used as GUI callbacks
 static void toggleShowSpeed(void *none);
 static void toggleFullThrottle(void *none);
+static void flipFastForwardSpeed(void *none);
+static const char *fastForwardSpeedLabel();
+static void flipAutoWarpFrames(void *none);
+static const char *autoWarpLabel();
 static void toggleCrtEmulation(void *none);
 static void toggleVsync(void *none);
 static void flipMachineTypeFwd(void *name);
 static const char *machineTypeLabel();
 static void flipWindowScale(void *none);
 static void toggleTrueDriveEmulation(void *none);
+static void toggleLoadTrap(void *none);
 
 // SDL stuff
 static SDL_Window* sdlWindow;
@@ -81,6 +90,7 @@ static CPU				*machine = NULL;
 static CTCBM			*tcbm = NULL;
 static CIECInterface	*iec = NULL;
 static CIECDrive		*fsdrive = NULL;
+static CIECD64Drive		*d64drive = NULL;
 static CTrueDrive		*drive1541 = NULL;
 static FakeSerialDrive	*fsd1541 = NULL;
 
@@ -93,22 +103,31 @@ static unsigned int		g_bActive = true;
 static unsigned int		g_inDebug = false;
 static unsigned int		g_FrameRate = true;
 static unsigned int		g_50Hz = true;
+static unsigned int		g_iFastForwardSpeed = 3;
+static unsigned int		g_iAutoWarpFrames = 50;
+static bool				autoWarping = false;
 static unsigned int		g_bSaveSettings = true;
 static unsigned int     g_bUseOverlay = 0;
 static unsigned int		g_iWindowMultiplier = 2;
 static unsigned int		g_iEmulationLevel = 0;
 static unsigned int		g_bTrueDriveEmulation = 0;
+static unsigned int		g_bLoadTrap = 1;
 static unsigned int		g_bVideoVsync = 0;
+static unsigned int		g_bFrameSkip = 1;
 static char				lastSnapshotName[512] = "";
 static rvar_t mainSettings[] = {
 	{ "Show framerate", "DisplayFrameRate", toggleShowSpeed, &g_FrameRate, RVAR_TOGGLE, NULL },
 	{ "Display debug info", "DisplayQuickDebugInfo", NULL, &g_inDebug, RVAR_TOGGLE, NULL },
 	{ "Speed limit", "50HzTimerActive", toggleFullThrottle, &g_50Hz, RVAR_TOGGLE, NULL },
+	{ "Fast-forward speed", "FastForwardSpeed", flipFastForwardSpeed, &g_iFastForwardSpeed, RVAR_STRING_FLIPLIST, &fastForwardSpeedLabel },
+	{ "Warp while loading", "AutoWarpFrames", flipAutoWarpFrames, &g_iAutoWarpFrames, RVAR_STRING_FLIPLIST, &autoWarpLabel },
 	{ "Window scale", "WindowMultiplier", flipWindowScale, &g_iWindowMultiplier, RVAR_INT, NULL },
 	{ "Machine type", "EmulationLevel", flipMachineTypeFwd, &g_iEmulationLevel, RVAR_STRING_FLIPLIST, &machineTypeLabel },
 	{ "CRT emulation", "CRTEmulation", toggleCrtEmulation, &g_bUseOverlay, RVAR_TOGGLE, NULL },
 	{ "Video vertical sync", "VideoVsync", toggleVsync, &g_bVideoVsync, RVAR_TOGGLE, NULL },
+	{ "Adaptive frameskip", "AdaptiveFrameSkip", NULL, &g_bFrameSkip, RVAR_TOGGLE, NULL },
 	{ "True drive emulation", "TrueDriveEmulation", toggleTrueDriveEmulation, &g_bTrueDriveEmulation, RVAR_TOGGLE, NULL },
+	{ "KERNAL LOAD trap", "KernalLoadTrap", toggleLoadTrap, &g_bLoadTrap, RVAR_TOGGLE, NULL },
 	{ "Save settings on exit", "SaveSettingsOnExit", NULL, &g_bSaveSettings, RVAR_TOGGLE, NULL },
 	{ "", "", NULL, NULL, RVAR_NULL, NULL }
 };
@@ -118,8 +137,10 @@ rvar_t *settings[] = {
 	soundSettings,
 	SIDsound::sidSettings,
 	archDepSettings,
+	FdcGcr::fdcSettings,
 	TED::tedSettings,
 	videoSettings,
+	captureSettings,
 	NULL
 };
 
@@ -152,7 +173,8 @@ inline static void DebugInfo()
 		machine->getST(), machine->getAC(), machine->getX(), machine->getY(), machine->getSP());
 	ted8360->texttoscreen(hpos, vpos+16, textout);
 	vpos += 24;
-	sprintf(textout, "TAPE: %08d ", ted8360->tap->tapeSoFar);
+	// blocks reached out of those found, the position itself counts half-waves
+	sprintf(textout, "TAPE: %03u/%03u ", ted8360->tap->getCurrentBlock(), ted8360->tap->getBlockCount());
 	CTrueDrive *d = CTrueDrive::Drives[0];
 	if (d) {
 		char driveText[64];
@@ -169,6 +191,14 @@ inline static void DebugInfo()
 	} else {
 		ted8360->texttoscreen(hpos, vpos, textout);
 	}
+	unsigned int underruns, overruns;
+	sound_get_stats(underruns, overruns);
+	sprintf(textout, "AUDIO: UNDERRUNS %05u OVERRUNS %05u", underruns, overruns);
+	ted8360->texttoscreen(hpos, vpos+8, textout);
+	unsigned int jitterMean, jitterMax;
+	ad_get_jitter(jitterMean, jitterMax);
+	sprintf(textout, "FRAME: LATENESS AVG %05u MAX %05u US", jitterMean, jitterMax);
+	ted8360->texttoscreen(hpos, vpos+16, textout);
 }
 
 //-----------------------------------------------------------------------------
@@ -184,14 +214,41 @@ void machineReset(bool hardreset)
 
 void machineDoSomeFrames(unsigned int frames)
 {
+	TED::setFrameRendered(true);
 	ted8360->getKeys()->block(true);
 	while (frames--) {
 		ted8360->ted_process(1);
+		captureFrame();
 		frameUpdate();
 	}
 	ted8360->getKeys()->block(false);
 }
 
+/*
+	Puts the D64 image or the host directory behind device 8 and
+	traps the KERNAL LOAD when no true drive is on the bus
+*/
+static void hookVirtualDrive()
+{
+	CIECDrive *drive = (d64drive && d64drive->IsImageAttached()) ? (CIECDrive *) d64drive : fsdrive;
+
+	((CFakeIEC *) iec)->AddIECDevice(drive);
+	if (fsd1541)
+		fsd1541->useIecDrive(drive);
+	machine->removeTraps(prgLoadTrap);
+	if (g_bLoadTrap && !drive1541)
+		machine->addTrap(ted8360->getKernalLoad().entry, prgLoadTrap, drive);
+}
+
+static bool attachVirtualDisk(const char *fileName, const unsigned char *data, unsigned int size)
+{
+	if (!d64drive)
+		d64drive = new CIECD64Drive();
+	bool attached = data ? d64drive->AttachImage(data, size, fileName) : d64drive->AttachImage(fileName);
+	hookVirtualDrive();
+	return attached;
+}
+
 void machineEnable1551(bool enable)
 {
 	if (enable) {
@@ -219,6 +276,7 @@ void machineEnable1551(bool enable)
 		}
 		g_bTrueDriveEmulation = 1;
 	}
+	hookVirtualDrive();
 }
 
 bool machineIsTrueDriveEnabled(unsigned int dn = 8)
@@ -232,35 +290,204 @@ static void toggleTrueDriveEmulation(void *none)
 	machineEnable1551(!e);
 }
 
-static void startd64(const char *fileName, bool autostart)
+static void toggleLoadTrap(void *)
+{
+	g_bLoadTrap = !g_bLoadTrap;
+	hookVirtualDrive();
+}
+
+static void startd64(const char *fileName, bool autostart, const unsigned char *data = NULL, unsigned int size = 0)
+{
+	// plain D64 images are served at DOS level unless the true drive is on
+	if (!machineIsTrueDriveEnabled() && !attachVirtualDisk(fileName, data, size)) {
+		machineEnable1551(false);
+		machineDoSomeFrames(70);
+		if (data)
+			CTrueDrive::SwapDisk(data, size, fileName);
+		else
+			CTrueDrive::SwapDisk(fileName);
+	}
+	if (autostart)
+		ted8360->copyToKbBuffer("L\317\042*\042,8,1\rRUN:\r", 15);
+	else
+		ted8360->copyToKbBuffer("L\317\042*\042,8,1\r\r", 11);
+}
+
+/*
+	Disk sets need the true drive. The first disk goes in, the others are
+	made ready in the background and swapped in with LALT+N.
+*/
+static void prepareDiskSet()
 {
 	if (!machineIsTrueDriveEnabled()) {
 		machineEnable1551(false);
 		machineDoSomeFrames(70);
-		CTrueDrive::SwapDisk(fileName);
 	}
+}
+
+static bool startDiskSet(bool autostart)
+{
+	unsigned int disks = CTrueDrive::InsertDiskSet();
+
+	if (!disks)
+		return false;
+	fprintf(stderr, "Disk set of %u disks inserted.\n", disks);
 	if (autostart)
 		ted8360->copyToKbBuffer("L\317\042*\042,8,1\rRUN:\r", 15);
 	else
 		ted8360->copyToKbBuffer("L\317\042*\042,8,1\r\r", 11);
+	return true;
 }
 
+// the '#' of "archive.zip#member", NULL for other names, even with a '#' elsewhere
+static const char *zipMemberOf(const char *fileName)
+{
+	const char *zipMember = fileName;
+
+	while ((zipMember = strchr(zipMember, '#')) != NULL) {
+		if (zipMember - fileName >= 4) {
+			char ext[5];
+			for (int i = 0; i < 4; i++)
+				ext[i] = tolower(zipMember[i - 4]);
+			ext[4] = 0;
+			if (!strcmp(ext, ".zip"))
+				return zipMember;
+		}
+		zipMember++;
+	}
+	return NULL;
+}
+
+static bool addZipMemberToDiskSet(const char *fileName)
+{
+	char zipName[MAX_PATH];
+	unsigned int size;
+	const char *member = zipMemberOf(fileName);
+	size_t length = member - fileName;
+
+	if (length >= MAX_PATH)
+		return false;
+	memcpy(zipName, fileName, length);
+	zipName[length] = 0;
+	unsigned char *data = zipOpen(zipName, member + 1, NULL, size, NULL);
+	return data && CTrueDrive::AddToDiskSet(data, size, fileName);
+}
+
+/*
+	Disk lists (.m3u) name one image per line, relative to the list.
+	Empty lines and those starting with # are skipped.
+*/
+static bool openDiskList(const char *listName, bool autostart)
+{
+	FILE *fp = fopen(listName, "r");
+	char line[MAX_PATH];
+	char path[2 * MAX_PATH];
+
+	if (!fp)
+		return false;
+	const char *slash = strrchr(listName, '/');
+	const char *backslash = strrchr(listName, '\\');
+	if (backslash > slash)
+		slash = backslash;
+	int dirLength = slash ? (int) (slash - listName + 1) : 0;
+
+	prepareDiskSet();
+	while (fgets(line, sizeof(line), fp)) {
+		size_t length = strlen(line);
+		while (length && (line[length - 1] == '\n' || line[length - 1] == '\r' || line[length - 1] == ' '))
+			line[--length] = 0;
+		if (!length || line[0] == '#')
+			continue;
+		int pathLength;
+		if (line[0] == '/' || line[0] == '\\' || line[1] == ':')
+			pathLength = snprintf(path, sizeof(path), "%s", line);
+		else
+			pathLength = snprintf(path, sizeof(path), "%.*s%s", dirLength, listName, line);
+		// a cut path would name another file
+		if (pathLength < 0 || pathLength >= (int) sizeof(path))
+			continue;
+		if (zipMemberOf(path))
+			addZipMemberToDiskSet(path);
+		else
+			CTrueDrive::AddToDiskSet(path);
+	}
+	fclose(fp);
+	return startDiskSet(autostart);
+}
+
+static bool hasExtension(const char *fileName, const char *ext)
+{
+	const char *p = strrchr(fileName, '.');
+	if (!p || strlen(p) != strlen(ext))
+		return false;
+	while (*p && tolower(*p) == *ext) {
+		p++;
+		ext++;
+	}
+	return !*p;
+}
+
+/*
+	Media are taken from the archive in memory. "archive.zip#member" picks a
+	member, otherwise the first disk, tape or program image is used. Archives
+	with several disks are inserted as a disk set.
+*/
 bool openZipDisk(const char *fname, bool autostart)
 {
-	const unsigned int size = 1 << 20;
-	unsigned char b[200000];
-	unsigned int fsize = size;
-	const char *tmpName = "tmp.d64";
-
-	if (zipOpen(fname, b, fsize)) {
-		FILE *tmp = fopen(tmpName, "wb");
-		if (tmp) {
-			fwrite(b, sizeof(char), fsize, tmp);
-			fclose(tmp);
-			startd64(tmpName, autostart);
-			return true;
+	char zipName[MAX_PATH];
+	char member[MAX_PATH];
+	char display[2 * MAX_PATH];
+	unsigned int size;
+
+	strncpy(zipName, fname, MAX_PATH - 1);
+	zipName[MAX_PATH - 1] = 0;
+	char *memberName = (char *) zipMemberOf(zipName);
+	if (memberName) {
+		*memberName++ = 0;
+	} else {
+		char disks[16][MAX_PATH];
+		unsigned int count = zipListMembers(zipName, ".d64.g64", disks, 16);
+		if (count > 1) {
+			prepareDiskSet();
+			for (unsigned int i = 0; i < count; i++) {
+				unsigned char *data = zipOpen(zipName, disks[i], NULL, size, NULL);
+				snprintf(display, sizeof(display), "%s#%s", zipName, disks[i]);
+				if (data)
+					CTrueDrive::AddToDiskSet(data, size, display);
+			}
+			return startDiskSet(autostart);
 		}
 	}
+	unsigned char *data = zipOpen(zipName, memberName, ".d64.g64.prg.p00.t64.tap.wav", size, member);
+	if (!data)
+		return false;
+	sprintf(display, "%s#%s", zipName, member);
+
+	if (hasExtension(member, ".d64") || hasExtension(member, ".g64")) {
+		startd64(display, autostart, data, size);
+		return true;
+	}
+	if (hasExtension(member, ".prg") || hasExtension(member, ".p00")) {
+		PrgLoad(data, size, member, 0, ted8360);
+		if (autostart)
+			ted8360->copyToKbBuffer("RUN:\r");
+		return true;
+	}
+	if (hasExtension(member, ".t64")) {
+		prgLoadFromT64(data, size, display, 0, ted8360);
+		if (autostart)
+			ted8360->copyToKbBuffer("RUN:\r");
+		return true;
+	}
+	if (hasExtension(member, ".tap") || hasExtension(member, ".wav")) {
+		ted8360->tap->detachTape();
+		ted8360->tap->attachTape(data, size, display);
+		if (autostart) {
+			ted8360->copyToKbBuffer("Lo:\rRUN\r");
+			ted8360->tap->pressTapeButton(ted8360->GetClockCount(), 1);
+		}
+		return true;
+	}
 	return false;
 }
 
@@ -268,15 +495,22 @@ bool start_file(const char *szFile, bool autostart = true)
 {
 	char *pFileExt = (char *) strrchr(szFile, '.');
 
+	// the member of an archive has its own extension
+	if (zipMemberOf(szFile))
+		return openZipDisk(szFile, autostart);
 	if (pFileExt) {
 		char *fileext = pFileExt;
-		if (!strcmp(fileext,".d64") || !strcmp(fileext,".D64")) {
+		if (!strcmp(fileext,".d64") || !strcmp(fileext,".D64")
+				|| !strcmp(fileext,".g64") || !strcmp(fileext,".G64")) {
 			startd64(szFile, autostart);
 			return true;
 		}
 		if (!strcmp(fileext,".zip") || !strcmp(fileext,".ZIP")) {
 			return openZipDisk(szFile, autostart);
 		}
+		if (!strcmp(fileext,".m3u") || !strcmp(fileext,".M3U")) {
+			return openDiskList(szFile, autostart);
+		}
 		if (!strcmp(fileext,".prg") || !strcmp(fileext,".PRG")
 			|| !strcmp(fileext,".p00") || !strcmp(fileext,".P00")) {
 			PrgLoad(szFile, 0, ted8360 );
@@ -357,7 +591,7 @@ inline void PopupMsg(const char *msg, ...)
 	popupMessageTimeOut = 60; // frames
 }
 
-static void showKeyboardOverlay()
+static void showKeyboardOverlay(unsigned int alpha)
 {
 	static SDL_Texture* texture = NULL;
 	static SDL_Rect rc = { 0 };
@@ -378,26 +612,79 @@ static void showKeyboardOverlay()
 			SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
 		}
 	}
-	SDL_SetTextureAlphaMod(texture, timeOutOverlayKeys);
+	SDL_SetTextureAlphaMod(texture, alpha);
 	SDL_RenderCopy(sdlRenderer, texture, NULL, &rc);
 }
 
-static unsigned int pixels[512 * SCR_VSIZE * 2];
+/* ---------- Presentation ---------- */
+
+// Frames are handed over to the main thread through a triple buffer: the emulation
+// writes the free slot, the main thread always takes the newest complete one.
+// All SDL video calls stay on the main thread, the emulation runs on a thread of its own.
+struct PresentFrame {
+	unsigned char screen[512 * (SCREENY + 1)];
+	unsigned char dirty[SCREENY];	// line changed since the previously published frame
+	unsigned int pitch;
+	unsigned int overlay;			// CRT emulation as it was when the frame was handed over
+	unsigned int overlayAlpha;
+};
+
+static PresentFrame		presentFrames[3];
+// visible lines of the last frame handed over, for screenshots
+static unsigned char	publishedScreen[512 * SCREENY];
+static unsigned int		publishedPitch = 0;
+static unsigned int		frameWriteIx = 0;	// owned by the emulation
+static unsigned int		frameReadyIx = 1;	// newest complete frame
+static unsigned int		frameShowIx = 2;	// owned by the main thread
+static bool				frameReady = false;
+static SDL_mutex		*presentLock = NULL;
+static Uint32			frameEventType = (Uint32) -1;	// wakes the main thread for a frame
+static SDL_atomic_t		frameEventPending;
+// the emulation thread holds emuLock except while the pacer waits
+static SDL_Thread		*emuThread = NULL;
+static SDL_mutex		*emuLock = NULL;
+static SDL_cond			*emuWake = NULL;		// an event was handled while paused
+static SDL_atomic_t		emuLockWanted;
+static double			pacedFrameRate = 0;
+// converted pixels and the screen texture, main thread only
+static unsigned int		pixels[512 * SCR_VSIZE * 2];
+static unsigned char	pixelsDirty[SCREENY * 2];	// texture rows not uploaded yet
+static bool				convertedValid = false;
+static unsigned int		convertedPitch = 0;
+static unsigned int		convertedOverlay = 0;
+static unsigned int		convertedVideoVersion = 0;
+static bool				textureValid = false;
+static unsigned int		textureOverlay = 0;
+
+static void createScreenTexture()
+{
+	if (sdlTexture)
+		SDL_DestroyTexture(sdlTexture);
+	sdlTexture = SDL_CreateTexture(sdlRenderer,
+			textureOverlay ? SDL_PIXELFORMAT_UYVY : SDL_PIXELFORMAT_ARGB8888,
+			SDL_TEXTUREACCESS_STREAMING,
+			WINDOWX, WINDOWY * (textureOverlay ? 2 : 1));
+	textureValid = false;
+}
 
-void frameUpdate(unsigned char *src, unsigned int *target)
+static void convertLines(PresentFrame &frame, unsigned int first, unsigned int count)
 {
-	const unsigned int pixelsPerRow = ted8360->getCyclesPerRow();
+	const unsigned int pixelsPerRow = frame.pitch;
 	const unsigned int sourcePitch = (pixelsPerRow - SCREENX);
 	const unsigned int targetPitch = sourcePitch;
-	const unsigned int *texture = target;
 	unsigned int i, j;
 
     //
-    if (g_bUseOverlay) {
-        video_convert_buffer(target, pixelsPerRow, src);
+    if (frame.overlay) {
+        video_convert_buffer(pixels, pixelsPerRow, frame.screen, first, count);
+		// the CRT filter outputs two texture rows per line
+		first <<= 1;
+		count <<= 1;
     } else {
         const unsigned int *palette = palette_get_rgb();
-        for(i = 0; i < SCREENY; i++) {
+		unsigned char *src = frame.screen + first * pixelsPerRow;
+		unsigned int *target = pixels + first * pixelsPerRow;
+        for(i = 0; i < count; i++) {
             for(j = 0; j < SCREENX; j++) {
 				*target++ = palette[*src++];
 			}
@@ -405,29 +692,175 @@ void frameUpdate(unsigned char *src, unsigned int *target)
 			target += targetPitch;
 		}
     }
-    // TODO: use SDL_LockTexture instead
-	int e = SDL_UpdateTexture(sdlTexture, NULL, texture, pixelsPerRow * sizeof (unsigned int));
-	e = SDL_RenderCopy(sdlRenderer, sdlTexture, NULL, NULL);
+	memset(pixelsDirty + first, 1, count);
+}
+
+static void convertScreen(PresentFrame &frame)
+{
+	const unsigned int videoVersion = video_get_version();
+	const bool full = !convertedValid || convertedPitch != frame.pitch
+		|| convertedOverlay != frame.overlay || convertedVideoVersion != videoVersion;
+	unsigned int i = 0;
+
+	// convert only runs of changed lines
+	while (i < SCREENY) {
+		unsigned int first = i;
+		if (full) {
+			i = SCREENY;
+		} else {
+			// the CRT filter blends each line with the one above
+			while (first < SCREENY && !frame.dirty[first]
+				&& !(frame.overlay && first && frame.dirty[first - 1]))
+				first++;
+			if (first == SCREENY)
+				break;
+			i = first + 1;
+			while (i < SCREENY && (frame.dirty[i] || (frame.overlay && frame.dirty[i - 1])))
+				i++;
+		}
+		convertLines(frame, first, i - first);
+	}
+	convertedValid = true;
+	convertedPitch = frame.pitch;
+	convertedOverlay = frame.overlay;
+	convertedVideoVersion = videoVersion;
+}
+
+/*
+	Takes the newest complete frame over, converts and presents it.
+	Main thread only, a vsync stall here does not hold up the emulation.
+*/
+static void presentScreen()
+{
+	// a frame handed over from now on asks for a new wakeup
+	SDL_AtomicSet(&frameEventPending, 0);
+	if (presentLock)
+		SDL_LockMutex(presentLock);
+	const bool ready = frameReady;
+	if (ready) {
+		unsigned int ix = frameShowIx;
+		frameShowIx = frameReadyIx;
+		frameReadyIx = ix;
+		frameReady = false;
+	}
+	if (presentLock)
+		SDL_UnlockMutex(presentLock);
+	if (!ready)
+		return;
+
+	PresentFrame &frame = presentFrames[frameShowIx];
+	if (textureOverlay != frame.overlay) {
+		textureOverlay = frame.overlay;
+		createScreenTexture();
+	}
+	convertScreen(frame);
+	const unsigned int rows = SCREENY << (textureOverlay ? 1 : 0);
+	if (!textureValid)
+		memset(pixelsDirty, 1, rows);
+	// upload runs of changed rows
+	unsigned int i = 0;
+	while (i < rows) {
+		if (!pixelsDirty[i]) {
+			i++;
+			continue;
+		}
+		SDL_Rect rc;
+		rc.x = 0;
+		rc.y = i;
+		rc.w = SCREENX;
+		while (i < rows && pixelsDirty[i])
+			pixelsDirty[i++] = 0;
+		rc.h = i - rc.y;
+		// TODO: use SDL_LockTexture instead
+		SDL_UpdateTexture(sdlTexture, &rc, pixels + rc.y * frame.pitch, frame.pitch * sizeof (unsigned int));
+	}
+	textureValid = true;
+
+	SDL_RenderCopy(sdlRenderer, sdlTexture, NULL, NULL);
+	if (frame.overlayAlpha)
+		showKeyboardOverlay(frame.overlayAlpha);
+	SDL_RenderPresent(sdlRenderer);
+}
+
+/*
+	Hands a frame over to the main thread, with the emulation locked
+*/
+static void publishFrame(unsigned char *src)
+{
+	// the previous frame is kept for change detection
+	unsigned char *lastScreen = publishedScreen;
+	const unsigned int lastPitch = publishedPitch;
+	// visible bytes plus the extra pixel the CRT filter reads
+	const unsigned int lineLength = SCREENX + 2;
+	PresentFrame &frame = presentFrames[frameWriteIx];
+	unsigned int i;
+
+	frame.pitch = ted8360->getCyclesPerRow();
+	for (i = 0; i < SCREENY; i++) {
+		unsigned char *line = lastScreen + i * frame.pitch;
+		unsigned char *srcLine = src + i * frame.pitch;
+		frame.dirty[i] = lastPitch != frame.pitch || memcmp(line, srcLine, lineLength);
+		if (frame.dirty[i])
+			memcpy(line, srcLine, lineLength);
+	}
+	publishedPitch = frame.pitch;
+	memcpy(frame.screen, src, frame.pitch * SCREENY);
+	frame.overlay = g_bUseOverlay;
+	frame.overlayAlpha = timeOutOverlayKeys;
 	if (timeOutOverlayKeys) {
-		showKeyboardOverlay();
 		//SDL_StartTextInput();
 		if (!mouseBtnHeld)
 			timeOutOverlayKeys -= 4;
 	}
-	SDL_RenderPresent(sdlRenderer);
+	if (presentLock)
+		SDL_LockMutex(presentLock);
+	if (frameReady) {
+		// the main thread skips the unconsumed frame, keep its changes
+		PresentFrame &skipped = presentFrames[frameReadyIx];
+		for (i = 0; i < SCREENY; i++)
+			frame.dirty[i] |= skipped.dirty[i];
+	}
+	frameWriteIx = frameReadyIx;
+	frameReadyIx = &frame - presentFrames;
+	frameReady = true;
+	if (presentLock)
+		SDL_UnlockMutex(presentLock);
 }
 
-static void frameUpdate()
+/*
+	Shows the frame right away, for the menus and other one-off updates
+	made by the main thread
+*/
+void frameUpdate(unsigned char *src)
+{
+	publishFrame(src);
+	presentScreen();
+}
+
+// top left pixel of the visible screen area
+static unsigned char *getVisibleScreen()
 {
 	const unsigned int cyclesPerRow = ted8360->getCyclesPerRow();
 	const int offsetX = cyclesPerRow == VIC_PIXELS_PER_ROW ? -72 : 8;
 	const int offsetY = cyclesPerRow == VIC_PIXELS_PER_ROW ? 9 : 0;
 
+	return ted8360->getScreenData() + (cyclesPerRow - 384 - offsetX) / 2 + offsetY * cyclesPerRow;
+}
+
+static void frameUpdate()
+{
 	if (popupMessageTimeOut)
 		showPopUpMessage();
-    frameUpdate(ted8360->getScreenData() + (cyclesPerRow - 384 - offsetX) / 2 + offsetY * cyclesPerRow, pixels);
+    frameUpdate(getVisibleScreen());
+}
+
+static void captureFrame()
+{
+	if (video_capture_active())
+		video_capture_frame(getVisibleScreen(), ted8360->getCyclesPerRow());
 }
 
+
 /* ---------- Management of settings ---------- */
 
 //-----------------------------------------------------------------------------
@@ -461,6 +894,10 @@ bool SaveSettings(char *inifileName)
 		fprintf(ini, "CRTEmulation = %u\n", g_bUseOverlay);
 		fprintf(ini, "WindowMultiplier = %u\n", g_iWindowMultiplier);
 		fprintf(ini, "EmulationLevel = %u\n", g_iEmulationLevel);
+		fprintf(ini, "AdaptiveFrameSkip = %u\n", g_bFrameSkip);
+		fprintf(ini, "FastForwardSpeed = %u\n", g_iFastForwardSpeed);
+		fprintf(ini, "AutoWarpFrames = %u\n", g_iAutoWarpFrames);
+		fprintf(ini, "KernalLoadTrap = %u\n", g_bLoadTrap);
 
 		fclose(ini);
 		return true;
@@ -525,6 +962,14 @@ bool LoadSettings(char *inifileName)
 					g_iWindowMultiplier = number ? (number & 3) : 1;
 				else if (!strcmp(keyword, "EmulationLevel"))
 					g_iEmulationLevel = atoi(value);
+				else if (!strcmp(keyword, "AdaptiveFrameSkip"))
+					g_bFrameSkip = !!atoi(value);
+				else if (!strcmp(keyword, "FastForwardSpeed"))
+					g_iFastForwardSpeed = atoi(value) % 4;
+				else if (!strcmp(keyword, "AutoWarpFrames"))
+					g_iAutoWarpFrames = atoi(value);
+				else if (!strcmp(keyword, "KernalLoadTrap"))
+					g_bLoadTrap = !!atoi(value);
 			}
 		}
 		fclose(ini);
@@ -534,21 +979,6 @@ bool LoadSettings(char *inifileName)
 	return false;
 }
 
-static bool saveScreenshotBMP(char* filepath, SDL_Window* SDLWindow, SDL_Renderer* SDLRenderer)
-{
-	SDL_Surface* saveSurface = NULL;
-	int w, h;
-
-	SDL_GetRendererOutputSize(SDLRenderer, &w, &h);
-	saveSurface = SDL_CreateRGBSurface(0, w, h, 32, 0x00ff0000, 0x0000ff00, 0x000000ff, 0xff000000);
-	if (saveSurface && 0 == SDL_RenderReadPixels(SDLRenderer, 0, SDL_PIXELFORMAT_ARGB8888, saveSurface->pixels, saveSurface->pitch)) {
-		SDL_SaveBMP(saveSurface, filepath);
-		SDL_FreeSurface(saveSurface);
-		return true;
-	}
-	return false;
-}
-
 static bool getSerializedFilename(const char *name, const char *extension, char *out)
 {
 	char dummy[512];
@@ -573,20 +1003,40 @@ static bool getSerializedFilename(const char *name, const char *extension, char
 
 //-----------------------------------------------------------------------------
 // Name: SaveBitmap()
-// Desc: Saves the SDL surface to Windows bitmap file named as yapeXXXX.bmp
+// Desc: Saves the emulated screen to an indexed Windows bitmap file named as yapeXXXX.bmp
 //-----------------------------------------------------------------------------
 static int SaveBitmap()
 {
-    char bmpname[512];
+	// the frame as last shown, the one being emulated may be skipped or unfinished
+	if (!publishedPitch)
+		return false;
+	return screenshot_save("yape", publishedScreen, publishedPitch);
+}
+
+static void toggleVideoCapture()
+{
+	if (video_capture_active()) {
+		video_capture_stop();
+		PopupMsg(" VIDEO CAPTURE STOPPED ");
+	} else {
+		char name[512];
+		unsigned int rateNum, rateDen;
+		ted8360->getFrameRate(rateNum, rateDen);
+		if (getSerializedFilename("yape", video_capture_extension(), name) && video_capture_start(name, rateNum, rateDen))
+			PopupMsg(" CAPTURING VIDEO ");
+	}
+}
 
-    // finding the last yapeXXXX.bmp image
-	if (getSerializedFilename("yape", "bmp", bmpname)) {
-		if (saveScreenshotBMP(bmpname, sdlWindow, sdlRenderer)) {
-			fprintf(stderr, "Screenshot saved: %s\n", bmpname);
-			return true;
-		}
+static void toggleAudioCapture()
+{
+	if (audio_capture_active()) {
+		audio_capture_stop();
+		PopupMsg(" AUDIO CAPTURE STOPPED ");
+	} else {
+		char name[512];
+		if (getSerializedFilename("yape", "wav", name) && sound_capture_start(name))
+			PopupMsg(" CAPTURING AUDIO ");
 	}
-	return false;
 }
 
 bool mainSaveMemoryAsPrg(const char *prgname, unsigned short &beginAddr, unsigned short &endAddr)
@@ -618,38 +1068,137 @@ static void enterMenu()
 #else
 	uinterface->enterMenu();
 #endif
-	if (g_50Hz)
-		sound_resume();
+	sound_resume();
 	if (!g_bActive) {
 		PopupMsg(" PAUSED ");
 		frameUpdate();
 	}
 }
 
+// multiple of the machine frame rate, 0 is unlimited
+static unsigned int getSpeedMultiplier()
+{
+	const unsigned int speeds[] = { 2, 4, 8, 0 };
+	if (autoWarping)
+		return 0;
+	return g_50Hz ? 1 : speeds[g_iFastForwardSpeed % 4];
+}
+
+static const char *fastForwardSpeedLabel()
+{
+	const char *label[] = { "2X", "4X", "8X", "MAX" };
+	return label[g_iFastForwardSpeed % 4];
+}
+
+static void flipFastForwardSpeed(void *)
+{
+	g_iFastForwardSpeed = (g_iFastForwardSpeed + 1) % 4;
+}
+
 static void toggleFullThrottle(void *none)
 {
 	g_50Hz = !g_50Hz;
 
-	sprintf(textout, " 50 HZ TIMER IS ");
+	// audio keeps playing, fragments are left out when fast-forwarding
+	sound_set_fast_forward(!g_50Hz || autoWarping);
 	if (g_50Hz) {
-		sound_resume();
-		strcat(textout,"ON ");
+		PopupMsg(" 50 HZ TIMER IS ON ");
 #ifdef __EMSCRIPTEN__
 		emscripten_set_main_loop_timing(EM_TIMING_RAF, 0);
 #endif
 	}
 	else {
-		sound_pause();
-		strcat(textout, "OFF ");
+		PopupMsg(" FAST-FORWARD %s ", fastForwardSpeedLabel());
 #ifdef __EMSCRIPTEN__
 		emscripten_set_main_loop_timing(EM_TIMING_SETTIMEOUT, 1);
 #endif
 	}
-	PopupMsg(textout);
 	// restart counter
 	g_TotFrames = 0;
 }
 
+// engages fast-forward, or steps to the next speed when already on
+static void cycleFastForwardSpeed()
+{
+	if (g_50Hz) {
+		toggleFullThrottle(NULL);
+		return;
+	}
+	flipFastForwardSpeed(NULL);
+	PopupMsg(" FAST-FORWARD %s ", fastForwardSpeedLabel());
+	g_TotFrames = 0;
+}
+
+static void flipAutoWarpFrames(void *)
+{
+	const unsigned int frames[] = { 10, 50, 250 };
+	unsigned int i = 0;
+
+	while (i < 3 && frames[i] <= g_iAutoWarpFrames)
+		i++;
+	g_iAutoWarpFrames = i < 3 ? frames[i] : 0;
+}
+
+static const char *autoWarpLabel()
+{
+	static char label[24];
+
+	if (!g_iAutoWarpFrames)
+		return "OFF";
+	snprintf(label, sizeof(label), "%u FRAMES", g_iAutoWarpFrames);
+	return label;
+}
+
+// frames without keyboard, joystick or mouse input before warping
+static unsigned int autoWarpQuietFrames = 0;
+
+static void holdAutoWarp(unsigned int eventType)
+{
+	switch (eventType) {
+		case SDL_KEYDOWN:
+		case SDL_KEYUP:
+		case SDL_JOYAXISMOTION:
+		case SDL_JOYHATMOTION:
+		case SDL_JOYBUTTONDOWN:
+		case SDL_JOYBUTTONUP:
+		case SDL_MOUSEBUTTONDOWN:
+			autoWarpQuietFrames = 50;
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+	Runs at host speed while a tape or disk motor is on, then stays warped
+	for the set number of frames after the motors stop
+*/
+static void updateAutoWarp()
+{
+	static unsigned int framesLeft = 0;
+	const bool loading = ted8360->tap->isMotorOn() || CTrueDrive::IsMotorRunning();
+
+	if (autoWarpQuietFrames) {
+		autoWarpQuietFrames--;
+		framesLeft = 0;
+	} else if (g_iAutoWarpFrames && g_50Hz && loading)
+		framesLeft = g_iAutoWarpFrames;
+	else if (framesLeft)
+		framesLeft--;
+
+	if (autoWarping == (framesLeft != 0))
+		return;
+	autoWarping = framesLeft != 0;
+	const bool unthrottled = !g_50Hz || autoWarping;
+	// fragments are left out as in fast-forward, the sound chips keep running
+	// so that programs reading back OSC3/ENV3 see the same values
+	sound_set_fast_forward(unthrottled);
+#ifdef __EMSCRIPTEN__
+	emscripten_set_main_loop_timing(unthrottled ? EM_TIMING_SETTIMEOUT : EM_TIMING_RAF, unthrottled ? 1 : 0);
+#endif
+	g_TotFrames = 0;
+}
+
 static void setEmulationLevel(unsigned int level)
 {
 	unsigned char ram[RAMSIZE];
@@ -712,6 +1261,7 @@ static void setEmulationLevel(unsigned int level)
             ted8360->Write(0, prddr);
             ted8360->Write(1, prp & prddr);
 		}
+		hookVirtualDrive();
 		//
 		sound_resume();
 		g_bActive = 1;
@@ -736,11 +1286,7 @@ static void toggleVsync(void *none)
 static void toggleCrtEmulation(void *none)
 {
     g_bUseOverlay = !g_bUseOverlay;
-    SDL_DestroyTexture(sdlTexture);
-    sdlTexture = SDL_CreateTexture(sdlRenderer,
-            g_bUseOverlay ? SDL_PIXELFORMAT_UYVY : SDL_PIXELFORMAT_ARGB8888,
-            SDL_TEXTUREACCESS_STREAMING,
-			WINDOWX, WINDOWY * (g_bUseOverlay ? 2 : 1));
+	// the next frame handed over carries the new setting to the texture
     PopupMsg(" CRT emulation %s ", g_bUseOverlay ? "ON" : "OFF");
 }
 
@@ -774,14 +1320,12 @@ static void flipWindowScale(void *none)
 }
 
 //-----------------------------------------------------------------------------
-// Name: poll_events()
-// Desc: polls SDL events if there's any in the message queue
+// Name: handle_event()
+// Desc: acts on an SDL event, with the emulation locked
 //-----------------------------------------------------------------------------
-inline static void poll_events(void)
+static void handle_event(SDL_Event &event)
 {
-	SDL_Event event;
-
-    if ( SDL_PollEvent(&event) ) {
+		holdAutoWarp(event.type);
         switch (event.type) {
 
 			case SDL_WINDOWEVENT:
@@ -838,6 +1382,13 @@ inline static void poll_events(void)
 							case SDLK_m :
 								monitorEnter(machine);
 								break;
+							case SDLK_n:
+								{
+									unsigned int disk, disks;
+									if (CTrueDrive::NextDisk(disk, disks))
+										PopupMsg(" DISK %u OF %u ", disk, disks);
+								}
+								break;
                             case SDLK_p:
 								toggleCrtEmulation(NULL);
                                 break;
@@ -854,6 +1405,15 @@ inline static void poll_events(void)
 							case SDLK_w :
 								toggleFullThrottle(NULL);
 								break;
+							case SDLK_f :
+								cycleFastForwardSpeed();
+								break;
+							case SDLK_v:
+								toggleVideoCapture();
+								break;
+							case SDLK_a:
+								toggleAudioCapture();
+								break;
 							case SDLK_RETURN:
 								{
 									Uint32 isFS = SDL_GetWindowFlags(sdlWindow) & SDL_WINDOW_FULLSCREEN_DESKTOP;
@@ -878,8 +1438,7 @@ inline static void poll_events(void)
 								}
 								break;
 						};
-						if (g_50Hz)
-							sound_resume();
+						sound_resume();
 						return;
 				}
 				switch (event.key.keysym.sym) {
@@ -995,7 +1554,18 @@ inline static void poll_events(void)
             case SDL_QUIT:
                 exit(0);
         }
-    }
+}
+
+//-----------------------------------------------------------------------------
+// Name: poll_events()
+// Desc: polls SDL events if there's any in the message queue
+//-----------------------------------------------------------------------------
+inline static void poll_events(void)
+{
+	SDL_Event event;
+
+	if (SDL_PollEvent(&event))
+		handle_event(event);
 }
 
 static void machineInit()
@@ -1025,12 +1595,14 @@ static void machineInit()
 	init_palette(ted8360);
 	// CPU
 	machine->Reset();
+	hookVirtualDrive();
 }
 
 void machineShutDown()
 {
 	machineEnable1551(true);
 	delete fsdrive;
+	delete d64drive;
 	delete iec;
 	delete tcbm;
 	delete machine;
@@ -1039,6 +1611,9 @@ void machineShutDown()
 
 static void app_close()
 {
+	stopEmulationThread();
+	video_capture_stop();
+	screenshot_flush();
 	close_audio();
 	// Save settings if required
 	if (g_bSaveSettings)
@@ -1121,24 +1696,168 @@ static void app_initialise()
 							   WINDOWX, WINDOWY * (g_bUseOverlay ? 2 : 1));
 	// Make target texture to render to
 	SDL_SetRenderTarget(sdlRenderer, sdlTexture);
+	textureOverlay = g_bUseOverlay;
 	init_audio();
-	if (!g_50Hz)
-		sound_pause();
+	sound_set_fast_forward(!g_50Hz);
 	KEYS::initPcJoys();
 }
 
+//-----------------------------------------------------------------------------
+// Name: updateFrameSkip()
+// Desc: decides if the next frame gets rendered, skipping frames while the
+//       emulation lags behind real time
+//-----------------------------------------------------------------------------
+static void updateFrameSkip()
+{
+	const unsigned int maxSkippedFrames = 4;
+	static unsigned int skippedFrames = 0;
+	bool render = true;
+
+	// captures need every frame
+	if (g_bFrameSkip && g_50Hz && !autoWarping && !video_capture_active()) {
+		// the pacer measures against the exact frame period of the machine
+		render = !ad_vsync_frames_behind() || skippedFrames >= maxSkippedFrames;
+		skippedFrames = render ? 0 : skippedFrames + 1;
+	} else {
+		skippedFrames = 0;
+	}
+	// nor are frames rendered that the pacer is not going to show
+	const bool presentDue = ad_vsync_present_due(getSpeedMultiplier());
+	if (!video_capture_active())
+		render = render && presentDue;
+	TED::setFrameRendered(render);
+}
+
 /* ---------- MAIN LOOP ---------- */
+
+// one frame of emulation, with the emulation locked
+static void emulateFrame()
+{
+	// the pacer follows the machine, which may have been switched meanwhile
+	const double frameRate = ted8360->getFrameRate();
+	if (frameRate != pacedFrameRate) {
+		pacedFrameRate = frameRate;
+		ad_vsync_set_frame_rate(frameRate);
+	}
+	updateAutoWarp();
+	updateFrameSkip();
+	ted8360->ted_process(1);
+	captureFrame();
+	if (g_inDebug)
+		DebugInfo();
+	ShowFrameRate(g_FrameRate);
+}
+
+static void showFrame()
+{
+	if (popupMessageTimeOut)
+		showPopUpMessage();
+	publishFrame(getVisibleScreen());
+}
+
+static void lockEmulation()
+{
+	// the emulation thread steps aside between two frames when asked
+	SDL_AtomicAdd(&emuLockWanted, 1);
+	SDL_LockMutex(emuLock);
+	SDL_AtomicAdd(&emuLockWanted, -1);
+}
+
+/*
+	Runs the machine and the pacer. Only the pacer wait is done unlocked, that
+	is when the main thread gets to handle events.
+*/
+static int emulationThreadFunc(void *)
+{
+	SDL_LockMutex(emuLock);
+	for (;;) {
+		if (!g_bActive) {
+			// paused until the main thread has handled an event
+			SDL_CondWaitTimeout(emuWake, emuLock, 100);
+			continue;
+		}
+		emulateFrame();
+		const unsigned int speed = getSpeedMultiplier();
+		const bool rendered = TED::isFrameRendered();
+		SDL_UnlockMutex(emuLock);
+		const bool due = ad_vsync(speed);
+		while (SDL_AtomicGet(&emuLockWanted))
+			SDL_Delay(1);
+		SDL_LockMutex(emuLock);
+		if (due && rendered) {
+			showFrame();
+			// a single wakeup until the main thread takes a frame
+			if (SDL_AtomicCAS(&frameEventPending, 0, 1)) {
+				SDL_Event event;
+				memset(&event, 0, sizeof(event));
+				event.type = frameEventType;
+				SDL_PushEvent(&event);
+			}
+		}
+	}
+	return 0;
+}
+
+static bool startEmulationThread()
+{
+#ifndef __EMSCRIPTEN__
+	frameEventType = SDL_RegisterEvents(1);
+	presentLock = SDL_CreateMutex();
+	emuLock = SDL_CreateMutex();
+	emuWake = SDL_CreateCond();
+	if (frameEventType != (Uint32) -1 && presentLock && emuLock && emuWake) {
+		SDL_AtomicSet(&frameEventPending, 0);
+		SDL_AtomicSet(&emuLockWanted, 0);
+		emuThread = SDL_CreateThread(emulationThreadFunc, "Emulation", NULL);
+	}
+	if (!emuThread)
+		fprintf(stderr, "Could not start the emulation thread, running it on the main thread: %s\n", SDL_GetError());
+#endif
+	return emuThread != NULL;
+}
+
+/*
+	The emulation thread is stopped at its next frame by keeping the lock,
+	leaving the process takes it down
+*/
+static void stopEmulationThread()
+{
+	if (emuThread)
+		lockEmulation();
+}
+
+/*
+	With the emulation on its own thread the main thread presents the
+	frames and handles the events, SDL video calls stay here
+*/
+static void presenterLoop()
+{
+	SDL_Event event;
+
+	for (;;) {
+		presentScreen();
+		if (!SDL_WaitEventTimeout(&event, 100) || event.type == frameEventType)
+			continue;
+		lockEmulation();
+		do {
+			if (event.type != frameEventType)
+				handle_event(event);
+		} while (SDL_PollEvent(&event));
+		SDL_CondSignal(emuWake);
+		SDL_UnlockMutex(emuLock);
+	}
+}
+
 static void mainLoop()
 {
 	// hook into the emulation loop if active
 	if (g_bActive) {
-		ted8360->ted_process(1);
+		emulateFrame();
 		poll_events();
-		if (g_inDebug)
-			DebugInfo();
-		ShowFrameRate(g_FrameRate);
-		if (ad_vsync(!!g_50Hz))
-			frameUpdate();
+		if (ad_vsync(getSpeedMultiplier()) && TED::isFrameRendered()) {
+			showFrame();
+			presentScreen();
+		}
 	} else {
 #ifndef __EMSCRIPTEN__ // does not work in Emscripten
 		if (SDL_WaitEvent(NULL))
@@ -1191,6 +1910,7 @@ int main(int argc, char *argv[])
 		ad_get_curr_dir(tmpStr);
 		fprintf(stderr, "IEC drive path: %s\n", tmpStr);
 		setEmulationLevel(g_iEmulationLevel);
+		hookVirtualDrive();
 	} else
 		fprintf(stderr,"Error loading settings or no .ini file present...\n");
 #endif
@@ -1207,8 +1927,17 @@ int main(int argc, char *argv[])
 			setEmulationLevel(2);
 		autostart_file(argv[2], true);
 #else
-		// and then try to load the parameter as file
-		autostart_file(argv[1], true);
+		for (int i = 1; i < argc; i++) {
+			if (!strcmp(argv[i], "-capture") && i + 1 < argc) {
+				unsigned int rateNum, rateDen;
+				ted8360->getFrameRate(rateNum, rateDen);
+				video_capture_start(argv[++i], rateNum, rateDen);
+			}
+			else if (!strcmp(argv[i], "-audiocapture") && i + 1 < argc)
+				sound_capture_start(argv[++i]);
+			else // and then try to load the parameter as file
+				autostart_file(argv[i], true);
+		}
 #endif
 	}
 #ifdef __EMSCRIPTEN__
@@ -1221,10 +1950,14 @@ int main(int argc, char *argv[])
 	printf("LALT + I     : switch emulated joystick port\n");
 	printf("LALT + L     : switch among emulators (C+4 cycle based; C+4 line based; C64 cycle based)\n");
 	printf("LALT + M     : enter console based external monitor and disassembler (currently deadlocks!)\n");
+	printf("LALT + N     : insert the next disk of a disk set\n");
 	printf("LALT + P     : toggle CRT emulation\n");
 	printf("LALT + R     : machine reset (press Shift+F11 for hard reset)\n");
 	printf("LALT + S     : display frame rate on/off\n");
-	printf("LALT + W     : toggle between unlimited speed and original speed\n");
+	printf("LALT + W     : toggle between fast-forward and original speed\n");
+	printf("LALT + F     : fast-forward, step through 2x/4x/8x/max speed\n");
+	printf("LALT + V     : start/stop video capture\n");
+	printf("LALT + A     : start/stop audio capture\n");
 	printf("LALT + ENTER : toggle full screen mode\n");
 	printf("LALT + F5    : save emulator snapshot\n");
 	printf("LALT + F6    : load emulator snapshot\n");
@@ -1234,6 +1967,8 @@ int main(int argc, char *argv[])
 	setMainLoop(1);
 #else
 	ad_vsync_init();
+	if (startEmulationThread())
+		presenterLoop();
 	for (;;) {
 		mainLoop();
 	}
@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <string.h>
 #include "tedmem.h"
+#include "cpu.h"
+#include "device.h"
 #include "types.h"
 
 static FILE	*prg;
@@ -24,66 +26,89 @@ static void prgLoadFromBuffer(unsigned short &adr, unsigned int size, unsigned c
     mem->Write(loadEndAddPtr + 1,(endaddr)>>8);
 }
 
-bool PrgLoad(const char *fname, int loadaddress, TED *mem)
+/*
+	P00 files are told by their name or their signature
+*/
+bool PrgLoad(const unsigned char *data, unsigned int size, const char *fname, int loadaddress, TED *mem)
 {
 	unsigned short	loadaddr;
-	unsigned int	fsize;
-	char			*fext;
-	int				p00offset = 0;
-
-	if ((prg = fopen(fname, "rb"))== NULL) {
-    	return false;
-	} else {
-		fext = (char *) strrchr( fname, '.');
-		if (!strcmp( fext, ".p00") || !strcmp(fext, ".P00"))
-			p00offset = 26;
-		// load PRG file
-		fseek(prg, 0L, SEEK_END);
-		fsize = ftell(prg) - p00offset;
-		fsize &= 0xFFFF;
-		fseek(prg, p00offset, SEEK_SET);
-		fread(lpBufPtr, 1, fsize, prg);
-		fclose(prg);
-		// copy to memory
-		if (loadaddress&0x10000)
-			loadaddr = loadaddress&0xFFFF;
-		else
-			loadaddr = lpBufPtr[0]|(lpBufPtr[1] << 8);
+	const char		*fext = strrchr(fname, '.');
 
-		if (fsize < 2)
+	if ((fext && (!strcmp(fext, ".p00") || !strcmp(fext, ".P00")))
+			|| (size >= 26 && !memcmp(data, "C64File", 8))) {
+		if (size < 26)
 			return false;
-        fsize -= 2;
-        prgLoadFromBuffer(loadaddr, fsize, lpBufPtr + 2, mem);
+		data += 26;
+		size -= 26;
 	}
-	fprintf( stderr, "Loaded: %s at $%04X-$%04X\n", fname, loadaddr, loadaddr + fsize);
+	size &= 0xFFFF;
+	if (size < 2)
+		return false;
+	// copy to memory
+	if (loadaddress&0x10000)
+		loadaddr = loadaddress&0xFFFF;
+	else
+		loadaddr = data[0]|(data[1] << 8);
+	size -= 2;
+	memcpy(lpBufPtr, data + 2, size);
+	prgLoadFromBuffer(loadaddr, size, lpBufPtr, mem);
+	fprintf( stderr, "Loaded: %s at $%04X-$%04X\n", fname, loadaddr, loadaddr + size);
 	return true;
 }
 
+bool PrgLoad(const char *fname, int loadaddress, TED *mem)
+{
+	unsigned int	fsize;
+	static unsigned char fileBuf[0x10000 + 26];
+
+	if ((prg = fopen(fname, "rb"))== NULL)
+		return false;
+	fsize = (unsigned int) fread(fileBuf, 1, sizeof(fileBuf), prg);
+	fclose(prg);
+	return PrgLoad(fileBuf, fsize, fname, loadaddress, mem);
+}
+
+bool prgLoadFromT64(const unsigned char *data, unsigned int size, const char *t64path, unsigned short *, TED *mem)
+{
+	if (size < 0x60)
+		return false;
+	const unsigned char *dirEntry = data + 0x40;
+	// PRG type?
+	if (dirEntry[1]) {
+		unsigned short adr = dirEntry[2] | (dirEntry[3] << 8);
+		unsigned short endAddr =  dirEntry[4] | (dirEntry[5] << 8);
+		int fsize = int(endAddr - adr);
+		unsigned int offsetInFile = dirEntry[8] | (dirEntry[9] << 8) | (dirEntry[10] << 16) | (dirEntry[11] << 24);
+		// some images have a wrong end address, take what is there
+		if (fsize > 0 && offsetInFile < size) {
+			if ((unsigned int) fsize > size - offsetInFile)
+				fsize = size - offsetInFile;
+			memcpy(lpBufPtr, data + offsetInFile, fsize);
+			prgLoadFromBuffer(adr, fsize, lpBufPtr, mem);
+			fprintf(stderr, "First PRG loaded from '%s' to $%04X-$%04X\n", t64path, adr, endAddr);
+			return true;
+		}
+	}
+	return false;
+}
+
 bool prgLoadFromT64(const char *t64path, unsigned short *loadAddress, TED *mem)
 {
 	if ((prg = fopen(t64path, "rb"))) {
-	    unsigned char dirEntry[32];
-	    fseek(prg, 0x40, SEEK_SET);
-        if (fread(dirEntry, 1, 32, prg) == 32) {
-            // PRG type?
-            if (dirEntry[1]) {
-                unsigned short adr = dirEntry[2] | (dirEntry[3] << 8);
-                unsigned short endAddr =  dirEntry[4] | (dirEntry[5] << 8);
-                int fsize = int(endAddr - adr);
-                if (fsize > 0) {
-                    unsigned int offsetInFile = dirEntry[8] | (dirEntry[9] << 8) | (dirEntry[10] << 16) | (dirEntry[11] << 24);
-                    fseek(prg, offsetInFile, SEEK_SET);
-                    if (fread(lpBufPtr, 1, fsize, prg)) {
-                        prgLoadFromBuffer(adr, fsize, lpBufPtr, mem);
-                        fprintf(stderr, "First PRG loaded from '%s' to $%04X-$%04X\n", t64path, adr, endAddr);
-                        return true;
-                    }
-                }
-            }
-        }
-	    fclose(prg);
+		fseek(prg, 0L, SEEK_END);
+		long size = ftell(prg);
+		fseek(prg, 0L, SEEK_SET);
+		if (size > 0) {
+			unsigned char *data = new unsigned char[size];
+			size = (long) fread(data, 1, size, prg);
+			fclose(prg);
+			bool loaded = prgLoadFromT64(data, (unsigned int) size, t64path, loadAddress, mem);
+			delete [] data;
+			return loaded;
+		}
+		fclose(prg);
 	}
-    return false;
+	return false;
 }
 
 bool prgSaveBasicMemory(const char *prgname, TED *mem, unsigned short &beginAddr, unsigned short &endAddr, bool isBasic)
@@ -102,3 +127,59 @@ bool prgSaveBasicMemory(const char *prgname, TED *mem, unsigned short &beginAddr
     }
     return false;
 }
+
+/*
+	Runs in place of the KERNAL LOAD routine and copies the whole file from
+	the drive emulated at DOS level straight into RAM
+*/
+bool prgLoadTrap(CPU *cpu, void *drive)
+{
+	TED *mem = TED::instance();
+	const KernalLoad &kl = mem->getKernalLoad();
+	CIECDevice *device = (CIECDevice *) drive;
+	char name[256];
+	unsigned char lo, hi, byte;
+	unsigned int status;
+
+	// only the ROM routine, loading (not verifying) from drive 8
+	if (mem->Read(kl.entry) != 0x85 || mem->Read(kl.entry + 1) != kl.verifyFlag
+		|| cpu->getAC() || mem->Ram[kl.device] != 8 || !mem->Ram[kl.nameLength])
+		return false;
+
+	unsigned int nameAddr = mem->Ram[kl.namePtr] | (mem->Ram[kl.namePtr + 1] << 8);
+	unsigned int i;
+	for (i = 0; i < mem->Ram[kl.nameLength]; i++)
+		name[i] = mem->Ram[(nameAddr + i) & 0xFFFF];
+	name[i] = 0;
+
+	mem->Ram[kl.verifyFlag] = 0;
+	if (device->Open(0, name) || (status = device->Read(0, &lo)) || (status = device->Read(0, &hi)) & 0x80) {
+		device->Close(0);
+		mem->Ram[kl.status] = 0x42;
+		cpu->setAC(4);	// FILE NOT FOUND
+		cpu->setST(cpu->getST() | 0x01);
+		return true;
+	}
+
+	unsigned int adr = mem->Ram[kl.secondaryAddress] ? (lo | (hi << 8))
+		: (mem->Ram[kl.loadAddress] | (mem->Ram[kl.loadAddress + 1] << 8));
+	unsigned int startAdr = adr;
+	while (!status) {
+		status = device->Read(0, &byte);
+		if (status & 0x80)
+			break;
+		mem->poke(adr, byte);
+		adr = (adr + 1) & 0xFFFF;
+	}
+	device->Close(0);
+
+	unsigned short loadEndAddPtr = mem->getEndLoadAddressPtr();
+	mem->Ram[loadEndAddPtr] = adr & 0xFF;
+	mem->Ram[loadEndAddPtr + 1] = adr >> 8;
+	mem->Ram[kl.status] = 0x40;
+	cpu->setX(adr & 0xFF);
+	cpu->setY(adr >> 8);
+	cpu->setST(cpu->getST() & ~0x01);
+	fprintf( stderr, "Trapped LOAD: \"%s\" at $%04X-$%04X\n", name, startAdr, adr);
+	return true;
+}
@@ -1,9 +1,14 @@
 #pragma once
 
 class TED;
+class CPU;
 
 extern bool PrgLoad(const char *fname, int loadaddress, TED *mem);
 extern bool prgLoadFromT64(const char *t64path, unsigned short *loadAddress, TED *mem);
+// the same from images already in memory, the name is only for the log
+extern bool PrgLoad(const unsigned char *data, unsigned int size, const char *fname, int loadaddress, TED *mem);
+extern bool prgLoadFromT64(const unsigned char *data, unsigned int size, const char *t64path, unsigned short *loadAddress, TED *mem);
 extern bool prgSaveBasicMemory(const char *prgname, TED *mem, unsigned short &beginAddr, unsigned short &endAddr, 
 	bool isBasic = true);
-extern bool mainSaveMemoryAsPrg(const char *prgname, unsigned short &beginAddr, unsigned short &endAddr);
\ No newline at end of file
+extern bool mainSaveMemoryAsPrg(const char *prgname, unsigned short &beginAddr, unsigned short &endAddr);
+extern bool prgLoadTrap(CPU *cpu, void *drive);
@@ -2,6 +2,7 @@
 #include "iec.h"
 #include "tedmem.h"
 #include "tcbm.h"
+#include "cpu.h"
 
 enum {
 	ST_OK = 0,				// No error
@@ -123,6 +124,22 @@ IecFakeSerial::IecFakeSerial(unsigned int DevNr, CIECDevice *iecDev) : CSerial(D
 	cycleCount = 0;
 
 	namePtr = nameBuffer;
+
+	TED *ted = TED::instance();
+	cpu = ted->cpuptr;
+	const KernalSerial &ks = ted->getKernalSerial();
+	if (cpu && ks.acptr) {
+		cpu->addTrap(ks.acptr, receiveTrap, this);
+		cpu->addTrap(ks.isour, sendTrap, this);
+	}
+}
+
+IecFakeSerial::~IecFakeSerial()
+{
+	if (cpu) {
+		cpu->removeTraps(receiveTrap, this);
+		cpu->removeTraps(sendTrap, this);
+	}
 }
 
 void IecFakeSerial::interpretIecByte()
@@ -339,23 +356,7 @@ void IecFakeSerial::update()
 						step = SM_RDY_TO_SEND;
 						//if ( dataTransfered ) 
 						if (state & (IEC_STATE_LISTENING))
-						{
-							unsigned int command = dataTransfered ? CIECInterface::CMD_DATA : CIECInterface::CMD_OPEN;
-							switch (dev_nr) {
-								case 8:
-								case 9:
-								case 10:
-								case 11:
-									errorState = iecDevice->Write( secondaryAddress & 0x0F, io_byte, command, eoi != 0);
-									break;
-								case 4:
-								case 5:
-									errorState = iecDevice->Write( secondaryAddress & 0x0F, io_byte, command, eoi != 0);
-									//errorState = printer_send_byte( io_byte, eoi)
-									;
-							}
-							
-						}
+							writeToDevice();
 						eoi = 0;
 					}
 #if IEC_DEBUG >= 1
@@ -623,6 +624,116 @@ void IecFakeSerial::update()
 	updateBus();
 }
 
+void IecFakeSerial::writeToDevice()
+{
+	unsigned int command = dataTransfered ? CIECInterface::CMD_DATA : CIECInterface::CMD_OPEN;
+	switch (dev_nr) {
+		case 8:
+		case 9:
+		case 10:
+		case 11:
+			errorState = iecDevice->Write( secondaryAddress & 0x0F, io_byte, command, eoi != 0);
+			break;
+		case 4:
+		case 5:
+			errorState = iecDevice->Write( secondaryAddress & 0x0F, io_byte, command, eoi != 0);
+			//errorState = printer_send_byte( io_byte, eoi)
+			;
+	}
+}
+
+/*
+	The KERNAL routine must be in place, not RAM or a patched ROM under it
+*/
+static bool isKernalRoutine(TED *mem, unsigned int addr, unsigned char secondOpcode)
+{
+	return mem->Read(addr) == 0x78 && mem->Read(addr + 1) == secondOpcode;
+}
+
+bool IecFakeSerial::receiveTrap(CPU *cpu, void *serial)
+{
+	return ((IecFakeSerial *) serial)->receiveByte(cpu);
+}
+
+bool IecFakeSerial::sendTrap(CPU *cpu, void *serial)
+{
+	return ((IecFakeSerial *) serial)->sendByte(cpu);
+}
+
+/*
+	ACPTR: take the next byte from the device while it is talking and
+	idling between two bytes, leaving the bus as after the handshake
+*/
+bool IecFakeSerial::receiveByte(CPU *cpu)
+{
+	TED *mem = TED::instance();
+	const KernalSerial &ks = mem->getKernalSerial();
+
+	update();
+	if (!(state & IEC_STATE_TALKING) || (state & IEC_STATE_ATN) || !atnInLine
+			|| !dataTransfered || dev_nr < 8 || errorState == ST_NOT_FOUND
+			|| (step != SM_WAITCLK0 && step != SM_RDY_TO_SEND)
+			|| !isKernalRoutine(mem, ks.acptr, 0xA9))
+		return false;
+
+	errorState = iecDevice->Read(secondaryAddress & 0x0F, &io_byte);
+	mem->Ram[ks.byteIn] = io_byte;
+	mem->Ram[ks.bitCount] = 0;
+	if (errorState == ST_EOI) {
+		// last byte, both sides let go of the bus
+		mem->Ram[ks.status] |= ST_EOI;
+		eoi = 1;
+		state &= ~IEC_STATE_TALKING;
+		errorState = 0;
+		clkLine = CLK_HI;
+		dataLine = DATA_HI;
+		updateBus();
+		mem->Write(ks.port, mem->Read(ks.port) & ~ks.lineMask);
+	} else {
+		timeout = cycleCount;
+		step = SM_WAITCLK0;
+		clkLine = CLK_LO;
+		dataLine = DATA_HI;
+		updateBus();
+	}
+	// LDA byte, CLI, CLC
+	cpu->setAC(io_byte);
+	cpu->setST((cpu->getST() & ~0x87) | (io_byte & 0x80) | (io_byte ? 0 : 0x02));
+	return true;
+}
+
+/*
+	ISOUR: hand the buffered byte to the device while it is listening
+	and no command is sent under ATN
+*/
+bool IecFakeSerial::sendByte(CPU *cpu)
+{
+	TED *mem = TED::instance();
+	const KernalSerial &ks = mem->getKernalSerial();
+
+	update();
+	if (!(state & IEC_STATE_LISTENING) || (state & IEC_STATE_ATN) || !atnInLine
+			|| (step != SM_WAITCLK0 && step != SM_RDY_TO_SEND)
+			|| !isKernalRoutine(mem, ks.isour, 0x20))
+		return false;
+
+	io_byte = mem->Ram[ks.byteOut];
+	eoi = (mem->Ram[ks.eoiFlag] & 0x80) ? 1 : 0;
+	writeToDevice();
+	eoi = 0;
+	// the listener holds DATA until the talker releases CLK again
+	dataLine = DATA_LO;
+	clkLine = CLK_HI;
+	step = SM_RDY_TO_SEND;
+	updateBus();
+	// the byte was shifted out through the carry
+	mem->Ram[ks.byteOut] = 0xFF;
+	mem->Ram[ks.bitCount] = 0;
+	// CLI, carry clear from the acknowledge
+	cpu->setST(cpu->getST() & ~0x05);
+	return true;
+}
+
 void IecFakeSerial::writeBus(unsigned char newLines)
 {
 	oldAtnLine = atnInLine;
@@ -75,12 +75,13 @@ public:
 
 class IEC;
 class CIECDevice;
+class CPU;
 
 class IecFakeSerial : public CSerial
 {
 public:
 	IecFakeSerial(unsigned int DevNr, CIECDevice *iecDev);
-	virtual ~IecFakeSerial() {};
+	virtual ~IecFakeSerial();
 	virtual void UpdateSerialState() {
 		update();
 	};
@@ -102,6 +103,7 @@ public:
 			& serialPort[8] & serialPort[9] & serialPort[10] & serialPort[11];
 	}
 	void writeBus(unsigned char newLines);
+	void setIecDevice(CIECDevice *iecDev) { iecDevice = iecDev; };
 	inline void updateBus() {
 		serialPort[dev_nr] = dataLine | clkLine;
 	}
@@ -110,6 +112,13 @@ private:
 	IecFakeSerial();
 protected:
 	void interpretIecByte();
+	void writeToDevice();
+	// KERNAL byte transfers completed in one step
+	static bool receiveTrap(CPU *cpu, void *serial);
+	static bool sendTrap(CPU *cpu, void *serial);
+	bool receiveByte(CPU *cpu);
+	bool sendByte(CPU *cpu);
+	CPU *cpu;
 	CIECDevice *iecDevice;
 	unsigned int state;	
 	unsigned int step;		
@@ -3,6 +3,11 @@
 #include <string.h>
 #include <math.h>
 #include "sound.h"
+#include "capture.h"
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MIX_SSE2
+#endif
 
 //#define LOG_AUDIO
 #ifndef __EMSCRIPTEN__
@@ -16,25 +21,53 @@
 static SDL_AudioDeviceID dev;
 static SDL_AudioSpec obtained, *audiohwspec;
 //
-static const unsigned int bufLenInMsec[] = { 20, 50, 100, 200, 10 };
-static unsigned int bufLenIndex = 0;
+static const unsigned int BufferLengthInMsec = 20;
 static int bufferLatencyInFrags = 2;
 static int bufferMaxLeadInFrags = 5;
-static unsigned int BufferLengthInMsec;
+// dynamic rate control, keeps the ring fill around the target latency
+#define SND_RATE_MAX_ADJUST 0.005
+#define SND_RATE_GAIN 0.005
+#define SND_RATE_INTEGRAL_GAIN 0.00002	// takes up a steady clock mismatch
+static double rateAdjust = 1.0;		// correction factor of the mixing frequency
+static double rateIntegral;			// accumulated correction
+static double averageFill;			// ring fill level low-pass filtered
+static unsigned int lastUnderruns;
+static double samplePosFraction;
 //
 static unsigned int	MixingFreq;
 static unsigned int BufferLength;
 static unsigned int	sndBufferPos;
 
 static short *mixingBuffer;
+// single producer (emulation), single consumer (audio callback) sample ring
 static short *sndRingBuffer;
-static unsigned int sndWriteBufferIndex;
-static unsigned int sndPlayBufferIndex;
-static short *sndWriteBufferPtr;
-static short *sndPlayBufferPtr;
+static unsigned int sndRingSize;		// in samples, power of 2
+static SDL_atomic_t sndRingWritePos;	// free running sample counters, each one
+static SDL_atomic_t sndRingReadPos;		// is only written by its own side
+static SDL_atomic_t sndUnderruns;
+static SDL_atomic_t sndOverruns;
 static short lastSample;
 static ClockCycle		lastUpdateCycle;
-static unsigned int		lastSamplePos;
+static bool				lastUpdateKnown;	// false until the first event after init
+// timestamped register writes for the synthesis thread
+struct SoundEvent {
+	ClockCycle cycle;
+	unsigned int frq;
+	SoundRegWrite write;	// NULL for a plain flush up to 'cycle'
+	void *chip;
+	unsigned int reg;
+	unsigned char value;
+};
+#define SND_EVENT_QUEUE_SIZE 4096
+static SoundEvent sndEvents[SND_EVENT_QUEUE_SIZE];
+static SDL_atomic_t sndEventWritePos;
+static SDL_atomic_t sndEventReadPos;
+static ClockCycle lastWakeCycle;
+static SDL_mutex *soundLock;		// held by whoever renders the queued events
+static SDL_Thread *soundThread;
+static SDL_sem *soundWake;
+static SDL_atomic_t soundWakePending;
+static SDL_atomic_t soundQuit;
 
 template<> unsigned int LinkedList<SoundSource>::count = 0;
 template<> SoundSource* LinkedList<SoundSource>::root = 0;
@@ -42,140 +75,404 @@ template<> SoundSource* LinkedList<SoundSource>::last = 0;
 unsigned int SoundSource::sampleRate = SAMPLE_FREQ;
 static unsigned int soundEnabled = 1;
 static unsigned int soundPaused = 0;
+static volatile unsigned int fastForward = 0;
+static bool fragmentDropped;		// current fragment is left out while fast-forwarding
+
+// saturating add of 'src' to 'dst'
+static void mixSamples(short *dst, const short *src, unsigned int nrsamples)
+{
+	unsigned int i = 0;
+#ifdef MIX_SSE2
+	for (; i + 8 <= nrsamples; i += 8) {
+		__m128i d = _mm_loadu_si128((const __m128i *) (dst + i));
+		__m128i s = _mm_loadu_si128((const __m128i *) (src + i));
+		_mm_storeu_si128((__m128i *) (dst + i), _mm_adds_epi16(d, s));
+	}
+#endif
+	for (; i < nrsamples; i++) {
+		const int sum = dst[i] + src[i];
+		dst[i] = sum > 32767 ? 32767 : (sum < -32768 ? -32768 : sum);
+	}
+}
 
 void SoundSource::bufferFill(unsigned int nrsamples, short *buffer)
 {
-	SoundSource *cb = SoundSource::getRoot();
-	if (cb && !soundPaused) {
-		cb->calcSamples(buffer, nrsamples);
-		cb = cb->getNext();
-	} else {
+	// the mixing buffer holds one fragment
+	while (nrsamples > BufferLength) {
+		bufferFill(BufferLength, buffer);
+		buffer += BufferLength;
+		nrsamples -= BufferLength;
+	}
+	bool silent = true;
+	if (!soundPaused) {
+		SoundSource *cb = SoundSource::getRoot();
+		while (cb) {
+			if (!cb->isIdle()) {
+				if (silent) {
+					cb->calcSamples(buffer, nrsamples);
+					silent = false;
+				} else {
+					// multiple sources
+					cb->calcSamples(mixingBuffer, nrsamples);
+					mixSamples(buffer, mixingBuffer, nrsamples);
+				}
+			}
+			cb = cb->getNext();
+		}
+	}
+	if (silent)
 		memset(buffer, 0, nrsamples * 2);
-		return;
+}
+
+static inline unsigned int ringFill()
+{
+	return (unsigned int) SDL_AtomicGet(&sndRingWritePos) - (unsigned int) SDL_AtomicGet(&sndRingReadPos);
+}
+
+// mix straight into the ring, split at the wrap point
+static void ringProduce(unsigned int nrsamples)
+{
+	const unsigned int writePos = (unsigned int) SDL_AtomicGet(&sndRingWritePos);
+	const unsigned int start = writePos & (sndRingSize - 1);
+	const unsigned int first = nrsamples < sndRingSize - start ? nrsamples : sndRingSize - start;
+
+	SoundSource::bufferFill(first, sndRingBuffer + start);
+	audio_capture_samples(sndRingBuffer + start, first);
+	if (nrsamples > first) {
+		SoundSource::bufferFill(nrsamples - first, sndRingBuffer);
+		audio_capture_samples(sndRingBuffer, nrsamples - first);
 	}
-	// multiple sources
-	while (cb) {
-		int i = nrsamples - 1;
-		cb->calcSamples(mixingBuffer, nrsamples);
-		do {
-			buffer[i] += mixingBuffer[i];
-		} while(i--);
-		cb = cb->getNext();
+	SDL_AtomicSet(&sndRingWritePos, (int) (writePos + nrsamples));
+}
+
+// repeat the last sample without advancing the sound chips
+static void ringPad(unsigned int nrsamples)
+{
+	const unsigned int writePos = (unsigned int) SDL_AtomicGet(&sndRingWritePos);
+	const short sample = sndRingBuffer[(writePos - 1) & (sndRingSize - 1)];
+
+	for (unsigned int i = 0; i < nrsamples; i++)
+		sndRingBuffer[(writePos + i) & (sndRingSize - 1)] = sample;
+	SDL_AtomicSet(&sndRingWritePos, (int) (writePos + nrsamples));
+}
+
+// synthesize samples that do not go to the device, only to the capture;
+// the chips must still be clocked as programs read back their state
+static void renderDiscarded(unsigned int nrsamples)
+{
+	short buffer[1024];
+
+	while (nrsamples) {
+		const unsigned int chunk = nrsamples < 1024 ? nrsamples : 1024;
+		SoundSource::bufferFill(chunk, buffer);
+		audio_capture_samples(buffer, chunk);
+		nrsamples -= chunk;
 	}
 }
 
-static void add_new_frag()
+static void ringConsume(short *out, unsigned int nrsamples)
 {
-#ifndef AUDIO_CALLBACK
-	SDL_QueueAudio(dev, sndWriteBufferPtr, BufferLength * 2);
-#endif
-	sndWriteBufferIndex++;
-	sndWriteBufferPtr = sndRingBuffer
-		+ (BufferLength * (sndWriteBufferIndex % SND_BUF_MAX_READ_AHEAD));
+	const unsigned int readPos = (unsigned int) SDL_AtomicGet(&sndRingReadPos);
+	const unsigned int start = readPos & (sndRingSize - 1);
+	const unsigned int first = nrsamples < sndRingSize - start ? nrsamples : sndRingSize - start;
+
+	memcpy(out, sndRingBuffer + start, first * 2);
+	if (nrsamples > first)
+		memcpy(out + first, sndRingBuffer, (nrsamples - first) * 2);
+	SDL_AtomicSet(&sndRingReadPos, (int) (readPos + nrsamples));
 }
 
-static void delete_frag()
+#ifndef AUDIO_CALLBACK
+// hand over complete fragments to the SDL queue
+static void queueFragments()
 {
-	sndPlayBufferIndex++;
-	sndPlayBufferPtr = sndRingBuffer
-		+ (BufferLength * (sndPlayBufferIndex % SND_BUF_MAX_READ_AHEAD));
+	while (ringFill() >= BufferLength) {
+		const unsigned int readPos = (unsigned int) SDL_AtomicGet(&sndRingReadPos);
+		const unsigned int start = readPos & (sndRingSize - 1);
+		const unsigned int first = BufferLength < sndRingSize - start ? BufferLength : sndRingSize - start;
+
+		SDL_QueueAudio(dev, sndRingBuffer + start, first * 2);
+		if (BufferLength > first)
+			SDL_QueueAudio(dev, sndRingBuffer, (BufferLength - first) * 2);
+		SDL_AtomicSet(&sndRingReadPos, (int) (readPos + BufferLength));
+	}
 }
+#endif
 
-static int getLeadInFrags()
+static unsigned int getLeadInSamples()
 {
 #ifdef AUDIO_CALLBACK
-	return (int) (sndWriteBufferIndex - sndPlayBufferIndex);
+	return ringFill();
 #else
-	unsigned int b = SDL_GetQueuedAudioSize(dev);
-	return (int) (b / (BufferLength << 1));
+	return SDL_GetQueuedAudioSize(dev) / 2 + ringFill();
 #endif
 }
 
-static void fragmentDone()
+/*
+	Called once per fragment. Instead of dropping or padding whole fragments
+	the effective mixing frequency is nudged by a fraction of a percent so
+	that the lead settles at the target latency.
+*/
+static void updateRateControl()
 {
-	int lead_in_frags = getLeadInFrags();
-#ifdef LOG_AUDIO
-	printf("Lead in frags: %i\n", lead_in_frags);
-#endif
-
-	while (lead_in_frags < SND_LATENCY_IN_FRAGS) {
+	const double target = (double) (SND_LATENCY_IN_FRAGS * BufferLength);
+	const unsigned int underruns = (unsigned int) SDL_AtomicGet(&sndUnderruns);
+
+	if (underruns != lastUnderruns) {
+		// the device starved, prime the ring again at once
+		unsigned int lead = getLeadInSamples();
+		if (lead < (unsigned int) target)
+			ringPad((unsigned int) target - lead);
+		lastUnderruns = underruns;
+		averageFill = target;
+	}
+	averageFill += ((double) getLeadInSamples() - averageFill) / 8.0;
+	if (fastForward) {
+		// the emulation outruns the device, keep whole fragments only while
+		// there is room for them so that the pitch stays the same
+		fragmentDropped = getLeadInSamples() >= (unsigned int) target;
+		rateAdjust = 1.0;
+		return;
+	}
+	fragmentDropped = false;
+	if (audio_capture_active()) {
+		// captures must have an exact sample count per emulated frame
+		rateAdjust = 1.0;
+		return;
+	}
+	double error = (averageFill - target) / target;
+	rateIntegral += error * SND_RATE_INTEGRAL_GAIN;
+	if (rateIntegral > SND_RATE_MAX_ADJUST)
+		rateIntegral = SND_RATE_MAX_ADJUST;
+	else if (rateIntegral < -SND_RATE_MAX_ADJUST)
+		rateIntegral = -SND_RATE_MAX_ADJUST;
+	double adjust = -error * SND_RATE_GAIN - rateIntegral;
+	if (adjust > SND_RATE_MAX_ADJUST)
+		adjust = SND_RATE_MAX_ADJUST;
+	else if (adjust < -SND_RATE_MAX_ADJUST)
+		adjust = -SND_RATE_MAX_ADJUST;
+	rateAdjust = 1.0 + adjust;
 #ifdef LOG_AUDIO
-		fprintf(stderr, "   adding an extra frag.\n");
+	fprintf(stderr, "Lead: %.0f samples, rate: %f\n", averageFill, rateAdjust);
 #endif
-		SoundSource::bufferFill(BufferLength, sndWriteBufferPtr);
-		add_new_frag();
-		lead_in_frags++;
-	}
 }
 
+// serves any request size, wrapped or not
 static void audioCallback(void *userdata, Uint8 *stream, int len)
 {
-	if (sndPlayBufferIndex < sndWriteBufferIndex) {
-		if (len > (int)(BufferLength*2))
-			len = BufferLength * 2;
-   		memcpy(stream, sndPlayBufferPtr, len);
-		lastSample = sndPlayBufferPtr[len/2 - 1];
-   		delete_frag();
-	} else {
-		short *buf = (short *) stream;
-		len /= 2;
-		do {
-			*buf++ = lastSample;
-		} while(--len);
+	short *buf = (short *) stream;
+	const unsigned int nrsamples = len / 2;
+	const unsigned int available = ringFill();
+	const unsigned int n = available < nrsamples ? available : nrsamples;
+
+	if (n) {
+		ringConsume(buf, n);
+		lastSample = buf[n - 1];
+	}
+	if (n < nrsamples) {
+		// underrun: hold the last sample to avoid a click
+		SDL_AtomicAdd(&sndUnderruns, 1);
+		for(unsigned int i = n; i < nrsamples; i++)
+			buf[i] = lastSample;
 	}
 #ifdef LOG_AUDIO
-	fprintf(stderr, "Playing a frag (%i).\n", getLeadInFrags());
+	fprintf(stderr, "Playing %u samples (%u left).\n", n, ringFill());
 #endif
 }
 
 void updateAudio(unsigned int nrsamples)
 {
+	if (!nrsamples)
+		return;
 	// SDL openaudio failed?
-	if (!sndWriteBufferPtr)
+	if (!sndRingBuffer) {
+		if (mixingBuffer)
+			renderDiscarded(nrsamples);
 		return;
-
-	if (sndBufferPos + nrsamples >= BufferLength) {
-		if (getLeadInFrags() > SND_LATENCY_IN_FRAGS) {
-#ifdef LOG_AUDIO
-			fprintf(stderr, "Skipping a frag.\n");
-#endif
-		} else {
-			// Finish pending buffer...
-			SoundSource::bufferFill(BufferLength - sndBufferPos, sndWriteBufferPtr + sndBufferPos);
-			add_new_frag();
-			if ((sndBufferPos = (sndBufferPos + nrsamples) % BufferLength))
-				SoundSource::bufferFill(sndBufferPos, sndWriteBufferPtr);
-			fragmentDone();
-		}
-	} else if (nrsamples) {
-		SoundSource::bufferFill(nrsamples, sndWriteBufferPtr + sndBufferPos);
-		sndBufferPos += nrsamples;
 	}
-	//_ASSERT(sndBufferPos <= BufferLength);
+	if (fragmentDropped) {
+		renderDiscarded(nrsamples);
+	} else if (ringFill() + nrsamples > sndRingSize) {
+		// no room left in the ring
+		SDL_AtomicAdd(&sndOverruns, 1);
+		renderDiscarded(nrsamples);
+		return;
+	} else {
+		ringProduce(nrsamples);
+	}
+	sndBufferPos += nrsamples;
+	if (sndBufferPos >= BufferLength) {
+		sndBufferPos %= BufferLength;
+		updateRateControl();
+	}
+#ifndef AUDIO_CALLBACK
+	queueFragments();
+#endif
 }
 
-static inline unsigned int getNrOfSamplesToGenerate(ClockCycle clock, unsigned int deviceFrq)
+bool sound_capture_start(const char *name)
 {
-	// OK this should really be INT but I'm tired right now
-	const unsigned int samplePos = (unsigned int) ((double) clock * (double) MixingFreq / deviceFrq);
-	unsigned int samplesToDo = samplePos - lastSamplePos;
-	//fprintf( stderr, "Sound: %i cycles/%f samples\n", clock, (double) clock * (double) MixingFreq / deviceFrq);
-	// 'clock' might have been reset but 'lastSamplePos' not!
-	if (lastSamplePos > samplePos)
-		samplesToDo = 0;
-	return samplesToDo;
+	sound_sync();
+	return audio_capture_start(name, MixingFreq);
 }
 
-void flushBuffer(ClockCycle cycle, unsigned int frq)
+// audio keeps running while fast-forwarding, with fragments left out
+void sound_set_fast_forward(bool enabled)
+{
+	fastForward = enabled;
+}
+
+void sound_get_stats(unsigned int &underruns, unsigned int &overruns)
+{
+	underruns = (unsigned int) SDL_AtomicGet(&sndUnderruns);
+	overruns = (unsigned int) SDL_AtomicGet(&sndOverruns);
+}
+
+static inline unsigned int getNrOfSamplesToGenerate(ClockCycle clock, unsigned int deviceFrq, double &samplePos)
 {
-	unsigned int samplesToDo = getNrOfSamplesToGenerate(cycle, frq);
+	// 'clock' might have been reset, or the audio reopened while running
+	if (!lastUpdateKnown || clock < lastUpdateCycle) {
+		lastUpdateKnown = true;
+		lastUpdateCycle = clock;
+		return 0;
+	}
+	// incremental so that a change of the rate does not make the position jump
+	samplePos = samplePosFraction
+		+ (double) (clock - lastUpdateCycle) * (double) MixingFreq * rateAdjust / deviceFrq;
+	return (unsigned int) samplePos;
+}
+
+static void renderUpTo(ClockCycle cycle, unsigned int frq)
+{
+	double samplePos;
+	unsigned int samplesToDo = getNrOfSamplesToGenerate(cycle, frq, samplePos);
 	if (samplesToDo) {
+		samplePosFraction = samplePos - samplesToDo;
+		// a long stall is not made up for, at most a ring worth is synthesized
+		const unsigned int maxSamples = sndRingSize ? sndRingSize : BufferLength;
+		if (samplesToDo > maxSamples) {
+			samplesToDo = maxSamples;
+			samplePosFraction = 0;
+		}
 		updateAudio(samplesToDo);
 		lastUpdateCycle = cycle;
-		lastSamplePos += samplesToDo;
 	}
 }
 
+// soundLock must be held
+static void processEvents()
+{
+	unsigned int readPos = (unsigned int) SDL_AtomicGet(&sndEventReadPos);
+	const unsigned int writePos = (unsigned int) SDL_AtomicGet(&sndEventWritePos);
+
+	while (readPos != writePos) {
+		SoundEvent &e = sndEvents[readPos & (SND_EVENT_QUEUE_SIZE - 1)];
+		renderUpTo(e.cycle, e.frq);
+		if (e.write)
+			e.write(e.chip, e.reg, e.value);
+		SDL_AtomicSet(&sndEventReadPos, (int) ++readPos);
+	}
+}
+
+/*
+	Renders everything queued so far on the calling thread. Must be called
+	before the emulation touches the state of a sound chip directly.
+*/
+void sound_sync()
+{
+	SDL_LockMutex(soundLock);
+	processEvents();
+	SDL_UnlockMutex(soundLock);
+}
+
+static void pushEvent(ClockCycle cycle, unsigned int frq, SoundRegWrite write, void *chip,
+	unsigned int reg, unsigned char value)
+{
+	const unsigned int writePos = (unsigned int) SDL_AtomicGet(&sndEventWritePos);
+
+	if (writePos - (unsigned int) SDL_AtomicGet(&sndEventReadPos) >= SND_EVENT_QUEUE_SIZE) {
+		// queue full, catch up here
+		sound_sync();
+	}
+	SoundEvent &e = sndEvents[writePos & (SND_EVENT_QUEUE_SIZE - 1)];
+	e.cycle = cycle;
+	e.frq = frq;
+	e.write = write;
+	e.chip = chip;
+	e.reg = reg;
+	e.value = value;
+	SDL_AtomicSet(&sndEventWritePos, (int) (writePos + 1));
+}
+
+static void wakeSoundThread()
+{
+	if (SDL_AtomicCAS(&soundWakePending, 0, 1))
+		SDL_SemPost(soundWake);
+}
+
+void flushBuffer(ClockCycle cycle, unsigned int frq)
+{
+	pushEvent(cycle, frq, NULL, NULL, 0, 0);
+	if (!soundThread) {
+		sound_sync();
+	} else if (cycle - lastWakeCycle >= frq / 1000 || cycle < lastWakeCycle) {
+		// batch about a millisecond of work per wakeup
+		lastWakeCycle = cycle;
+		wakeSoundThread();
+	}
+}
+
+void sound_write_reg(ClockCycle cycle, unsigned int frq, SoundRegWrite write, void *chip,
+	unsigned int reg, unsigned char value)
+{
+	pushEvent(cycle, frq, write, chip, reg, value);
+	if (!soundThread)
+		sound_sync();
+}
+
+static int soundThreadFunc(void *)
+{
+	for (;;) {
+		SDL_SemWait(soundWake);
+		SDL_AtomicSet(&soundWakePending, 0);
+		if (SDL_AtomicGet(&soundQuit))
+			break;
+		sound_sync();
+	}
+	return 0;
+}
+
+static void startSoundThread()
+{
+#ifndef __EMSCRIPTEN__
+	soundWake = SDL_CreateSemaphore(0);
+	if (!soundWake)
+		return;
+	SDL_AtomicSet(&soundQuit, 0);
+	SDL_AtomicSet(&soundWakePending, 0);
+	lastWakeCycle = 0;
+	soundThread = SDL_CreateThread(soundThreadFunc, "SoundThread", NULL);
+	if (!soundThread) {
+		fprintf(stderr, "Could not create the sound thread, rendering inline.\n");
+		SDL_DestroySemaphore(soundWake);
+		soundWake = NULL;
+	}
+#endif
+}
+
+static void stopSoundThread()
+{
+	if (soundThread) {
+		SDL_AtomicSet(&soundQuit, 1);
+		SDL_SemPost(soundWake);
+		SDL_WaitThread(soundThread, NULL);
+		SDL_DestroySemaphore(soundWake);
+		soundThread = NULL;
+		soundWake = NULL;
+	}
+	sound_sync();
+}
+
 static unsigned int calibrateAudioBufferSize(unsigned int msec, unsigned int sampleRate)
 {
 #ifdef __EMSCRIPTEN__
@@ -195,7 +492,7 @@ static unsigned int calibrateAudioBufferSize(unsigned int msec, unsigned int sam
 // Emscripten requires audio buffers to be cleaned when stopped
 void sound_reset()
 {
-	for (unsigned int i = 0; i < SND_BUF_MAX_READ_AHEAD * BufferLength; i++)
+	for (unsigned int i = 0; i < sndRingSize; i++)
 		sndRingBuffer[i] = audiohwspec->silence;
 }
 
@@ -203,10 +500,12 @@ void init_audio(unsigned int sampleFrq)
 {
     SDL_AudioSpec desired;
 
+	if (!soundLock)
+		soundLock = SDL_CreateMutex();
+
 	if (sampleFrq < 11025 || sampleFrq > 192000) sampleFrq = SAMPLE_FREQ;
 	MixingFreq = sampleFrq;
 
-	BufferLengthInMsec = bufLenInMsec[bufLenIndex];
 	BufferLength = calibrateAudioBufferSize(BufferLengthInMsec, MixingFreq);
 	if (BufferLength < 512) BufferLength = 512;
 
@@ -246,18 +545,28 @@ void init_audio(unsigned int sampleFrq)
 	fprintf(stderr, "Obtained sample buffer size: %u\n", audiohwspec->samples);
 	fprintf(stderr, "Obtained silence value: %u\n", audiohwspec->silence);
 
-	sndRingBuffer = new short[SND_BUF_MAX_READ_AHEAD * BufferLength];
-	for(unsigned int i = 0; i < SND_BUF_MAX_READ_AHEAD * BufferLength; i++)
+	sndRingSize = 1;
+	while (sndRingSize < SND_BUF_MAX_READ_AHEAD * BufferLength)
+		sndRingSize <<= 1;
+	sndRingBuffer = new short[sndRingSize];
+	for(unsigned int i = 0; i < sndRingSize; i++)
 		sndRingBuffer[i] = audiohwspec->silence;
-	sndWriteBufferIndex = SND_LATENCY_IN_FRAGS;
-	sndPlayBufferIndex = 0;
-	sndWriteBufferPtr = sndRingBuffer + BufferLength * SND_LATENCY_IN_FRAGS;
-	sndPlayBufferPtr = sndRingBuffer;
+	// start with the latency worth of silence
+	SDL_AtomicSet(&sndRingReadPos, 0);
+	SDL_AtomicSet(&sndRingWritePos, BufferLength * SND_LATENCY_IN_FRAGS);
+	SDL_AtomicSet(&sndUnderruns, 0);
+	SDL_AtomicSet(&sndOverruns, 0);
+	lastUnderruns = 0;
+	rateAdjust = 1.0;
+	rateIntegral = 0.0;
+	averageFill = (double) (BufferLength * SND_LATENCY_IN_FRAGS);
+	samplePosFraction = 0;
 
 	sndBufferPos = 0;
 	lastSample = 0;
 	lastUpdateCycle = 0;
-	lastSamplePos = 0;
+	lastUpdateKnown = false;
+	startSoundThread();
     sound_resume();
 }
 
@@ -291,22 +600,18 @@ void sound_change_freq(unsigned int &newFreq)
 
 void close_audio()
 {
+	stopSoundThread();
+	audio_capture_stop();
 	SDL_PauseAudioDevice(dev, 1);
 	SDL_CloseAudioDevice(dev);
 	delete[] sndRingBuffer;
 	delete[] mixingBuffer;
+	sndRingBuffer = NULL;
+	mixingBuffer = NULL;
 }
 
 //-- sound options management
 
-static void flipAudioBufferSize(void *none)
-{
-	const unsigned int arraySize = sizeof(bufLenInMsec) / sizeof(bufLenInMsec[0]);
-	close_audio();
-	bufLenIndex = (bufLenIndex + 1) % arraySize;
-	init_audio(MixingFreq);
-}
-
 static void flipAudioFrequency(void *none)
 {
 	const unsigned int frq[] = { 48000, 96000, 192000, 22050, 44100 };
@@ -328,7 +633,6 @@ rvar_t soundSettings[] = {
 	{ "Sound enabled", "SoundOn", NULL, &soundEnabled, RVAR_TOGGLE, NULL },
 #ifndef __EMSCRIPTEN__
 	{ "Audio frequency", "SoundFrequency", flipAudioFrequency, &MixingFreq, RVAR_INT, NULL },
-	{ "Audio buffer length in msec", "AudioBufferLength", flipAudioBufferSize, &BufferLengthInMsec, RVAR_INT, NULL },
 #endif
 	{ "", "", NULL, NULL, RVAR_NULL, NULL }
 };
@@ -11,12 +11,16 @@
 
 //#define AUDIO_CALLBACK
 
+extern void sound_sync();
+
 // derive from this class for sound sources
 class SoundSource : public LinkedList<SoundSource> {
 public:
     SoundSource() {
+        sound_sync();
         add(this);
     }
+    // derived classes must call sound_sync() first thing in their destructor
     ~SoundSource() {
         remove(this);
     }
@@ -25,6 +29,9 @@ public:
 		sampleRate = sampleRate_;
 	}
     virtual void calcSamples(short *buffer, unsigned int nrsamples) = 0;
+	// true while the output is silent and stays so until the next register
+	// write, the mixer then skips the source entirely
+	virtual bool isIdle() { return false; }
 	virtual void setFrequency(unsigned int frequency) = 0;
 	virtual void setSampleRate(unsigned int sampleRate) = 0;
 private:
@@ -39,7 +46,15 @@ extern void sound_pause();
 extern void sound_resume();
 extern void sound_reset();
 extern void sound_change_freq(unsigned int &newFreq);
+// callback applying a register write on the synthesis thread
+typedef void (*SoundRegWrite)(void *chip, unsigned int reg, unsigned char value);
+
 extern void flushBuffer(ClockCycle cycle, unsigned int frq);
+extern void sound_write_reg(ClockCycle cycle, unsigned int frq, SoundRegWrite write, void *chip,
+	unsigned int reg, unsigned char value);
+extern bool sound_capture_start(const char *name);
+extern void sound_set_fast_forward(bool enabled);
+extern void sound_get_stats(unsigned int &underruns, unsigned int &overruns);
 extern rvar_t soundSettings[];
 
 #endif
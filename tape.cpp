@@ -48,71 +48,100 @@ const char tapeFormatStr[][32] = {
 	"MTAP1", "MTAP2", "PCM WAV 8-bit", "PCM WAV 16-bit", "Unknown"
 };
 
-TAP::TAP() : tapeFileSize(0), tapeBuffer(NULL), lastCycle(0), edge(0), buttonPressed(0), tapeSoFar(0)
+// a pilot tone is at least this many half-waves of about the same length
+#define PILOT_MIN_HALFWAVES 2000
+
+TAP::TAP() : tapeFileSize(0), tapeBuffer(NULL), lastCycle(0), edge(0), buttonPressed(0),
+	pulses(NULL), pulseCount(0), pulseLeft(0), startEdge(0), streamClock(0),
+	blockStart(NULL), blockCount(0), decodeThread(NULL), tapeSoFar(0)
 {
 	buttonPressed = motorOn = false;
 }
 
+TAP::~TAP()
+{
+	detachTape();
+}
+
 bool TAP::attachTape(const char *fname)
 {
 	FILE *tapfile;
 
-	tapeFormat = TAPE_FORMAT_NONE;
 	if ((tapfile = fopen(fname,"rb"))) {
-		strcpy(tapefilename, fname);
 		// load TAP file into buffer
 		fseek(tapfile, 0L, SEEK_END);
-		tapeFileSize = ftell(tapfile);
+		unsigned int size = ftell(tapfile);
 		fseek(tapfile, 0L, SEEK_SET);
 		// allocate and load file
-		tapeBuffer = new unsigned char[tapeFileSize];
-		if (fread(tapeBuffer, 1, tapeFileSize, tapfile) < 4)
-			return false;
-		tapeHeaderRead = tapeBuffer;
-
-		// determine the type of tape file attached
-		// MTAP?
-		if (!strncmp((const char *) tapeBuffer + 3,"-TAPE-RAW", 9)) {
-			tapeImageHeaderSize = tapeSoFar = sizeof(mtap_header_default); // offset to beginning of wave data
-			tapeFormat = (tapeHeaderRead[MTAP_VERSION] == 2) ? TAPE_FORMAT_MTAP2 : TAPE_FORMAT_MTAP1;
-			// some sanity checks for crappy TAPs
-			if (tapeHeaderRead[MTAP_PLATFORM] > 2)
-				tapeHeaderRead[MTAP_PLATFORM] = 0;
-			if (tapeHeaderRead[MTAP_VIDEOFORMAT] > 1)
-				tapeHeaderRead[MTAP_VIDEOFORMAT] = 0;
-			// set the MTAP frequency based on header
-			unsigned int index = tapeHeaderRead[MTAP_PLATFORM] * 2 + tapeHeaderRead[MTAP_VIDEOFORMAT];
-			tapeImageSampleRate = tapFrqs[index];
-			// trigger reading first pulse by starting high and no initial delay
-			edge = 0x10;
-			tapeDelay = 0;
-		// PCM WAV?
-		} else if (!memcmp(tapeBuffer, "RIFF", 4) && !memcmp(tapeBuffer + 8, "WAVEfmt ", 8)) {
-			tapeImageHeaderSize = tapeSoFar = sizeof(wav_header_t);
-			wav_header_t *wavh = (wav_header_t *)tapeHeaderRead;
-			tapeImageSampleRate = wavh->nSamplesPerSec;
-			// mono?
-			if (wavh->nChannels != 1)
-				return false;
-			tapeFormat = wavh->nBitsPerSample == 8 ? TAPE_FORMAT_PCM8 : TAPE_FORMAT_PCM16;
-		// if no match, assume it is a 44.1 kHz sample
-		} else {
-			tapeImageHeaderSize = tapeSoFar = 0;
-			tapeImageSampleRate = 44100;
-			tapeFormat = TAPE_FORMAT_PCM8;
-		}
-		motorOn = buttonPressed = false;
+		unsigned char *buffer = new unsigned char[size];
+		size = (unsigned int) fread(buffer, 1, size, tapfile);
 		// close the file, it's in the memory now...
 		fclose(tapfile);
-		fprintf(stderr, "Tape attached    : %s\n", tapefilename);
-		fprintf(stderr, "Tape format      : %s\n", tapeFormatStr[(unsigned int)tapeFormat]);
-		fprintf(stderr, "Tape data size   : %3.1f kBytes\n", double(tapeFileSize) / 1024.0);
-		fprintf(stderr, "Tape sample rate : %u Hz\n", tapeImageSampleRate);
-		return true;
+		return attachBuffer(buffer, size, fname);
 	}
+	tapeFormat = TAPE_FORMAT_NONE;
 	return false;
 }
 
+bool TAP::attachTape(const unsigned char *data, unsigned int size, const char *name)
+{
+	unsigned char *buffer = new unsigned char[size];
+	memcpy(buffer, data, size);
+	return attachBuffer(buffer, size, name);
+}
+
+/*
+	Takes over the image buffer
+*/
+bool TAP::attachBuffer(unsigned char *buffer, unsigned int size, const char *name)
+{
+	detachTape();
+	tapeFormat = TAPE_FORMAT_NONE;
+	strncpy(tapefilename, name, sizeof(tapefilename) - 1);
+	tapefilename[sizeof(tapefilename) - 1] = 0;
+	tapeFileSize = size;
+	tapeBuffer = buffer;
+	if (tapeFileSize < 4)
+		return false;
+	tapeHeaderRead = tapeBuffer;
+
+	// determine the type of tape file attached
+	// MTAP?
+	if (!strncmp((const char *) tapeBuffer + 3,"-TAPE-RAW", 9)) {
+		tapeImageHeaderSize = sizeof(mtap_header_default); // offset to beginning of wave data
+		tapeFormat = (tapeHeaderRead[MTAP_VERSION] == 2) ? TAPE_FORMAT_MTAP2 : TAPE_FORMAT_MTAP1;
+		// some sanity checks for crappy TAPs
+		if (tapeHeaderRead[MTAP_PLATFORM] > 2)
+			tapeHeaderRead[MTAP_PLATFORM] = 0;
+		if (tapeHeaderRead[MTAP_VIDEOFORMAT] > 1)
+			tapeHeaderRead[MTAP_VIDEOFORMAT] = 0;
+		// set the MTAP frequency based on header
+		unsigned int index = tapeHeaderRead[MTAP_PLATFORM] * 2 + tapeHeaderRead[MTAP_VIDEOFORMAT];
+		tapeImageSampleRate = tapFrqs[index];
+	// PCM WAV?
+	} else if (!memcmp(tapeBuffer, "RIFF", 4) && !memcmp(tapeBuffer + 8, "WAVEfmt ", 8)) {
+		tapeImageHeaderSize = sizeof(wav_header_t);
+		wav_header_t *wavh = (wav_header_t *)tapeHeaderRead;
+		tapeImageSampleRate = wavh->nSamplesPerSec;
+		// mono?
+		if (wavh->nChannels != 1 || !tapeImageSampleRate)
+			return false;
+		tapeFormat = wavh->nBitsPerSample == 8 ? TAPE_FORMAT_PCM8 : TAPE_FORMAT_PCM16;
+	// if no match, assume it is a 44.1 kHz sample
+	} else {
+		tapeImageHeaderSize = 0;
+		tapeImageSampleRate = 44100;
+		tapeFormat = TAPE_FORMAT_PCM8;
+	}
+	motorOn = buttonPressed = false;
+	startDecoding();
+	fprintf(stderr, "Tape attached    : %s\n", tapefilename);
+	fprintf(stderr, "Tape format      : %s\n", tapeFormatStr[(unsigned int)tapeFormat]);
+	fprintf(stderr, "Tape data size   : %3.1f kBytes\n", double(tapeFileSize) / 1024.0);
+	fprintf(stderr, "Tape sample rate : %u Hz\n", tapeImageSampleRate);
+	return true;
+}
+
 bool TAP::createTape(const char *fname)
 {
 	FILE *tapfile;
@@ -141,23 +170,20 @@ bool TAP::detachTape()
 	//  fclose(tapfile);
 	//  tapfile = NULL;
 	//}
+	releaseStream();
 	if (tapeBuffer != NULL) { // just to be sure....
 		delete [] tapeBuffer;
 		tapeBuffer = NULL;
 	}
+	tapeFormat = TAPE_FORMAT_NONE;
 	tapeSoFar = 0;
 	return false;
 }
 
 void TAP::rewind()
 {
-	tapeSoFar = tapeImageHeaderSize;
-	if (tapeFormat <= TAPE_FORMAT_MTAP2) {
-		// start high since XOR is triggered
-		edge = 0x10;
-		tapeDelay = 0;
-	} else
-		edge = 0x00;
+	syncStream();
+	setPosition(0);
 }
 
 void TAP::changewave(bool wholewave)
@@ -165,116 +191,283 @@ void TAP::changewave(bool wholewave)
 	mtap_header_default[MTAP_VERSION] = wholewave ? 1 : 2;
 }
 
-inline void TAP::readMtapData(unsigned int elapsed)
+/*
+	The image is turned into half-wave lengths once, so playing the tape
+	is just counting down the current one
+*/
+void TAP::startDecoding()
+{
+	streamClock = mem->getRealSlowClock();
+	tapeSoFar = 0;
+#ifndef __EMSCRIPTEN__
+	decodeThread = SDL_CreateThread(decoderThread, "Tape decoder", this);
+	if (decodeThread)
+		return;
+#endif
+	decodeStream();
+	setPosition(0);
+}
+
+int TAP::decoderThread(void *tap)
 {
-	while (elapsed--) {
-		if (!tapeDelay--) {
-			//fprintf( stderr, "TAP unit timeout in cycle: %u\n", elapsed);
-			if (edge == 0x10) {
-				convTAPUnitsToCycles();
-				fallingEdge = true;
-			} else {
-				tapeDelay = origTapeDelay;
-			}
-			edge ^= 0x10;
-		}
+	((TAP *) tap)->decodeStream();
+	return 0;
+}
+
+/*
+	Waits for the decoder and decodes again if the machine clock has changed since
+*/
+void TAP::syncStream()
+{
+	if (decodeThread) {
+		SDL_WaitThread(decodeThread, NULL);
+		decodeThread = NULL;
+		setPosition(tapeSoFar);
+	}
+	if (tapeBuffer && mem && streamClock != mem->getRealSlowClock()) {
+		const unsigned int position = tapeSoFar;
+		releaseStream();
+		streamClock = mem->getRealSlowClock();
+		decodeStream();
+		setPosition(position);
 	}
 }
 
-inline void TAP::readWavData(unsigned int elapsed)
+void TAP::releaseStream()
 {
-	const unsigned int fastClockFreq = mem->getRealSlowClock() << 1;
-	static int prevSample = 0;
-
-	while (elapsed--) {
-		if (tapeSoFar >= tapeFileSize)
-			return;
-		if ((tapeDelay += tapeImageSampleRate) >= fastClockFreq) {
-			int sample = tapeBuffer[tapeSoFar++];
-
-			if (tapeFormat == TAPE_FORMAT_PCM16) {
-				sample += tapeBuffer[tapeSoFar++] << 8;
-				int change = short(sample) - prevSample;
-				if (sample > 0 && change > 0) {
-					edge = 0x10;
-				} else if (sample <= 0 && change < 0) {
-					edge = 0x00;
-					fallingEdge = true;
-				}
-			} else {
-				int change = sample - prevSample;
-				if (sample > 0x80 && change > 0) {
-					edge = 0x10;
-				} else if (sample <= 0x7F && change < 0) {
-					edge = 0x00;
-					fallingEdge = true;
-				}
-			}
-			prevSample = sample;
-			tapeDelay -= fastClockFreq;
-		}
+	if (decodeThread) {
+		SDL_WaitThread(decodeThread, NULL);
+		decodeThread = NULL;
 	}
+	delete [] pulses;
+	pulses = NULL;
+	delete [] blockStart;
+	blockStart = NULL;
+	pulseCount = pulseLeft = blockCount = 0;
 }
 
-unsigned char TAP::readCSTIn(ClockCycle cycle)
+void TAP::decodeStream()
 {
-	int elapsed = int(cycle - lastCycle);
+	const unsigned int dataSize = tapeFileSize > tapeImageHeaderSize ? tapeFileSize - tapeImageHeaderSize : 0;
 
-	if (motorOn && tapeBuffer) {
-		switch (tapeFormat) {
-			case TAPE_FORMAT_MTAP1:
-			case TAPE_FORMAT_MTAP2:
-				readMtapData(elapsed);
-				break;
-			case TAPE_FORMAT_PCM8:
-				readWavData(elapsed);
-				break;
-			case TAPE_FORMAT_NONE:
-			default:
-				break;
-		}
-		lastCycle = cycle;
+	pulseCount = 0;
+	switch (tapeFormat) {
+		case TAPE_FORMAT_MTAP1:
+		case TAPE_FORMAT_MTAP2:
+			// two half-waves per data byte at most, plus the start
+			pulses = new unsigned int[dataSize * 2 + 1];
+			decodeMtap();
+			break;
+		case TAPE_FORMAT_PCM8:
+		case TAPE_FORMAT_PCM16:
+			// an edge spans many samples, so count them before sizing the array
+			decodeWav();
+			pulses = new unsigned int[pulseCount];
+			pulseCount = 0;
+			decodeWav();
+			break;
+		default:
+			break;
 	}
-	return edge;
+	indexBlocks();
 }
 
-inline unsigned int TAP::readNextTapDelay()
+inline unsigned int TAP::readNextTapDelay(unsigned int &offset, double frqMult)
 {
-	unsigned int delay = tapeBuffer[tapeSoFar++];
+	unsigned int delay = tapeBuffer[offset++];
 
 	/* byte $00 is a pilot byte */
 	if (!delay) {
-		delay = tapeBuffer[tapeSoFar++];
-		delay += tapeBuffer[tapeSoFar++] << 8;
-		delay += tapeBuffer[tapeSoFar++] << 16;
-		/*fprintf( stderr, "Pilot byte %i.\n", delay);
-		fprintf( stderr, "Pilot offset: %i.\n", TapeSoFar);*/
+		if (offset + 3 > tapeFileSize) {
+			offset = tapeFileSize;
+			return 0;
+		}
+		delay = tapeBuffer[offset++];
+		delay += tapeBuffer[offset++] << 8;
+		delay += tapeBuffer[offset++] << 16;
 	} else {
 		delay <<= 3;
 	}
-	unsigned int tapClockFreq = mem->getRealSlowClock() >> 4;
 	// machine clock frequency different from MTAP one? then adjust...
-	if (tapeImageSampleRate != tapClockFreq) {
-		const double frqMult = double(tapClockFreq) / double(tapeImageSampleRate);
+	if (frqMult != 1.0)
 		delay = (unsigned int)(double(delay) * frqMult + 0.5);
+	return delay << 1;
+}
+
+/*
+	The first edge falls right away, then a low and a high half-wave follow
+	for each whole wave of MTAP1 or each pair of MTAP2 half-waves
+*/
+void TAP::decodeMtap()
+{
+	const unsigned int tapClockFreq = streamClock >> 4;
+	const double frqMult = double(tapClockFreq) / double(tapeImageSampleRate);
+	unsigned int offset = tapeImageHeaderSize;
+
+	startEdge = 0x10;
+	pulses[pulseCount++] = 1;
+	while (offset < tapeFileSize) {
+		unsigned int low, high;
+		if (tapeFormat == TAPE_FORMAT_MTAP1) {
+			const unsigned int wave = readNextTapDelay(offset, frqMult);
+			low = wave >> 1;
+			high = wave - low;
+		} else {
+			low = readNextTapDelay(offset, frqMult);
+			if (offset >= tapeFileSize)
+				break;
+			high = readNextTapDelay(offset, frqMult);
+		}
+		pulses[pulseCount++] = low + 1;
+		pulses[pulseCount++] = high + 1;
+	}
+}
+
+/*
+	Edges are where the signal crosses the middle heading the same way,
+	each sample lasts machine clock / sample rate cycles. Without a
+	pulse array the edges are only counted.
+*/
+void TAP::decodeWav()
+{
+	const unsigned long long fastClockFreq = (unsigned long long) streamClock << 1;
+	const bool pcm16 = tapeFormat == TAPE_FORMAT_PCM16;
+	const unsigned char *data = tapeBuffer + tapeImageHeaderSize;
+	const unsigned int samples = tapeFileSize > tapeImageHeaderSize ?
+		(tapeFileSize - tapeImageHeaderSize) >> (pcm16 ? 1 : 0) : 0;
+	unsigned long long lastEdge = 0;
+	unsigned char level = 0;
+	int prevSample = 0;
+
+	startEdge = 0;
+	for (unsigned int i = 0; i < samples; i++) {
+		int sample;
+		unsigned char newLevel = level;
+
+		if (pcm16) {
+			sample = short(data[i * 2] | (data[i * 2 + 1] << 8));
+			int change = sample - prevSample;
+			if (sample > 0 && change > 0)
+				newLevel = 0x10;
+			else if (sample <= 0 && change < 0)
+				newLevel = 0;
+		} else {
+			sample = data[i];
+			int change = sample - prevSample;
+			if (sample > 0x80 && change > 0)
+				newLevel = 0x10;
+			else if (sample <= 0x7F && change < 0)
+				newLevel = 0;
+		}
+		prevSample = sample;
+		if (newLevel != level) {
+			// the cycle in which this sample gets played
+			unsigned long long cycle = ((i + 1) * fastClockFreq + tapeImageSampleRate - 1) / tapeImageSampleRate;
+			if (pulses)
+				pulses[pulseCount] = cycle > lastEdge ? (unsigned int)(cycle - lastEdge) : 1;
+			pulseCount++;
+			lastEdge = cycle;
+			level = newLevel;
+		}
 	}
-	if (tapeSoFar >= tapeFileSize) {
-		motorOn = buttonPressed = false;
+	// play the tail of the recording too
+	unsigned long long end = (samples * fastClockFreq + tapeImageSampleRate - 1) / tapeImageSampleRate;
+	if (pulses)
+		pulses[pulseCount] = end > lastEdge ? (unsigned int)(end - lastEdge) : 1;
+	pulseCount++;
+}
+
+/*
+	Every block of data is led in by a pilot tone of many equal waves,
+	whole waves are compared since the duty cycle of a WAV may be uneven
+*/
+void TAP::indexBlocks()
+{
+	unsigned int runStart = 0, runLength = 0, reference = 0;
+
+	blockCount = 0;
+	blockStart = new unsigned int[pulseCount / PILOT_MIN_HALFWAVES + 1];
+	for (unsigned int i = 0; i + 1 < pulseCount; i++) {
+		const unsigned int length = pulses[i] + pulses[i + 1];
+		const unsigned int tolerance = reference >> 3;
+
+		if (runLength && length + tolerance >= reference && length <= reference + tolerance) {
+			if (++runLength == PILOT_MIN_HALFWAVES)
+				blockStart[blockCount++] = runStart;
+		} else {
+			runStart = i;
+			runLength = 1;
+			reference = length;
+		}
 	}
-	return delay << 1;
 }
 
-void TAP::convTAPUnitsToCycles()
+void TAP::setPosition(unsigned int pulse)
 {
-	if (tapeFormat == TAPE_FORMAT_MTAP1) {
-		origTapeDelay = readNextTapDelay();
-		tapeDelay = origTapeDelay >> 1;
-		origTapeDelay -= tapeDelay;
+	tapeSoFar = pulse;
+	fallingEdge = false;
+	if (pulse < pulseCount) {
+		edge = startEdge ^ ((pulse & 1) ? 0x10 : 0);
+		pulseLeft = pulses[pulse];
 	} else {
-		tapeDelay = readNextTapDelay();
-		origTapeDelay = readNextTapDelay();
+		edge = startEdge;
+		pulseLeft = 0;
 	}
-	//fprintf(stderr, "New TAP delay value: %u\n", tapeDelay);
+}
+
+bool TAP::seekToBlock(unsigned int block)
+{
+	syncStream();
+	if (block >= blockCount)
+		return false;
+	setPosition(blockStart[block]);
+	return true;
+}
+
+unsigned int TAP::getBlockCount()
+{
+	syncStream();
+	return blockCount;
+}
+
+/*
+	Number of blocks whose pilot tone has been reached
+*/
+unsigned int TAP::getCurrentBlock()
+{
+	unsigned int block = 0;
+
+	syncStream();
+	while (block < blockCount && blockStart[block] <= tapeSoFar)
+		block++;
+	return block;
+}
+
+unsigned char TAP::readCSTIn(ClockCycle cycle)
+{
+	if (motorOn && tapeBuffer) {
+		if (decodeThread)
+			syncStream();
+		ClockCycle elapsed = cycle - lastCycle;
+		while (elapsed >= pulseLeft) {
+			elapsed -= pulseLeft;
+			if (++tapeSoFar >= pulseCount) {
+				// end of tape
+				motorOn = buttonPressed = false;
+				tapeSoFar = pulseCount;
+				pulseLeft = 0;
+				break;
+			}
+			edge ^= 0x10;
+			if (!edge)
+				fallingEdge = true;
+			pulseLeft = pulses[tapeSoFar];
+		}
+		if (motorOn)
+			pulseLeft -= (unsigned int) elapsed;
+		lastCycle = cycle;
+	}
+	return edge;
 }
 
 void TAP::pressTapeButton(ClockCycle cycle, unsigned int pressed)
@@ -291,8 +484,10 @@ void TAP::setTapeMotor(ClockCycle cycle, unsigned int on)
 {
 	if (!on && motorOn)
 		readCSTIn(cycle);
-	else if (on && !motorOn)
+	else if (on && !motorOn) {
+		syncStream();
 		lastCycle = cycle;
+	}
 	motorOn = (on != 0);
 	//fprintf( stderr, "Motor state: %i, in cycle %u\n", motorOn, cycle);
 }
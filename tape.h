@@ -34,31 +34,51 @@ class TAP {
 		char tapefilename[260];
 		unsigned int tapeFileSize;
 		unsigned char *tapeBuffer;
-		unsigned int tapeDelay, origTapeDelay;
 		//
 		ClockCycle lastCycle;
 		unsigned char edge;
 		bool motorOn;
 		unsigned int buttonPressed;
-		void convTAPUnitsToCycles();
-		void readMtapData(unsigned int);
-		void readWavData(unsigned int elapsed);
-		unsigned int readNextTapDelay();
+		unsigned int readNextTapDelay(unsigned int &offset, double frqMult);
 		TapeFormat tapeFormat;
 		bool fallingEdge;
 		unsigned char *tapeHeaderRead;
 		unsigned int tapeImageHeaderSize;
 		unsigned int tapeImageSampleRate;
+		bool attachBuffer(unsigned char *buffer, unsigned int size, const char *name);
+		// the image decoded into half-wave lengths in machine cycles
+		unsigned int *pulses;
+		unsigned int pulseCount;
+		unsigned int pulseLeft;		// cycles until the next edge
+		unsigned char startEdge;	// level of the first half-wave
+		unsigned int streamClock;	// machine clock the stream was decoded for
+		unsigned int *blockStart;	// first half-wave of each pilot tone
+		unsigned int blockCount;
+		SDL_Thread *decodeThread;
+		void decodeStream();
+		void decodeMtap();
+		void decodeWav();
+		void indexBlocks();
+		void startDecoding();
+		void syncStream();
+		void releaseStream();
+		void setPosition(unsigned int pulse);
+		static int decoderThread(void *tap);
 
 	public:
 		TAP();
+		~TAP();
 		class TED *mem;
 		bool attachTape(const char *fname);
+		bool attachTape(const unsigned char *data, unsigned int size, const char *name);
 		bool createTape(const char *fname);
 		bool detachTape();
 		void rewind();
 		void changewave(bool wholewave);
-		unsigned int tapeSoFar;
+		unsigned int tapeSoFar;		// half-waves played
+		bool seekToBlock(unsigned int block);
+		unsigned int getBlockCount();
+		unsigned int getCurrentBlock();
 		//
 		unsigned char readCSTIn(ClockCycle cycle);
 		void writeCSTOut(ClockCycle cycle, unsigned char value);
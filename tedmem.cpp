@@ -53,6 +53,7 @@ unsigned int TED::ff1d_latch;
 bool TED::charPosLatchFlag;
 bool TED::endOfScreen;
 bool TED::delayedDMA;
+bool TED::frameRendered = true;
 TED *TED::instance_;
 unsigned int TED::retraceScanLine;
 char TED::romlopath[4][260];
@@ -413,6 +414,7 @@ unsigned char TED::Read(unsigned int addr)
 						case 0xFE9:
 							if (sidCard) {
 								flushBuffer(CycleCounter, TED_SOUND_CLOCK);
+								sound_sync();
 								return sidCard->read(addr & 0x1f);
 							}
 							return 0xFD;
@@ -834,8 +836,7 @@ void TED::Write(unsigned int addr, unsigned char value)
 						case 0xFE8:
 						case 0xFE9:
 							if (sidCard) {
-								flushBuffer(CycleCounter, TED_SOUND_CLOCK);
-								sidCard->write(addr & 0x1f, value);
+								sidCard->queueWrite(CycleCounter, TED_SOUND_CLOCK, addr & 0x1f, value);
 							}
 							return;
 						case 0xFDD:
@@ -1568,10 +1569,11 @@ void TED::ted_process(const unsigned int continuous)
 			if (!(HBlanking||VBlanking)) {
 				if (SideBorderFlipFlop) { // drawing the visible part of the screen
 					// call the relevant rendering function
-					render();
+					if (frameRendered)
+						render();
 					x = (x + 1) & 0x3F;
 				}
-				if (!CharacterWindow) {
+				if (!CharacterWindow && frameRendered) {
 					// we are on the border area, so use the frame color
 					*((int*)scrptr) = framecol;
 				}
@@ -1656,6 +1658,7 @@ Color TED::getColor(unsigned int ix)
 
 TED::~TED()
 {
+	sound_sync();
 	delete [] screen;
     if (keys) {
         delete keys;
@@ -1870,9 +1873,9 @@ void TEDFAST::ted_process(const unsigned int continuous)
 			ff1d_latch = (beamy + 1) & 0x1FF;
 			newLine();
 			dmaLineBased();
-			//if (isFrameRendered()) {
+			if (isFrameRendered()) {
 				renderLine();
-			//}
+			}
 			// Drives
 			const unsigned int driveStepFactor = 1;
 			const int driveCycles = 64; // 312 * 50 * 64 = 998400 ~= 1 MHz
@@ -1902,9 +1905,9 @@ void TEDFAST::ted_process(const unsigned int continuous)
 			ff1d_latch = (beamy + 1) & 0x1FF;
 			newLine();
 			dmaLineBased();
-			//if (isFrameRendered()) {
+			if (isFrameRendered()) {
 				renderLine();
-			//}
+			}
 			cpuptr->process(clkIx);
 			countTimers(57);
 			CycleCounter += 114;
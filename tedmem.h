@@ -24,7 +24,7 @@
 #define SCR_VSIZE 312
 #define TED_CLOCK (312*114*500)
 #define TED_REAL_CLOCK_M10 17734475
-#define TED_SOUND_CLOCK (TED_CLOCK / 10 )
+#define TED_SOUND_CLOCK (TED_REAL_CLOCK_M10 / 10)	// cycles per second at the real frame rate
 #define TED_REAL_SOUND_CLOCK (TED_REAL_CLOCK_M10 / 10 / 8)
 
 #define TEXTMODE	0x00000000
@@ -38,6 +38,31 @@
 
 class TED;
 class CPU;
+
+// entry point of the KERNAL LOAD routine and its zero page parameters
+struct KernalLoad {
+	unsigned short entry;		// default target of the ILOAD vector
+	unsigned char verifyFlag;
+	unsigned char status;
+	unsigned char device;
+	unsigned char secondaryAddress;
+	unsigned char nameLength;
+	unsigned char namePtr;
+	unsigned char loadAddress;	// used with secondary address 0
+};
+
+// KERNAL serial byte routines and their zero page variables
+struct KernalSerial {
+	unsigned short acptr;		// receive a byte from the talker
+	unsigned short isour;		// send the buffered byte to the listeners
+	unsigned char byteIn;
+	unsigned char byteOut;
+	unsigned char bitCount;
+	unsigned char eoiFlag;		// bit 7 set: send with EOI
+	unsigned char status;
+	unsigned short port;		// serial output port
+	unsigned char lineMask;		// CLK and DATA outputs in the port
+};
 class KEYS;
 class TAP;
 class CTCBM;
@@ -127,18 +152,34 @@ class TED : public CSerial , public MemoryHandler, public SoundSource, public Sa
 	virtual unsigned char *getIrqReg() { return &irqFlag; }
 	virtual unsigned int getSoundClock() { return TED_SOUND_CLOCK; }
 	virtual unsigned int getRealSlowClock() { return TED_REAL_CLOCK_M10 / clockDivisor; }
+	virtual double getFrameRate() { return TED_REAL_CLOCK_M10 / 10.0 / (SCR_VSIZE * 114); }
+	// the same as an exact fraction
+	virtual void getFrameRate(unsigned int &num, unsigned int &den) { num = TED_REAL_CLOCK_M10; den = 10 * SCR_VSIZE * 114; }
 	virtual unsigned int getEmulationLevel() { return 0; }
 	virtual unsigned int getAutostartDelay() { return 70; }
 	virtual unsigned int getHorizontalCount() { return ((98 + beamx) << 1) % 228; }
 	virtual unsigned int getVerticalCount() { return beamy; }
 	virtual unsigned short getEndLoadAddressPtr() { return 0x9D; };
+	virtual const KernalLoad &getKernalLoad() {
+		static const KernalLoad kl = { 0xF04A, 0x93, 0x90, 0xAE, 0xAD, 0xAB, 0xAF, 0xB4 };
+		return kl;
+	}
+	// no serial traps: the Plus/4 reaches its drives through CFakeIEC and the TCBM
+	virtual const KernalSerial &getKernalSerial() {
+		static const KernalSerial ks = { 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+		return ks;
+	}
 	virtual void calcSamples(short *buffer, unsigned int nrsamples);
+	virtual bool isIdle();
 	virtual void setFrequency(unsigned int sid_frequency);
 	virtual void setSampleRate(unsigned int sampleRate_);
 	void setClockStep(unsigned int originalFreq, unsigned int samplingFreq);
 	//
 	static unsigned int sidCardEnabled;
 	static rvar_t tedSettings[];
+	// frameskip: pixel output may be left out for frames that are not presented
+	static void setFrameRendered(bool rendered) { frameRendered = rendered; }
+	static bool isFrameRendered() { return frameRendered; }
 
 private:
 	  KEYS *keys;
@@ -215,6 +256,7 @@ protected:
 	static bool charPosLatchFlag;
 	static bool endOfScreen;
 	static bool delayedDMA;
+	static bool frameRendered;
 	static bool displayEnable;
 	static unsigned int retraceScanLine;
 	//
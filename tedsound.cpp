@@ -1,8 +1,18 @@
+#include <math.h>
 #include "sound.h"
 #include "tedmem.h"
 
 #define PRECISION 4
 #define OSCRELOADVAL (0x3FF << PRECISION)
+// band-limited steps
+#define BLEP_TAPS 16
+#define BLEP_PHASES 32
+#define BLEP_BUFSIZE 32 // power of 2, at least BLEP_TAPS
+#define BLEP_CUTOFF 0.45 // relative to the sample rate
+
+#ifndef M_PI
+#define M_PI 3.1415926535897932384626433832795
+#endif
 
 static int             Volume;
 static int             channelStatus[2];
@@ -20,9 +30,61 @@ static unsigned int		originalFreq;
 static int				volumeTable[64];
 static int				cachedDigiSample;
 static int				cachedSoundSample[2];
+// windowed sinc impulses for an edge at a fraction of a sample ago
+static float			blepKernel[BLEP_PHASES][BLEP_TAPS];
+static float			blepDelta[BLEP_BUFSIZE];
+static unsigned int		blepPos;
+static float			blepIntegrator;
+static int				blepLevel;	// level the queued steps add up to
+
+static void initBlepKernel()
+{
+	for (unsigned int p = 0; p < BLEP_PHASES; p++) {
+		double sum = 0;
+		for (unsigned int k = 0; k < BLEP_TAPS; k++) {
+			const double x = (double) k + (double) p / BLEP_PHASES;
+			const double t = (x - BLEP_TAPS / 2) * 2.0 * BLEP_CUTOFF;
+			const double sinc = t == 0 ? 1.0 : sin(M_PI * t) / (M_PI * t);
+			const double window = 0.42 - 0.5 * cos(2.0 * M_PI * x / BLEP_TAPS)
+				+ 0.08 * cos(4.0 * M_PI * x / BLEP_TAPS);
+			blepKernel[p][k] = (float) (sinc * window);
+			sum += blepKernel[p][k];
+		}
+		// every step must add up to exactly its height
+		for (unsigned int k = 0; k < BLEP_TAPS; k++)
+			blepKernel[p][k] = (float) (blepKernel[p][k] / sum);
+	}
+	for (unsigned int i = 0; i < BLEP_BUFSIZE; i++)
+		blepDelta[i] = 0;
+	blepPos = 0;
+	blepIntegrator = 0;
+	blepLevel = 0;
+}
+
+// a step of 'delta' that happened 'ago' (in 1/oscStep units) before the current sample
+inline static void addStep(int delta, int ago)
+{
+	unsigned int phase = ago * BLEP_PHASES / oscStep;
+	if (phase >= BLEP_PHASES)
+		phase = BLEP_PHASES - 1;
+	const float *kernel = blepKernel[phase];
+	for (unsigned int k = 0; k < BLEP_TAPS; k++)
+		blepDelta[(blepPos + k) & (BLEP_BUFSIZE - 1)] += delta * kernel[k];
+	blepLevel += delta;
+}
+
+inline static short nextSample()
+{
+	blepIntegrator += blepDelta[blepPos];
+	blepDelta[blepPos] = 0;
+	blepPos = (blepPos + 1) & (BLEP_BUFSIZE - 1);
+	const int output = (int) floor(blepIntegrator + 0.5f);
+	return output > 32767 ? 32767 : (output < -32768 ? -32768 : output);
+}
 
 void TED::tedSoundInit(unsigned int mixingFreq)
 {
+	sound_sync();
 	originalFreq = TED_SOUND_CLOCK / 8;
 	MixingFreq = mixingFreq;
 	setClockStep(originalFreq, MixingFreq);
@@ -32,6 +94,7 @@ void TED::tedSoundInit(unsigned int mixingFreq)
 	Freq[0] = Freq[1] = 0;
 	DAStatus = cachedDigiSample = 0;
 	cachedSoundSample[0] = cachedSoundSample[1] = 0;
+	initBlepKernel();
 
 	/* initialise im with 0xa8 */
 	int im = 0xa8;
@@ -51,49 +114,90 @@ void TED::setClockStep(unsigned int originalFreq, unsigned int samplingFreq)
 
 void TED::setFrequency(unsigned int frequency)
 {
+	sound_sync();
 	originalFreq = frequency;
 	setClockStep(frequency, MixingFreq);
 }
 
 void TED::setSampleRate(unsigned int sampleRate)
 {
+	sound_sync();
 	MixingFreq = sampleRate;
 	setClockStep(originalFreq, sampleRate);
 }
 
+/*
+	Edges are placed at their exact position between two output samples as
+	band-limited steps, so the square waves do not alias even at 48 kHz.
+*/
 void TED::calcSamples(short *buffer, unsigned int nrsamples)
 {
-    // Rendering...
+	// level changes by register writes land on the sample boundary
+	const int level = DAStatus ? cachedDigiSample : cachedSoundSample[0] + cachedSoundSample[1];
+	if (level != blepLevel)
+		addStep(level - blepLevel, 0);
+
+	// Rendering...
 	// Calculate the buffer...
 	if (DAStatus) {// digi?
 		for (;nrsamples--;) {
-			*buffer++ = cachedDigiSample;
+			*buffer++ = nextSample();
 		}
 	} else {
 		for (;nrsamples--;) {
 			// Channel 1
-			if ((oscCount[0] += oscStep) >= OSCRELOADVAL) {
-				if (OscReload[0] != (0x3FF << PRECISION)) {
+			if (OscReload[0] == OSCRELOADVAL) {
+				// frequency $3FE, the output is held
+				oscCount[0] = OSCRELOADVAL;
+			} else {
+				oscCount[0] += oscStep;
+				while (oscCount[0] >= OSCRELOADVAL) {
+					const int ago = oscCount[0] - OSCRELOADVAL;
 					FlipFlop ^= 0x10;
-					cachedSoundSample[0] = volumeTable[Volume | (FlipFlop & channelStatus[0])];
+					const int sample = volumeTable[Volume | (FlipFlop & channelStatus[0])];
+					if (sample != cachedSoundSample[0]) {
+						addStep(sample - cachedSoundSample[0], ago);
+						cachedSoundSample[0] = sample;
+					}
+					oscCount[0] = OscReload[0] + ago;
 				}
-				oscCount[0] = OscReload[0] + (oscCount[0] - OSCRELOADVAL);
 			}
 			// Channel 2
-			if ((oscCount[1] += oscStep) >= OSCRELOADVAL) {
-				if (OscReload[1] != (0x3FF << PRECISION)) {
+			if (OscReload[1] == OSCRELOADVAL) {
+				oscCount[1] = OSCRELOADVAL;
+			} else {
+				oscCount[1] += oscStep;
+				while (oscCount[1] >= OSCRELOADVAL) {
+					const int ago = oscCount[1] - OSCRELOADVAL;
 					FlipFlop ^= 0x20;
 					if (++NoiseCounter == 256)
 						NoiseCounter = 0;
-					cachedSoundSample[1] = volumeTable[Volume | (FlipFlop & channelStatus[1]) | (noise[NoiseCounter] & SndNoiseStatus)];
+					const int sample = volumeTable[Volume | (FlipFlop & channelStatus[1]) | (noise[NoiseCounter] & SndNoiseStatus)];
+					if (sample != cachedSoundSample[1]) {
+						addStep(sample - cachedSoundSample[1], ago);
+						cachedSoundSample[1] = sample;
+					}
+					oscCount[1] = OscReload[1] + ago;
 				}
-				oscCount[1] = OscReload[1] + (oscCount[1] - OSCRELOADVAL);
 			}
-			*buffer++ = cachedSoundSample[0] + cachedSoundSample[1];
+			*buffer++ = nextSample();
 		}   // for
 	}
 }
 
+// muted and no band-limited step still ringing out
+bool TED::isIdle()
+{
+	if (DAStatus ? cachedDigiSample : (Volume || cachedSoundSample[0] || cachedSoundSample[1]))
+		return false;
+	if (blepLevel || blepIntegrator > 0.5f || blepIntegrator < -0.5f)
+		return false;
+	for (unsigned int i = 0; i < BLEP_BUFSIZE; i++)
+		if (blepDelta[i] != 0)
+			return false;
+	return true;
+}
+
 inline void setFreq(unsigned int channel, int freq)
 {
 	if (freq == 0x3FE) {
@@ -106,10 +210,9 @@ inline void setFreq(unsigned int channel, int freq)
 	OscReload[channel] = ((freq + 1) & 0x3FF) << PRECISION;
 }
 
-void TED::writeSoundReg(ClockCycle cycle, unsigned int reg, unsigned char value)
+// runs on the synthesis thread
+static void applySoundReg(void *, unsigned int reg, unsigned char value)
 {
-	flushBuffer(cycle, TED_SOUND_CLOCK);
-
 	switch (reg) {
 		case 0:
 			Freq[0] = (Freq[0] & 0x300) | value;
@@ -145,3 +248,8 @@ void TED::writeSoundReg(ClockCycle cycle, unsigned int reg, unsigned char value)
 	}
 }
 
+void TED::writeSoundReg(ClockCycle cycle, unsigned int reg, unsigned char value)
+{
+	sound_write_reg(cycle, TED_SOUND_CLOCK, applySoundReg, NULL, reg, value);
+}
+
@@ -146,6 +146,7 @@ void Vic2mem::Reset(bool clearmem)
 	memset(spriteCollisions, 0, sizeof(spriteCollisions));
 	memset(spriteBckgColl, 0, sizeof(spriteBckgColl));
 	spriteBckgCollReg = spriteCollisionReg = 0;
+	spriteLineActive = false;
 	//
 	vicBusAccessCycleStart = spriteDMAmask = 0;
 	for (int i = 0; i < 8; i++) {
@@ -582,6 +583,7 @@ unsigned char Vic2mem::Read(unsigned int addr)
 					case 0xD7:
 						if (sidCard) {
 							flushBuffer(CycleCounter, VIC_SOUND_CLOCK);
+							sound_sync();
 							return sidCard->read(addr & 0x1F);
 						}
 						return 0xD4;
@@ -872,8 +874,7 @@ skip:
 					case 0xD6:
 					case 0xD7:
 						if (sidCard) {
-							flushBuffer(CycleCounter, VIC_SOUND_CLOCK);
-							sidCard->write(addr & 0x1f, value);
+							sidCard->queueWrite(CycleCounter, VIC_SOUND_CLOCK, addr & 0x1f, value);
 						}
 						return;
 					case 0xD8: // Color RAM
@@ -954,6 +955,15 @@ void Vic2mem::doHRetrace()
 		drawSpritesPerLine(sPtr);
 	// the beam reached a new line
 	sPtr = scrptr;
+	// sprite-background collisions need the background pixels
+	// of the next line even if the frame is skipped
+	spriteLineActive = false;
+	for(unsigned int i = 0; i < 8; i++) {
+		if (mob[i].dmaState || mob[i].rendering) {
+			spriteLineActive = true;
+			break;
+		}
+	}
 }
 
 inline void Vic2mem::newLine()
@@ -1224,12 +1234,14 @@ void Vic2mem::ted_process(const unsigned int continuous)
 
 		// drawing the visible part of the screen
 		if (!(HBlanking |VBlanking)) {
+			const bool lineRendered = frameRendered || spriteLineActive;
 			if (SideBorderFlipFlop) {
 				// call the relevant rendering function
-				render();
+				if (lineRendered)
+					render();
 				x = (x + 1) & 0x3F;
 			}
-			if (!CharacterWindow) {
+			if (!CharacterWindow && lineRendered) {
 				// we are on the border area, so use the frame color
 				*((int*)scrptr) = framecol;
 				*((int*)(scrptr + 4)) = framecol;
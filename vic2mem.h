@@ -10,7 +10,7 @@ struct Color;
 #define FAST_BOOT 1
 #define VIC_PIXELS_PER_ROW 504
 #define VIC_REAL_CLOCK_M10 9852480 // 9852480 19704960
-#define VIC_SOUND_CLOCK (312*63*50)
+#define VIC_SOUND_CLOCK (VIC_REAL_CLOCK_M10 / 10)	// cycles per second at the real frame rate
 #define VIC_REAL_SOUND_CLOCK (VIC_REAL_CLOCK_M10 / 8 / 10)
 
 class Vic2mem : public TED
@@ -35,6 +35,8 @@ class Vic2mem : public TED
 		virtual void copyToKbBuffer(const char *text, unsigned int length = 0);
 		virtual unsigned int getSoundClock() { return VIC_SOUND_CLOCK; }
 		virtual unsigned int getRealSlowClock() { return VIC_REAL_CLOCK_M10 / 10; }
+		virtual double getFrameRate() { return VIC_REAL_CLOCK_M10 / 10.0 / (312 * 63); }
+		virtual void getFrameRate(unsigned int &num, unsigned int &den) { num = VIC_REAL_CLOCK_M10; den = 10 * 312 * 63; }
 		virtual unsigned int getEmulationLevel() { return 2; }
 #if !FAST_BOOT
 		virtual unsigned int getAutostartDelay() { return 175; }
@@ -42,6 +44,14 @@ class Vic2mem : public TED
 		virtual unsigned int getAutostartDelay() { return 50; }
 #endif
 		virtual unsigned short getEndLoadAddressPtr() { return 0xAE; };
+		virtual const KernalLoad &getKernalLoad() {
+			static const KernalLoad kl = { 0xF4A5, 0x93, 0x90, 0xBA, 0xB9, 0xB7, 0xBB, 0xC3 };
+			return kl;
+		}
+		virtual const KernalSerial &getKernalSerial() {
+			static const KernalSerial ks = { 0xEE13, 0xED40, 0xA4, 0x95, 0xA5, 0xA3, 0x90, 0xDD00, 0x30 };
+			return ks;
+		}
 		virtual unsigned int getHorizontalCount() { return beamx; }
 		// this is for the savestate support
 		virtual void dumpState();
@@ -83,6 +93,7 @@ class Vic2mem : public TED
 		unsigned char spriteCollisions[512 + 48];
 		unsigned char spriteBckgColl[512 + 48];
 		unsigned char collisionLookup[256];
+		bool spriteLineActive;
 		unsigned char mobExtCol[4];
 		void renderSprite(unsigned char *in, unsigned char *out, Mob &m, unsigned int cx, const unsigned int six);
 		void drawSpritesPerLine(unsigned char *lineBuf);
@@ -31,6 +31,7 @@ static unsigned int videoSaturation = 100;
 static unsigned int videoBrightness = 100;
 static int videoHueOffset = 0;
 static unsigned int videoGammaCorrection = 0;
+static unsigned int videoVersion = 0;
 
 static double gammaCorr(double in)
 {
@@ -79,6 +80,7 @@ void init_palette(TED *videoChip)
 #endif
 		yuvPalette[ix + 128] = yuvPalette[ix];
 	}
+	videoVersion++;
 }
 
 unsigned int *palette_get_rgb()
@@ -86,10 +88,22 @@ unsigned int *palette_get_rgb()
 	return palette;
 }
 
+Yuv *palette_get_yuv()
+{
+	return yuvPalette;
+}
+
+// changes whenever the same screen would convert to different output
+unsigned int video_get_version()
+{
+	return videoVersion;
+}
+
 static void flipInterlacedShade(void *none)
 {
 	interlacedShade = interlacedShade + 15;
 	if (interlacedShade > 100) interlacedShade = 10;
+	videoVersion++;
 }
 
 static void flipVideoSaturation(void *none)
@@ -128,7 +142,8 @@ rvar_t videoSettings[] = {
 	{ "", "", NULL, NULL, RVAR_NULL, NULL }
 };
 
-void video_convert_buffer(unsigned int *pImage, unsigned int srcpitch, unsigned char *screenptr)
+void video_convert_buffer(unsigned int *pImage, unsigned int srcpitch, unsigned char *screenptr,
+	unsigned int firstLine, unsigned int lineCount)
 {
 	int i;
 	int Uc[4], Vc[4], Up[4], Vp[4];
@@ -136,12 +151,22 @@ void video_convert_buffer(unsigned int *pImage, unsigned int srcpitch, unsigned
     const Yuv *yuvLookup = yuvPalette;
 	const int interlace = 0;
 //	const int thisFrameInterlaced = !evenFrame && doubleScan ? 1 : 0;
-	unsigned char *fb = screenptr;
-	unsigned char *prevLine = fb;
+	unsigned char *fb = screenptr + firstLine * srcpitch;
+	unsigned char *prevLine = firstLine ? fb - srcpitch : fb;
 
-    i = SCREENY; /// 2;
+	pImage += firstLine * srcpitch * (doubleScan + 1);
+    i = lineCount; /// 2;
 
     Up[0] = Up[1] = Up[2] = Up[3] = Vp[0] = Vp[1] = Vp[2] = Vp[3] = 0;
+	if (firstLine) {
+		// carry in the chroma a full conversion leaves from the row above,
+		// that is the last pixels of the line before it
+		const unsigned char *seedLine = screenptr + (firstLine >= 2 ? firstLine - 2 : 0) * srcpitch;
+		for (int x = SCREENX - 2; x <= SCREENX + 1; x++) {
+			Up[x & 3] = yuvLookup[seedLine[x]].u;
+			Vp[x & 3] = yuvLookup[seedLine[x]].v;
+		}
+	}
     do {
         int k = doubleScan & !interlace;
         do {
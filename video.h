@@ -27,5 +27,8 @@ struct Color {
 
 extern void init_palette(TED *videoChip);
 extern unsigned int *palette_get_rgb();
-extern void video_convert_buffer(unsigned int *pImage, unsigned int srcpitch, unsigned char *screenptr);
+extern Yuv *palette_get_yuv();
+extern unsigned int video_get_version();
+extern void video_convert_buffer(unsigned int *pImage, unsigned int srcpitch, unsigned char *screenptr,
+	unsigned int firstLine = 0, unsigned int lineCount = SCREENY);
 extern rvar_t videoSettings[];